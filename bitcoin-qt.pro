@@ -181,6 +181,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
+    src/blockfilter.h \
+    src/muhash.h \
     src/bloom.h \
     src/mruset.h \
     src/checkqueue.h \
@@ -272,6 +274,8 @@ SOURCES += src/qt/bitcoin.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/blockfilter.cpp \
+    src/muhash.cpp \
     src/bloom.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
@@ -0,0 +1,245 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "uint256.h"
+#include "serialize.h"
+#include "script.h"
+
+// Kinds of scripts the address index knows about
+enum AddressIndexType
+{
+    ADDRESS_INDEX_PUBKEYHASH = 1,   // pay-to-pubkey(-hash), keyed by the key ID
+    ADDRESS_INDEX_SCRIPTHASH = 2,   // pay-to-script-hash, keyed by the script ID
+};
+
+/** Get the address index kind and hash a script pays to; false if it isn't indexed */
+inline bool GetAddressIndexDestination(const CScript& scriptPubKey, int& nType, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID *keyID = boost::get<CKeyID>(&dest)) {
+        nType = ADDRESS_INDEX_PUBKEYHASH;
+        hashBytes = *keyID;
+        return true;
+    }
+    if (const CScriptID *scriptID = boost::get<CScriptID>(&dest)) {
+        nType = ADDRESS_INDEX_SCRIPTHASH;
+        hashBytes = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+// Heights and positions in index keys are stored big-endian, so that
+// LevelDB's byte order iterates an address's history in chain order
+template<typename Stream>
+inline void WriteIndexBE32(Stream& s, unsigned int n)
+{
+    unsigned char pch[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+    s.write((char*)pch, 4);
+}
+
+template<typename Stream>
+inline unsigned int ReadIndexBE32(Stream& s)
+{
+    unsigned char pch[4];
+    s.read((char*)pch, 4);
+    return ((unsigned int)pch[0] << 24) | ((unsigned int)pch[1] << 16) | ((unsigned int)pch[2] << 8) | pch[3];
+}
+
+/** An amount an address received (positive) or spent (negative), in the address index */
+struct CAddressIndexKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+    int nHeight;
+    unsigned int nTxIndex;      // position of the transaction in its block
+    uint256 txhash;
+    unsigned int nIndex;        // output index, or input index if fSpending
+    bool fSpending;
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddressIndexKey(int nTypeIn, const uint160& hashBytesIn, int nHeightIn, unsigned int nTxIndexIn,
+                     const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), nHeight(nHeightIn), nTxIndex(nTxIndexIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    void SetNull()
+    {
+        nType = 0;
+        hashBytes = 0;
+        nHeight = 0;
+        nTxIndex = 0;
+        txhash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    unsigned int GetSerializeSize(int nSerType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nSerType, int nVersion) const
+    {
+        s << nType << hashBytes;
+        WriteIndexBE32(s, nHeight);
+        WriteIndexBE32(s, nTxIndex);
+        s << txhash << nIndex << fSpending;
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nSerType, int nVersion)
+    {
+        s >> nType >> hashBytes;
+        nHeight = ReadIndexBE32(s);
+        nTxIndex = ReadIndexBE32(s);
+        s >> txhash >> nIndex >> fSpending;
+    }
+};
+
+/** Prefix of CAddressIndexKey, to seek to the history of an address from a given height */
+struct CAddressIndexIteratorKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+    int nHeight;
+
+    CAddressIndexIteratorKey(int nTypeIn, const uint160& hashBytesIn, int nHeightIn = 0) :
+        nType(nTypeIn), hashBytes(hashBytesIn), nHeight(nHeightIn) {}
+
+    unsigned int GetSerializeSize(int nSerType, int nVersion) const
+    {
+        return 1 + 20 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nSerType, int nVersion) const
+    {
+        s << nType << hashBytes;
+        WriteIndexBE32(s, nHeight);
+    }
+};
+
+/** An unspent output of an address, in the address index */
+struct CAddressUnspentKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey()
+    {
+        nType = 0;
+        hashBytes = 0;
+        txhash = 0;
+        nIndex = 0;
+    }
+
+    CAddressUnspentKey(int nTypeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+/** Prefix of CAddressUnspentKey, to seek to the unspent outputs of an address */
+struct CAddressUnspentIteratorKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+
+    CAddressUnspentIteratorKey(int nTypeIn, const uint160& hashBytesIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nType);
+        READWRITE(hashBytes);
+    )
+};
+
+struct CAddressUnspentValue
+{
+    int64 nValue;               // -1 marks an entry to erase
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue()
+    {
+        SetNull();
+    }
+
+    CAddressUnspentValue(int64 nValueIn, const CScript& scriptIn, int nHeightIn) :
+        nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) {}
+
+    void SetNull()
+    {
+        nValue = -1;
+        script.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nValue == -1;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    )
+};
+
+/** An amount a memory pool transaction pays to (positive) or spends from (negative) an address */
+struct CMempoolAddressDeltaKey
+{
+    int nType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CMempoolAddressDeltaKey(int nTypeIn, const uint160& hashBytesIn, const uint256& txhashIn = 0, unsigned int nIndexIn = 0, bool fSpendingIn = false) :
+        nType(nTypeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    friend bool operator<(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b)
+    {
+        if (a.nType != b.nType)
+            return a.nType < b.nType;
+        if (a.hashBytes != b.hashBytes)
+            return a.hashBytes < b.hashBytes;
+        if (a.txhash != b.txhash)
+            return a.txhash < b.txhash;
+        if (a.nIndex != b.nIndex)
+            return a.nIndex < b.nIndex;
+        return a.fSpending < b.fSpending;
+    }
+};
+
+struct CMempoolAddressDelta
+{
+    int64 nTime;
+    int64 nAmount;
+    uint256 prevhash;           // the output spent, if spending
+    unsigned int nPrevOut;
+
+    CMempoolAddressDelta(int64 nTimeIn = 0, int64 nAmountIn = 0, const uint256& prevhashIn = 0, unsigned int nPrevOutIn = 0) :
+        nTime(nTimeIn), nAmount(nAmountIn), prevhash(prevhashIn), nPrevOut(nPrevOutIn) {}
+};
+
+#endif // BITCOIN_ADDRESSINDEX_H
@@ -5,6 +5,8 @@
 #include "addrman.h"
 #include "hash.h"
 
+#include <algorithm>
+
 using namespace std;
 
 int CAddrInfo::GetTriedBucket(const std::vector<unsigned char> &nKey) const
@@ -387,9 +389,9 @@ void CAddrMan::Attempt_(const CService &addr, int64 nTime)
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddress CAddrMan::Select_(int nUnkBias) const
 {
-    if (size() == 0)
+    if (vRandom.empty())
         return CAddress();
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
@@ -401,11 +403,12 @@ CAddress CAddrMan::Select_(int nUnkBias)
         while(1)
         {
             int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
+            const std::vector<int> &vTried = vvTried[nKBucket];
             if (vTried.size() == 0) continue;
             int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
+            std::map<int, CAddrInfo>::const_iterator itInfo = mapInfo.find(vTried[nPos]);
+            assert(itInfo != mapInfo.end());
+            const CAddrInfo &info = (*itInfo).second;
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -416,14 +419,15 @@ CAddress CAddrMan::Select_(int nUnkBias)
         while(1)
         {
             int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
+            const std::set<int> &vNew = vvNew[nUBucket];
             if (vNew.size() == 0) continue;
             int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
+            std::set<int>::const_iterator it = vNew.begin();
             while (nPos--)
                 it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
+            std::map<int, CAddrInfo>::const_iterator itInfo = mapInfo.find(*it);
+            assert(itInfo != mapInfo.end());
+            const CAddrInfo &info = (*itInfo).second;
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -431,79 +435,83 @@ CAddress CAddrMan::Select_(int nUnkBias)
     }
 }
 
-#ifdef DEBUG_ADDRMAN
-int CAddrMan::Check_()
+int CAddrMan::Check_(unsigned int nEntries, unsigned int nBuckets)
 {
-    std::set<int> setTried;
-    std::map<int, int> mapNew;
-
-    if (vRandom.size() != nTried + nNew) return -7;
+    if (vRandom.size() != (unsigned int)(nTried + nNew)) return -7;
+    if (mapInfo.size() != vRandom.size()) return -9;
+    if (mapAddr.size() != vRandom.size()) return -10;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    // the next nEntries entries, in vRandom order
+    for (unsigned int i = 0; i < nEntries && i < vRandom.size(); i++)
     {
-        int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        if (nCheckRandomPos >= vRandom.size())
+            nCheckRandomPos = 0;
+        int n = vRandom[nCheckRandomPos];
+        std::map<int, CAddrInfo>::const_iterator it = mapInfo.find(n);
+        if (it == mapInfo.end()) return -9;
+        const CAddrInfo &info = (*it).second;
         if (info.fInTried)
         {
-
             if (!info.nLastSuccess) return -1;
             if (info.nRefCount) return -2;
-            setTried.insert(n);
+            const std::vector<int> &vTried = vvTried[info.GetTriedBucket(nKey)];
+            if (std::find(vTried.begin(), vTried.end(), n) == vTried.end()) return -11;
         } else {
             if (info.nRefCount < 0 || info.nRefCount > ADDRMAN_NEW_BUCKETS_PER_ADDRESS) return -3;
             if (!info.nRefCount) return -4;
-            mapNew[n] = info.nRefCount;
+            int nRefs = 0;
+            for (unsigned int b = 0; b < vvNew.size(); b++)
+                nRefs += vvNew[b].count(n);
+            if (nRefs != info.nRefCount) return -12;
         }
-        if (mapAddr[info] != n) return -5;
-        if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
+        std::map<CNetAddr, int>::const_iterator itAddr = mapAddr.find(info);
+        if (itAddr == mapAddr.end() || (*itAddr).second != n) return -5;
+        if (info.nRandomPos != (int)nCheckRandomPos) return -14;
         if (info.nLastTry < 0) return -6;
         if (info.nLastSuccess < 0) return -8;
+        nCheckRandomPos++;
     }
 
-    if (setTried.size() != nTried) return -9;
-    if (mapNew.size() != nNew) return -10;
-
-    for (int n=0; n<vvTried.size(); n++)
+    // the next nBuckets buckets of each kind may only hold entries of their kind
+    for (unsigned int i = 0; i < nBuckets; i++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        nCheckBucket = (nCheckBucket + 1) % (ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_TRIED_BUCKET_COUNT);
+        const std::vector<int> &vTried = vvTried[nCheckBucket % ADDRMAN_TRIED_BUCKET_COUNT];
+        for (std::vector<int>::const_iterator it = vTried.begin(); it != vTried.end(); it++)
         {
-            if (!setTried.count(*it)) return -11;
-            setTried.erase(*it);
+            std::map<int, CAddrInfo>::const_iterator itInfo = mapInfo.find(*it);
+            if (itInfo == mapInfo.end() || !(*itInfo).second.fInTried) return -13;
         }
-    }
-
-    for (int n=0; n<vvNew.size(); n++)
-    {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        const std::set<int> &vNew = vvNew[nCheckBucket % ADDRMAN_NEW_BUCKET_COUNT];
+        for (std::set<int>::const_iterator it = vNew.begin(); it != vNew.end(); it++)
         {
-            if (!mapNew.count(*it)) return -12;
-            if (--mapNew[*it] == 0)
-                mapNew.erase(*it);
+            std::map<int, CAddrInfo>::const_iterator itInfo = mapInfo.find(*it);
+            if (itInfo == mapInfo.end() || (*itInfo).second.fInTried) return -15;
         }
     }
 
-    if (setTried.size()) return -13;
-    if (mapNew.size()) return -15;
-
     return 0;
 }
-#endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
+void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr) const
 {
     int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
+    // perform a random shuffle over the first nNodes positions of vRandom (selecting from all),
+    // keeping only the swapped positions aside so that vRandom itself stays untouched
+    std::map<int, int> mapSwapped;
     for (int n = 0; n<nNodes; n++)
     {
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        std::map<int, int>::iterator itRnd = mapSwapped.find(nRndPos);
+        int nId = (itRnd == mapSwapped.end()) ? vRandom[nRndPos] : (*itRnd).second;
+        std::map<int, int>::iterator itN = mapSwapped.find(n);
+        mapSwapped[nRndPos] = (itN == mapSwapped.end()) ? vRandom[n] : (*itN).second;
+        std::map<int, CAddrInfo>::const_iterator it = mapInfo.find(nId);
+        assert(it != mapInfo.end());
+        vAddr.push_back((*it).second);
     }
 }
 
@@ -13,6 +13,9 @@
 #include <map>
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -116,8 +119,10 @@ public:
 //        tried ones) is evicted from it, back to the "new" buckets.
 //    * Bucket selection is based on cryptographic hashing, using a randomly-generated 256-bit key, which should not
 //      be observable by adversaries.
-//    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
-//      consistency checks for the entire data structure.
+//    * Several indexes are kept for high performance. SetCheckEntries() turns on consistency checks, which verify
+//      a few entries and buckets per operation, so that the entire data structure is covered over time.
+//  * Selecting and returning addresses only read the tables, and share the lock with each other and with dumping
+//    the tables to disk. Adding addresses takes it exclusively, per ADDRMAN_ADD_BATCH addresses.
 
 // total number of buckets for tried addresses
 #define ADDRMAN_TRIED_BUCKET_COUNT 64
@@ -161,12 +166,15 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// how many addresses of an addr message are added per exclusive lock
+#define ADDRMAN_ADD_BATCH 100
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
 private:
-    // critical section to protect the inner data structures
-    mutable CCriticalSection cs;
+    // protects the inner data structures; shared by the operations that only read them
+    mutable boost::shared_mutex cs;
 
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
@@ -195,6 +203,16 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // number of changes so far, so unchanged tables need not be dumped again
+    uint64 nModifications;
+
+    // number of entries Check() verifies per operation (0 = no checks)
+    int nCheckEntries;
+
+    // where the next Check() continues in vRandom and in the buckets
+    unsigned int nCheckRandomPos;
+    unsigned int nCheckBucket;
+
 protected:
 
     // Find an entry.
@@ -230,15 +248,14 @@ protected:
 
     // Select an address to connect to.
     // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
+    CAddress Select_(int nUnkBias) const;
 
-#ifdef DEBUG_ADDRMAN
-    // Perform consistency check. Returns an error code or zero.
-    int Check_();
-#endif
+    // Perform consistency check of nEntries entries and nBuckets buckets of each kind,
+    // continuing where the previous check stopped. Returns an error code or zero.
+    int Check_(unsigned int nEntries, unsigned int nBuckets);
 
     // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    void GetAddr_(std::vector<CAddress> &vAddr) const;
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
@@ -268,7 +285,13 @@ public:
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
         {
-            LOCK(cs);
+            // dumping only reads the tables, so it doesn't hold up Select() or GetAddr()
+            boost::shared_lock<boost::shared_mutex> lockRead(cs, boost::defer_lock);
+            boost::unique_lock<boost::shared_mutex> lockWrite(cs, boost::defer_lock);
+            if (fWrite)
+                lockRead.lock();
+            else
+                lockWrite.lock();
             unsigned char nVersion = 0;
             READWRITE(nVersion);
             READWRITE(nKey);
@@ -387,55 +410,89 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         nModifications = 0;
+         nCheckEntries = 0;
+         nCheckRandomPos = 0;
+         nCheckBucket = 0;
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
+        boost::shared_lock<boost::shared_mutex> lock(cs);
         return vRandom.size();
     }
 
-    // Consistency check
+    // Return the number of changes made to the tables so far.
+    uint64 GetModifications() const
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        return nModifications;
+    }
+
+    // Verify nEntries entries and a bucket of each kind on every change (0 = off).
+    void SetCheckEntries(int nEntries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        nCheckEntries = std::max(nEntries, 0);
+    }
+
+    // Incremental consistency check; requires an exclusive lock on cs
     void Check()
     {
-#ifdef DEBUG_ADDRMAN
-        {
-            LOCK(cs);
-            int err;
-            if ((err=Check_()))
-                printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
-        }
-#endif
+        if (nCheckEntries == 0)
+            return;
+        int err;
+        if ((err=Check_(nCheckEntries, 1)))
+            printf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
+    }
+
+    // Consistency check of the entire data structure. Returns an error code or zero.
+    int CheckAll()
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        return Check_(vRandom.size(), std::max(ADDRMAN_NEW_BUCKET_COUNT, ADDRMAN_TRIED_BUCKET_COUNT));
     }
 
     // Add a single address.
     bool Add(const CAddress &addr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
         bool fRet = false;
+        int nTriedNow, nNewNow;
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
+            nModifications++;
             Check();
+            nTriedNow = nTried;
+            nNewNow = nNew;
         }
         if (fRet)
-            printf("Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort().c_str(), source.ToString().c_str(), nTried, nNew);
+            printf("Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort().c_str(), source.ToString().c_str(), nTriedNow, nNewNow);
         return fRet;
     }
 
     // Add multiple addresses.
+    // The lock is released every ADDRMAN_ADD_BATCH addresses, so that selecting
+    // outbound connections doesn't wait for a whole addr flood to be processed.
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
         int nAdd = 0;
+        int nTriedNow = 0, nNewNow = 0;
+        for (unsigned int i = 0; i < vAddr.size(); i += ADDRMAN_ADD_BATCH)
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
-            for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-                nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            for (unsigned int j = i; j < vAddr.size() && j < i + ADDRMAN_ADD_BATCH; j++)
+                nAdd += Add_(vAddr[j], source, nTimePenalty) ? 1 : 0;
+            nModifications++;
             Check();
+            nTriedNow = nTried;
+            nNewNow = nNew;
         }
         if (nAdd)
-            printf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTried, nNew);
+            printf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTriedNow, nNewNow);
         return nAdd > 0;
     }
 
@@ -443,9 +500,10 @@ public:
     void Good(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Good_(addr, nTime);
+            nModifications++;
             Check();
         }
     }
@@ -454,37 +512,34 @@ public:
     void Attempt(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Attempt_(addr, nTime);
+            nModifications++;
             Check();
         }
     }
 
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
-    CAddress Select(int nUnkBias = 50)
+    CAddress Select(int nUnkBias = 50) const
     {
         CAddress addrRet;
         {
-            LOCK(cs);
-            Check();
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             addrRet = Select_(nUnkBias);
-            Check();
         }
         return addrRet;
     }
 
     // Return a bunch of addresses, selected at random.
-    std::vector<CAddress> GetAddr()
+    std::vector<CAddress> GetAddr() const
     {
-        Check();
         std::vector<CAddress> vAddr;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             GetAddr_(vAddr);
         }
-        Check();
         return vAddr;
     }
 
@@ -492,9 +547,10 @@ public:
     void Connected(const CService &addr, int64 nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Connected_(addr, nTime);
+            nModifications++;
             Check();
         }
     }
@@ -204,6 +204,8 @@ static const CRPCCommand vRPCCommands[] =
     { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
     { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
     { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
+    { "getmessagetimings",      &getmessagetimings,      true,      true,       false },
+    { "getnettraffic",          &getnettraffic,          true,      true,       false },
     { "addnode",                &addnode,                true,      true,       false },
     { "masternode",             &masternode,             false,     false,      true },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
@@ -239,6 +241,7 @@ static const CRPCCommand vRPCCommands[] =
     { "createmultisig",         &createmultisig,         true,      true ,      false },
     { "getrawmempool",          &getrawmempool,          true,      false,      false },
     { "getblock",               &getblock,               false,     false,      false },
+    { "getblockfilter",         &getblockfilter,         false,     false,      false },
     { "getblockhash",           &getblockhash,           false,     false,      false },
     { "gettransaction",         &gettransaction,         false,     false,      true },
     { "listtransactions",       &listtransactions,       false,     false,      true },
@@ -266,10 +269,21 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "getflushinfo",           &getflushinfo,           true,      false,      false },
+    { "dumptxoutset",           &dumptxoutset,           true,      true,       false },
+    { "loadtxoutset",           &loadtxoutset,           false,     true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
+    { "getaddressbalance",      &getaddressbalance,      true,      false,      false },
+    { "getaddressutxos",        &getaddressutxos,        true,      false,      false },
+    { "getaddresstxids",        &getaddresstxids,        true,      false,      false },
+    { "getaddressmempool",      &getaddressmempool,      true,      false,      false },
+    { "getspentinfo",           &getspentinfo,           true,      false,      false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
+    { "getverificationinfo",    &getverificationinfo,    true,      true,       false },
+    { "getleveldbinfo",         &getleveldbinfo,         true,      true,       false },
+    { "compactleveldb",         &compactleveldb,         true,      true,       false },
 };
 
 CRPCTable::CRPCTable()
@@ -1152,6 +1166,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     //
     if (strMethod == "stop"                   && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getaddednodeinfo"       && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getnettraffic"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "setgenerate"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getnetworkhashps"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -1194,6 +1209,19 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    // the address index calls take one address, or a JSON array of them
+    bool fAddressArray = n > 0 && !strParams[0].empty() && strParams[0][0] == '[';
+    if (strMethod == "getaddressbalance"      && fAddressArray) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddressutxos"        && fAddressArray) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && fAddressArray) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddressmempool"      && fAddressArray) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddressutxos"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddressutxos"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddresstxids"        && n > 3) ConvertTo<boost::int64_t>(params[3]);
+    if (strMethod == "getaddresstxids"        && n > 4) ConvertTo<boost::int64_t>(params[4]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
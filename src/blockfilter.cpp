@@ -0,0 +1,241 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <algorithm>
+#include <set>
+
+#include "blockfilter.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// High 64 bits of x * n, which maps a uniform 64-bit hash into [0, n)
+// without a modulo (and without 128-bit integers, which not all of our
+// compilers have)
+static uint64 MapIntoRange(uint64 x, uint64 n)
+{
+    uint64 x_hi = x >> 32, x_lo = x & 0xffffffff;
+    uint64 n_hi = n >> 32, n_lo = n & 0xffffffff;
+
+    uint64 ac = x_hi * n_hi;
+    uint64 ad = x_hi * n_lo;
+    uint64 bc = x_lo * n_hi;
+    uint64 bd = x_lo * n_lo;
+
+    uint64 mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+    return ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+}
+
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nBits;
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nBits(0) {}
+
+    // Append the nCount low bits of n, most significant first
+    void Write(uint64 n, int nCount)
+    {
+        while (nCount > 0)
+        {
+            int nTake = std::min(8 - nBits, nCount);
+            unsigned char nChunk = (n >> (nCount - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= nChunk << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8)
+            {
+                vch.push_back(nBuffer);
+                nBuffer = 0;
+                nBits = 0;
+            }
+        }
+    }
+
+    void Flush()
+    {
+        if (nBits > 0)
+            vch.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    unsigned int nPos;
+    int nBits; // bits of vch[nPos] already consumed
+
+public:
+    CBitReader(const std::vector<unsigned char>& vchIn, unsigned int nPosIn) : vch(vchIn), nPos(nPosIn), nBits(0) {}
+
+    bool Read(uint64& n, int nCount)
+    {
+        n = 0;
+        while (nCount > 0)
+        {
+            if (nPos >= vch.size())
+                return false;
+            int nTake = std::min(8 - nBits, nCount);
+            unsigned char nChunk = (vch[nPos] >> (8 - nBits - nTake)) & ((1 << nTake) - 1);
+            n = (n << nTake) | nChunk;
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8)
+            {
+                nPos++;
+                nBits = 0;
+            }
+        }
+        return true;
+    }
+
+    // Golomb-Rice: the quotient in unary (a run of 1 bits ended by a 0), then P bits of remainder
+    bool ReadGolombRice(uint64& n)
+    {
+        uint64 nQuotient = 0, nBit;
+        while (true)
+        {
+            if (!Read(nBit, 1))
+                return false;
+            if (nBit == 0)
+                break;
+            nQuotient++;
+        }
+        uint64 nRemainder;
+        if (!Read(nRemainder, BLOCK_FILTER_P))
+            return false;
+        n = (nQuotient << BLOCK_FILTER_P) + nRemainder;
+        return true;
+    }
+};
+
+void CBlockFilter::GetSipHashKeys(uint64& k0, uint64& k1) const
+{
+    k0 = blockHash.Get64(0);
+    k1 = blockHash.Get64(1);
+}
+
+void CBlockFilter::HashElements(const vector<vector<unsigned char> >& vElements, uint64 nRange, vector<uint64>& vHashes) const
+{
+    uint64 k0, k1;
+    GetSipHashKeys(k0, k1);
+    vHashes.clear();
+    vHashes.reserve(vElements.size());
+    BOOST_FOREACH(const vector<unsigned char>& vElement, vElements)
+        vHashes.push_back(MapIntoRange(SipHash(k0, k1, vElement.empty() ? NULL : &vElement[0], vElement.size()), nRange));
+    sort(vHashes.begin(), vHashes.end());
+}
+
+void CBlockFilter::GetElements(const CBlock& block, vector<vector<unsigned char> >& vElements)
+{
+    set<vector<unsigned char> > setElements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            setElements.insert(vector<unsigned char>(script.begin(), script.end()));
+        }
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << txin.prevout;
+            setElements.insert(vector<unsigned char>(ss.begin(), ss.end()));
+        }
+    }
+    vElements.assign(setElements.begin(), setElements.end());
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block) : blockHash(block.GetHash())
+{
+    vector<vector<unsigned char> > vElements;
+    GetElements(block, vElements);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, vElements.size());
+    vchFilter.assign(ss.begin(), ss.end());
+    if (vElements.empty())
+        return;
+
+    vector<uint64> vHashes;
+    HashElements(vElements, vElements.size() * BLOCK_FILTER_M, vHashes);
+
+    CBitWriter writer(vchFilter);
+    uint64 nLast = 0;
+    BOOST_FOREACH(uint64 nHash, vHashes)
+    {
+        uint64 nDelta = nHash - nLast;
+        nLast = nHash;
+        for (uint64 q = nDelta >> BLOCK_FILTER_P; q > 0; q--)
+            writer.Write(1, 1);
+        writer.Write(0, 1);
+        writer.Write(nDelta, BLOCK_FILTER_P);
+    }
+    writer.Flush();
+}
+
+unsigned int CBlockFilter::GetN() const
+{
+    if (vchFilter.empty())
+        return 0;
+    CDataStream ss(vchFilter, SER_NETWORK, PROTOCOL_VERSION);
+    return ReadCompactSize(ss);
+}
+
+bool CBlockFilter::MatchAny(const vector<vector<unsigned char> >& vElements) const
+{
+    if (vchFilter.empty() || vElements.empty())
+        return false;
+    unsigned int nN = GetN();
+    if (nN == 0)
+        return false;
+
+    vector<uint64> vQuery;
+    HashElements(vElements, nN * BLOCK_FILTER_M, vQuery);
+
+    // Walk the sorted set and the sorted query side by side
+    CBitReader reader(vchFilter, GetSizeOfCompactSize(nN));
+    vector<uint64>::const_iterator it = vQuery.begin();
+    uint64 nValue = 0;
+    for (unsigned int i = 0; i < nN; i++)
+    {
+        uint64 nDelta;
+        if (!reader.ReadGolombRice(nDelta))
+            return false;
+        nValue += nDelta;
+        while (it != vQuery.end() && *it < nValue)
+            it++;
+        if (it == vQuery.end())
+            return false;
+        if (*it == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool CBlockFilter::Match(const vector<unsigned char>& vElement) const
+{
+    return MatchAny(vector<vector<unsigned char> >(1, vElement));
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    return Hash(vchFilter.begin(), vchFilter.end());
+}
+
+uint256 CBlockFilter::GetHeader(const uint256& prevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(BEGIN(hashFilter), END(hashFilter), BEGIN(prevHeader), END(prevHeader));
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include <vector>
+
+#include "uint256.h"
+#include "serialize.h"
+
+class CBlock;
+
+// Golomb-Rice coding parameters: each element is a P-bit remainder plus a
+// unary quotient, for a false positive rate of 1/M per queried element
+static const int BLOCK_FILTER_P = 19;
+static const uint64 BLOCK_FILTER_M = 784931;
+
+/**
+ * A compact filter of a block: a Golomb-coded set of the output scripts it
+ * creates and the outpoints it spends, keyed by the block hash.
+ *
+ * Unlike a CBloomFilter, which a light client hands to us so that we filter
+ * every block and transaction on its behalf, these filters are built once per
+ * block and the same bytes are served to every client, who match them
+ * locally against their own scripts and coins.
+ */
+class CBlockFilter
+{
+private:
+    uint256 blockHash;
+    // number of elements (compact size) followed by the Golomb-Rice coded deltas
+    std::vector<unsigned char> vchFilter;
+
+    void GetSipHashKeys(uint64& k0, uint64& k1) const;
+    // Hashes of the elements, mapped into [0, N * M) and sorted
+    void HashElements(const std::vector<std::vector<unsigned char> >& vElements, uint64 nRange, std::vector<uint64>& vHashes) const;
+    unsigned int GetN() const;
+
+public:
+    CBlockFilter() {}
+    CBlockFilter(const uint256& blockHashIn, const std::vector<unsigned char>& vchFilterIn) : blockHash(blockHashIn), vchFilter(vchFilterIn) {}
+    CBlockFilter(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockHash);
+        READWRITE(vchFilter);
+    )
+
+    const uint256& GetBlockHash() const { return blockHash; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchFilter; }
+
+    // The elements a filter is built from
+    static void GetElements(const CBlock& block, std::vector<std::vector<unsigned char> >& vElements);
+
+    // True if any of the elements might be in the block (false positive rate 1/M each)
+    bool MatchAny(const std::vector<std::vector<unsigned char> >& vElements) const;
+    bool Match(const std::vector<unsigned char>& vElement) const;
+
+    // Filter headers commit to the filter and all the filters before it
+    uint256 GetHash() const;
+    uint256 GetHeader(const uint256& prevHeader) const;
+};
+
+#endif /* BITCOIN_BLOCKFILTER_H */
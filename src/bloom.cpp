@@ -31,48 +31,51 @@ nFlags(nFlagsIn)
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const uint32_t* pBlocks, unsigned int nLen, uint32_t nTail) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    // The modulo is part of the protocol: peers compute the same bit positions.
+    return MurmurHash3Mixed(nHashNum * 0xFBA4C795 + nTweak, pBlocks, nLen, nTail) % (vData.size() * 8);
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+// Keys are mixed once into a buffer on the stack; anything longer than a
+// script push is hashed from scratch for every hash function.
+static const unsigned int MAX_MIXED_KEY_BLOCKS = MAX_SCRIPT_ELEMENT_SIZE / 4;
+
+void CBloomFilter::insert(const unsigned char* pch, unsigned int nLen)
 {
     if (isFull)
         return;
+    uint32_t pBlocks[MAX_MIXED_KEY_BLOCKS];
+    uint32_t nTail = 0;
+    bool fMixed = nLen / 4 <= MAX_MIXED_KEY_BLOCKS;
+    if (fMixed)
+        MurmurHash3Mix(pch, nLen, pBlocks, nTail);
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = fMixed ? Hash(i, pBlocks, nLen, nTail) :
+            MurmurHash3(i * 0xFBA4C795 + nTweak, pch, nLen) % (vData.size() * 8);
         // Sets bit nIndex of vData
         vData[nIndex >> 3] |= bit_mask[7 & nIndex];
     }
     isEmpty = false;
 }
 
-void CBloomFilter::insert(const COutPoint& outpoint)
-{
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
-}
-
-void CBloomFilter::insert(const uint256& hash)
-{
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
-}
-
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pch, unsigned int nLen) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
+    uint32_t pBlocks[MAX_MIXED_KEY_BLOCKS];
+    uint32_t nTail = 0;
+    bool fMixed = nLen / 4 <= MAX_MIXED_KEY_BLOCKS;
+    if (fMixed)
+        MurmurHash3Mix(pch, nLen, pBlocks, nTail);
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = fMixed ? Hash(i, pBlocks, nLen, nTail) :
+            MurmurHash3(i * 0xFBA4C795 + nTweak, pch, nLen) % (vData.size() * 8);
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
             return false;
@@ -80,18 +83,59 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
     return true;
 }
 
+bool CBloomFilter::contains(const CBloomTxKeys& keys, unsigned int nKey) const
+{
+    const CBloomTxKeys::Key& key = keys.vKeys[nKey];
+    const uint32_t* pBlocks = keys.vBlocks.empty() ? NULL : &keys.vBlocks[key.nBlock];
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = Hash(i, pBlocks, key.nLen, key.nTail);
+        if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
+            return false;
+    }
+    return true;
+}
+
+// An outpoint is keyed by its serialization: the txid followed by n, little endian
+static inline void SerializeOutPoint(const COutPoint& outpoint, unsigned char* pch)
+{
+    memcpy(pch, outpoint.hash.begin(), 32);
+    for (unsigned int i = 0; i < 4; i++)
+        pch[32 + i] = (unsigned char)(outpoint.n >> (8 * i));
+}
+
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+void CBloomFilter::insert(const COutPoint& outpoint)
+{
+    unsigned char pch[36];
+    SerializeOutPoint(outpoint, pch);
+    insert(pch, sizeof(pch));
+}
+
+void CBloomFilter::insert(const uint256& hash)
+{
+    insert(hash.begin(), 32);
+}
+
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char pch[36];
+    SerializeOutPoint(outpoint, pch);
+    return contains(pch, sizeof(pch));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), 32);
 }
 
 bool CBloomFilter::IsWithinSizeConstraints() const
@@ -100,6 +144,15 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(tx, CBloomTxKeys(tx, hash));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const CBloomTxKeys& keys)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -108,9 +161,10 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
         return true;
     if (isEmpty)
         return false;
-    if (contains(hash))
+    if (contains(keys, 0))
         fFound = true;
 
+    unsigned int nKey = 1;
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
         const CTxOut& txout = tx.vout[i];
@@ -118,54 +172,201 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (; nKey < keys.vOutputEnd[i]; nKey++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(keys, nKey))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
+                    insert(COutPoint(keys.hash, i));
                 else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
                 {
                     txnouttype type;
                     vector<vector<unsigned char> > vSolutions;
                     if (Solver(txout.scriptPubKey, type, vSolutions) &&
                             (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
+                        insert(COutPoint(keys.hash, i));
                 }
                 break;
             }
         }
+        nKey = keys.vOutputEnd[i];
     }
 
     if (fFound)
         return true;
 
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        // Match if the filter contains an outpoint tx spends, or any
+        // arbitrary script data element in any scriptSig in tx
+        for (; nKey < keys.vInputEnd[i]; nKey++)
+            if (contains(keys, nKey))
+                return true;
+    }
+
+    return false;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), within 1-50
+    nHashFuncs = max(1, min((int)(logFpRate / log(0.5) + 0.5), (int)MAX_HASH_FUNCS));
+    // Between 2 and 3 generations of nElements / 2 entries are kept
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // The false positive rate with nMaxElements entries is
+    //   pow(1 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+    // solved for nFilterBits:
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+// Map a 32-bit hash into [0, n) with a multiply and shift. This filter is
+// local only, so unlike CBloomFilter it doesn't have to use a modulo.
+static inline unsigned int FastRange32(unsigned int x, unsigned int n)
+{
+    return ((uint64)x * n) >> 32;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, unsigned int nLen)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64 nGenerationMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nGenerationMask2 = 0 - (uint64)(nGeneration >> 1);
+        // Wipe old entries that used this generation number
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64 p1 = data[p], p2 = data[p + 1];
+            uint64 mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint32_t pBlocks[MAX_MIXED_KEY_BLOCKS];
+    uint32_t nTail;
+    bool fMixed = nLen / 4 <= MAX_MIXED_KEY_BLOCKS;
+    if (fMixed)
+        MurmurHash3Mix(pch, nLen, pBlocks, nTail);
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nSeed = n * 0xFBA4C795 + nTweak;
+        unsigned int h = fMixed ? MurmurHash3Mixed(nSeed, pBlocks, nLen, nTail) : MurmurHash3(nSeed, pch, nLen);
+        int bit = h & 0x3F;
+        // The range reduction uses the high bits of h, the low ones pick the bit
+        unsigned int pos = FastRange32(h, data.size());
+        // The low bit of pos is ignored: the pair of words at pos & ~1 holds the generation
+        data[pos & ~1U] = (data[pos & ~1U] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration >> 1)) << bit;
+    }
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(hash.begin(), 32);
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, unsigned int nLen) const
+{
+    uint32_t pBlocks[MAX_MIXED_KEY_BLOCKS];
+    uint32_t nTail;
+    bool fMixed = nLen / 4 <= MAX_MIXED_KEY_BLOCKS;
+    if (fMixed)
+        MurmurHash3Mix(pch, nLen, pBlocks, nTail);
+    for (int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int nSeed = n * 0xFBA4C795 + nTweak;
+        unsigned int h = fMixed ? MurmurHash3Mixed(nSeed, pBlocks, nLen, nTail) : MurmurHash3(nSeed, pch, nLen);
+        int bit = h & 0x3F;
+        unsigned int pos = FastRange32(h, data.size());
+        // If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain vKey
+        if (!(((data[pos & ~1U] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(hash.begin(), 32);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
+
+CBloomTxKeys::CBloomTxKeys(const CTransaction& tx, const uint256& hashIn) : hash(hashIn)
+{
+    vOutputEnd.reserve(tx.vout.size());
+    vInputEnd.reserve(tx.vin.size());
+
+    AddKey(hash.begin(), 32);
+
+    vector<unsigned char> data;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        CScript::const_iterator pc = txout.scriptPubKey.begin();
+        while (pc < txout.scriptPubKey.end())
+        {
+            opcodetype opcode;
+            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                AddKey(&data[0], data.size());
+        }
+        vOutputEnd.push_back(vKeys.size());
+    }
+
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
-            return true;
+        unsigned char pch[36];
+        SerializeOutPoint(txin.prevout, pch);
+        AddKey(pch, sizeof(pch));
 
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
         CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
         while (pc < txin.scriptSig.end())
         {
             opcodetype opcode;
             if (!txin.scriptSig.GetOp(pc, opcode, data))
                 break;
-            if (data.size() != 0 && contains(data))
-                return true;
+            if (data.size() != 0)
+                AddKey(&data[0], data.size());
         }
+        vInputEnd.push_back(vKeys.size());
     }
+}
 
-    return false;
+void CBloomTxKeys::AddKey(const unsigned char* pch, unsigned int nLen)
+{
+    Key key;
+    key.nBlock = vBlocks.size();
+    key.nLen = nLen;
+    vBlocks.resize(vBlocks.size() + nLen / 4);
+    MurmurHash3Mix(pch, nLen, vBlocks.empty() ? NULL : &vBlocks[key.nBlock], key.nTail);
+    vKeys.push_back(key);
 }
 
 void CBloomFilter::UpdateEmptyFull()
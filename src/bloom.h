@@ -11,6 +11,7 @@
 
 class COutPoint;
 class CTransaction;
+class CBloomTxKeys;
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -48,7 +49,11 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const uint32_t* pBlocks, unsigned int nLen, uint32_t nTail) const;
+
+    void insert(const unsigned char* pch, unsigned int nLen);
+    bool contains(const unsigned char* pch, unsigned int nLen) const;
+    bool contains(const CBloomTxKeys& keys, unsigned int nKey) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -83,9 +88,74 @@ public:
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    // Same, with the keys of the transaction prepared once for all filters it is matched against
+    bool IsRelevantAndUpdate(const CTransaction& tx, const CBloomTxKeys& keys);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of the most recently
+ * inserted" set, used where a std::set plus a queue of the last N entries
+ * would cost far more memory and cache misses (like tracking what inventory
+ * a peer already knows).
+ *
+ * contains(item) always returns true if item was one of the last N things
+ * insert()'ed, and may return true for items that were not (at the given
+ * false positive rate). Entries are kept in three generations of N/2: each
+ * position stores the 2-bit generation that last set it, and starting a new
+ * generation wipes the positions of the oldest one.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const unsigned char* pch, unsigned int nLen);
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const unsigned char* pch, unsigned int nLen) const;
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    // position P is bit (P & 63) of both data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]
+    std::vector<uint64> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
+/**
+ * Every data element of a transaction that IsRelevantAndUpdate looks at, with
+ * the seed-independent half of MurmurHash3 already done. Relaying a transaction
+ * to many filtered peers then only runs the per-seed rounds for each filter.
+ */
+class CBloomTxKeys
+{
+public:
+    struct Key
+    {
+        unsigned int nBlock; // offset into vBlocks
+        unsigned int nLen;
+        uint32_t nTail;
+    };
+
+    uint256 hash;
+    std::vector<uint32_t> vBlocks;
+    std::vector<Key> vKeys;              // the txid first, then outputs, then inputs
+    std::vector<unsigned int> vOutputEnd; // end in vKeys of the data pushes of each output
+    std::vector<unsigned int> vInputEnd;  // end in vKeys of each input: prevout, then scriptSig pushes
+
+    CBloomTxKeys(const CTransaction& tx, const uint256& hashIn);
+
+private:
+    void AddKey(const unsigned char* pch, unsigned int nLen);
+};
+
 #endif /* BITCOIN_BLOOM_H */
@@ -57,6 +57,12 @@ namespace Checkpoints
                     //   (the tx=... number in the SetBestChain debug.log lines)
         288     // * estimated number of transactions per day after checkpoint
     };
+    // MuHash of the UTXO set at a checkpoint (the "muhash" of gettxoutsetinfo
+    // and dumptxoutset), by height. Only snapshots matching one of these can
+    // be loaded with loadtxoutset.
+    static MapCheckpoints mapSnapshots;
+    static MapCheckpoints mapSnapshotsTestnet;
+
     static MapCheckpoints mapCheckpointsTestnet = 
         boost::assign::map_list_of
         (   0, uint256("0x"))
@@ -88,6 +94,19 @@ namespace Checkpoints
         return hash == i->second;
     }
 
+    bool CheckSnapshot(int Vcoinh, const uint256& hashBlock, const uint256& hashMuHash)
+    {
+        // A loaded snapshot is never validated against the blocks below it,
+        // so there is no -checkpoints or testnet exception here
+        const MapCheckpoints& snapshots = fTestNet ? mapSnapshotsTestnet : mapSnapshots;
+        MapCheckpoints::const_iterator i = snapshots.find(Vcoinh);
+        if (i == snapshots.end() || hashMuHash != i->second)
+            return false;
+        const MapCheckpoints& checkpoints = *Checkpoints().mapCheckpoints;
+        MapCheckpoints::const_iterator j = checkpoints.find(Vcoinh);
+        return j != checkpoints.end() && hashBlock == j->second;
+    }
+
     // Guess how far we are in the verification process at the given block index
     double GuessVerificationProgress(CBlockIndex *pindex) {
         if (pindex==NULL)
@@ -17,6 +17,9 @@ namespace Checkpoints
     // Returns true if block passes checkpoint checks
     bool CheckBlock(int Vcoinh, const uint256& hash);
 
+    // Returns true if the UTXO set MuHash of a snapshot of the given checkpoint block matches the compiled-in one
+    bool CheckSnapshot(int Vcoinh, const uint256& hashBlock, const uint256& hashMuHash);
+
     // Return conservative estimate of total number of blocks, 0 if unknown
     int GetTotalBlocksEstimate();
 
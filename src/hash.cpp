@@ -5,49 +5,46 @@ inline uint32_t ROTL32 ( uint32_t x, int8_t r )
     return (x << r) | (x >> (32 - r));
 }
 
-unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+static inline uint32_t ReadLE32(const unsigned char* p)
 {
-    // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
-    uint32_t h1 = nHashSeed;
-    const uint32_t c1 = 0xcc9e2d51;
-    const uint32_t c2 = 0x1b873593;
-
-    const int nblocks = vDataToHash.size() / 4;
-
-    //----------
-    // body
-    const uint32_t * blocks = (const uint32_t *)(&vDataToHash[0] + nblocks*4);
-
-    for(int i = -nblocks; i; i++)
-    {
-        uint32_t k1 = blocks[i];
-
-        k1 *= c1;
-        k1 = ROTL32(k1,15);
-        k1 *= c2;
-
-        h1 ^= k1;
-        h1 = ROTL32(h1,13); 
-        h1 = h1*5+0xe6546b64;
-    }
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-    //----------
-    // tail
-    const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
+static inline uint32_t MurmurMixBlock(uint32_t k1)
+{
+    k1 *= 0xcc9e2d51;
+    k1 = ROTL32(k1,15);
+    k1 *= 0x1b873593;
+    return k1;
+}
 
+static inline uint32_t MurmurMixTail(const unsigned char* tail, unsigned int nLen)
+{
     uint32_t k1 = 0;
 
-    switch(vDataToHash.size() & 3)
+    switch(nLen & 3)
     {
     case 3: k1 ^= tail[2] << 16;
     case 2: k1 ^= tail[1] << 8;
     case 1: k1 ^= tail[0];
-            k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
+            return MurmurMixBlock(k1);
     };
+    return 0;
+}
+
+static inline uint32_t MurmurRound(uint32_t h1, uint32_t k1)
+{
+    h1 ^= k1;
+    h1 = ROTL32(h1,13);
+    return h1*5+0xe6546b64;
+}
 
-    //----------
-    // finalization
-    h1 ^= vDataToHash.size();
+static inline uint32_t MurmurFinal(uint32_t h1, unsigned int nLen, uint32_t nTail)
+{
+    // A tail that mixed to 0 leaves h1 unchanged, same as no tail at all
+    h1 ^= nTail;
+
+    h1 ^= nLen;
     h1 ^= h1 >> 16;
     h1 *= 0x85ebca6b;
     h1 ^= h1 >> 13;
@@ -56,3 +53,117 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     return h1;
 }
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen)
+{
+    // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+    uint32_t h1 = nHashSeed;
+    const unsigned int nblocks = nLen / 4;
+
+    for (unsigned int i = 0; i < nblocks; i++)
+        h1 = MurmurRound(h1, MurmurMixBlock(ReadLE32(pch + i*4)));
+
+    return MurmurFinal(h1, nLen, MurmurMixTail(pch + nblocks*4, nLen));
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashSeed, vDataToHash.empty() ? NULL : &vDataToHash[0], vDataToHash.size());
+}
+
+void MurmurHash3Mix(const unsigned char* pch, unsigned int nLen, uint32_t* pBlocks, uint32_t& nTail)
+{
+    const unsigned int nblocks = nLen / 4;
+    for (unsigned int i = 0; i < nblocks; i++)
+        pBlocks[i] = MurmurMixBlock(ReadLE32(pch + i*4));
+    nTail = MurmurMixTail(pch + nblocks*4, nLen);
+}
+
+unsigned int MurmurHash3Mixed(unsigned int nHashSeed, const uint32_t* pBlocks, unsigned int nLen, uint32_t nTail)
+{
+    uint32_t h1 = nHashSeed;
+    const unsigned int nblocks = nLen / 4;
+    for (unsigned int i = 0; i < nblocks; i++)
+        h1 = MurmurRound(h1, pBlocks[i]);
+    return MurmurFinal(h1, nLen, nTail);
+}
+
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    // SipHash-2-4, see https://131002.net/siphash/ ; the input is always
+    // four 64-bit words, so the message loop is unrolled
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // length (32 bytes) in the top byte of the final block
+    uint64 b = ((uint64)32) << 56;
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64 SipHash(uint64 k0, uint64 k1, const unsigned char* pch, size_t nLen)
+{
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t nBlocks = nLen / 8;
+    for (size_t i = 0; i < nBlocks; i++)
+    {
+        uint64 m = 0;
+        for (int j = 0; j < 8; j++)
+            m |= (uint64)pch[i*8 + j] << (8 * j);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // remaining bytes, with the length in the top byte
+    uint64 b = ((uint64)nLen) << 56;
+    for (size_t j = 0; j < (nLen & 7); j++)
+        b |= (uint64)pch[nBlocks*8 + j] << (8 * j);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -121,6 +121,19 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nLen);
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+// MurmurHash3 split in two: the mixing of the input blocks doesn't depend on
+// the seed, so a key hashed with many seeds only needs to be mixed once.
+// pBlocks must have room for nLen / 4 entries.
+void MurmurHash3Mix(const unsigned char* pch, unsigned int nLen, uint32_t* pBlocks, uint32_t& nTail);
+unsigned int MurmurHash3Mixed(unsigned int nHashSeed, const uint32_t* pBlocks, unsigned int nLen, uint32_t nTail);
+
+/** SipHash-2-4 of a 256-bit value, keyed with (k0, k1) */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
+/** SipHash-2-4 of arbitrary data */
+uint64 SipHash(uint64 k0, uint64 k1, const unsigned char* pch, size_t nLen);
+
 #endif
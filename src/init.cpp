@@ -112,8 +112,10 @@ void Shutdown()
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinsflusher; pcoinsflusher = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
+        delete pblockfilterdb; pblockfilterdb = NULL;
     }
     if (pwalletMain)
         bitdb.Flush(true);
@@ -303,6 +305,11 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -<db>.maxopenfiles=<n> " + _("Table files database <db> (chainstate, blockindex or blockfilter) keeps open (default: 1000 for chainstate, 64 otherwise)") + "\n" +
+        "  -<db>.blockcache=<n>   " + _("Block cache of database <db> in megabytes (default: half its share of -dbcache)") + "\n" +
+        "  -<db>.writebuffer=<n>  " + _("Write buffer of database <db> in megabytes (default: a quarter of its share of -dbcache)") + "\n" +
+        "  -<db>.blocksize=<n>    " + _("Table block size of database <db> in kilobytes (default: 4)") + "\n" +
+        "  -<db>.compression      " + _("Compress new tables of database <db> with Snappy (default: 0)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Exclusively connect through socks proxy") + "\n" +
         "  -proxytoo=<ip:port>    " + _("Also connect through socks proxy") + "\n" +
@@ -326,6 +333,10 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxrelaycache=<n>     " + _("Maximum memory for recently relayed transactions, <n>*1000 bytes (default: 20000)") + "\n" +
+        "  -maxhistoricalupload=<n> " + _("Limit the upload of blocks older than a week to <n>*1000 bytes per second, 0 = no limit (default: 0)") + "\n" +
+        "  -nettrafficdump=<n>    " + _("Log network traffic per command and peer every <n> seconds (default: 0)") + "\n" +
+        "  -msghandlers=<n>       " + _("Number of threads processing peer messages (up to 16, 0 = auto, default: 2)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -345,6 +356,7 @@ std::string HelpMessage()
         "  -testnet               " + _("Use the test network") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
+        "  -checkaddrman=<n>      " + _("Check <n> address manager entries for consistency on every change (default: 0)") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
@@ -368,7 +380,12 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
+        "  -checkbackground       " + _("Check the coin database (levels 3 and 4) in the background after startup, see getverificationinfo (default: 0)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the amounts and unspent outputs of each address (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of the inputs spending each output (default: 0)") + "\n" +
+        "  -blockfilterindex      " + _("Maintain compact filters of all blocks for light clients (default: 0)") + "\n" +
+        "  -prune=<n>             " + _("Delete old block files to keep them below <n> MiB, the last 288 blocks are always kept (default: 0 = disabled, minimum: 550, incompatible with -txindex and -blockfilterindex)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
@@ -509,6 +526,23 @@ bool AppInit2(boost::thread_group& threadGroup)
     fBloomFilters = GetBoolArg("-bloomfilters", true);
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", false);
+
+    int64 nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    if (nPruneArg > 0) {
+        nPruneTarget = (uint64)nPruneArg * 1024 * 1024;
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), (int)(MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024)));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (fBlockFilterIndex)
+            return InitError(_("Prune mode is incompatible with -blockfilterindex."));
+        fPruneMode = true;
+        // we can no longer serve the full chain
+        nLocalServices &= ~NODE_NETWORK;
+    }
 
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
@@ -553,6 +587,31 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
         nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
 
+    // MIN_CORE_FILEDESCRIPTORS allows for 64 open table files per database;
+    // the databases get as many more as they are set to and the system can
+    // spare, the chainstate last as it is the one asking for more by default
+    vector<pair<string, int> > vDBMaxOpenFiles;
+    vDBMaxOpenFiles.push_back(make_pair(string("blockindex"), 64));
+    if (fBlockFilterIndex)
+        vDBMaxOpenFiles.push_back(make_pair(string("blockfilter"), 64));
+    vDBMaxOpenFiles.push_back(make_pair(string("chainstate"), DEFAULT_CHAINSTATE_MAX_OPEN_FILES));
+    int nDBFiles = 0;
+    for (unsigned int i = 0; i < vDBMaxOpenFiles.size(); i++)
+        nDBFiles += std::max((int)GetArg("-" + vDBMaxOpenFiles[i].first + ".maxopenfiles", vDBMaxOpenFiles[i].second) - 64, 0);
+    if (nDBFiles > 0) {
+        int nDBFD = std::max(RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + nDBFiles) - nMaxConnections - MIN_CORE_FILEDESCRIPTORS, 0);
+        for (unsigned int i = 0; i < vDBMaxOpenFiles.size(); i++) {
+            string strArg = "-" + vDBMaxOpenFiles[i].first + ".maxopenfiles";
+            int nExtra = std::max((int)GetArg(strArg, vDBMaxOpenFiles[i].second) - 64, 0);
+            if (nExtra > nDBFD) {
+                nExtra = nDBFD;
+                mapArgs[strArg] = itostr(64 + nExtra);
+                printf("Keeping at most %s %s files open\n", mapArgs[strArg].c_str(), vDBMaxOpenFiles[i].first.c_str());
+            }
+            nDBFD -= nExtra;
+        }
+    }
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = GetBoolArg("-debug");
@@ -587,6 +646,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
 
+    mapRelay.SetMaxBytes(RelayCacheSize());
+
     if (mapArgs.count("-timeout"))
     {
         int nNewTimeout = GetArg("-timeout", 5000);
@@ -674,7 +735,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadMasterNodeSigCheck);
     }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "mnverify", &ThreadMasterNodeVerify));
 
     int64 nStart;
 
@@ -884,6 +948,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nBlockFilterDBCache = 0;
+    if (fBlockFilterIndex)
+        nBlockFilterDBCache = std::min(nTotalCache / 8, (size_t)(1 << 23)); // at most 8 MiB
+    nTotalCache -= nBlockFilterDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
@@ -900,12 +968,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsflusher;
                 delete pcoinsdbview;
                 delete pblocktree;
+                delete pblockfilterdb; pblockfilterdb = NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                if (fBlockFilterIndex)
+                    pblockfilterdb = new CBlockFilterDB(nBlockFilterDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pcoinsflusher = new CCoinsViewFlusher(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(*pcoinsflusher);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -932,9 +1005,22 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -addressindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+
+                // Check for changed -spentindex state
+                if (fSpentIndex != GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
-                              GetArg( "-checkblocks", 288))) {
+                              GetArg( "-checkblocks", 288),
+                              GetBoolArg("-checkbackground", false))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
@@ -974,6 +1060,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    // Old blocks are gone (pruned or below a UTXO snapshot) even if -prune is off now
+    if (fHavePruned)
+        nLocalServices &= ~NODE_NETWORK;
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -1087,6 +1177,13 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (pindexBest && pindexBest != pindexRescan)
         {
+            if (fHavePruned) {
+                CBlockIndex *pindex = pindexBest;
+                while (pindex && pindex != pindexRescan && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+                    pindex = pindex->pprev;
+                if (pindex != pindexRescan)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
             uiInterface.InitMessage(_("Rescanning..."));
             printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->Vcoinh - pindexRescan->Vcoinh, pindexRescan->Vcoinh);
             nStart = GetTimeMillis();
@@ -1112,6 +1209,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    if (fBlockFilterIndex)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "filterindex", &ThreadBlockFilterIndex));
+
+    if (GetBoolArg("-checkbackground", false) && GetArg("-checklevel", 3) >= 3)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "verifydb", &ThreadVerifyDB));
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -1123,6 +1226,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (!adb.Read(addrman))
             printf("Invalid or missing peers.dat; recreating\n");
     }
+    addrman.SetCheckEntries(GetArg("-checkaddrman", 0));
 
     printf("Loaded %i addresses from peers.dat  %"PRI64d"ms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -12,6 +12,8 @@
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+
 void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     if (status.ok())
         return;
@@ -24,23 +26,47 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+CLevelDBTuning::CLevelDBTuning(const std::string &strNameIn, size_t nCacheSize, int nDefaultMaxOpenFiles, bool fDefaultCompression) : strName(strNameIn) {
+    std::string strPrefix = "-" + strName + ".";
+    // LevelDB itself keeps these within bounds it can work with
+    nMaxOpenFiles = GetArg(strPrefix + "maxopenfiles", nDefaultMaxOpenFiles);
+    nBlockCacheSize = mapArgs.count(strPrefix + "blockcache") ? GetArg(strPrefix + "blockcache", 0) << 20 : nCacheSize / 2;
+    nWriteBufferSize = mapArgs.count(strPrefix + "writebuffer") ? GetArg(strPrefix + "writebuffer", 0) << 20 : nCacheSize / 4;
+    nBlockSize = GetArg(strPrefix + "blocksize", 4) << 10;
+    fCompression = GetBoolArg(strPrefix + "compression", fDefaultCompression);
+}
+
+std::string CLevelDBTuning::ToString() const {
+    return strprintf("%s: maxopenfiles=%d blockcache=%.1fMiB writebuffer=%.1fMiB blocksize=%uKiB compression=%d",
+        strName.c_str(), nMaxOpenFiles, nBlockCacheSize / 1048576.0, nWriteBufferSize / 1048576.0,
+        (unsigned int)(nBlockSize >> 10), fCompression);
+}
+
+static leveldb::Options GetOptions(const CLevelDBTuning &tuning) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.block_cache = leveldb::NewLRUCache(tuning.nBlockCacheSize);
+    options.write_buffer_size = tuning.nWriteBufferSize; // up to two write buffers may be held in memory simultaneously
+    options.block_size = tuning.nBlockSize;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    // tables written before keep their compression, so this can be changed any time
+    options.compression = tuning.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = tuning.nMaxOpenFiles;
     return options;
 }
 
-CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+// The open databases, for GetLevelDBStats and CompactLevelDB
+static boost::mutex mutexLevelDBs;
+static boost::condition_variable condLevelDBs; // a compaction finished
+static std::vector<CLevelDB*> vLevelDBs;
+
+CLevelDB::CLevelDB(const boost::filesystem::path &path, const CLevelDBTuning &tuningIn, bool fMemory, bool fWipe) :
+    tuning(tuningIn), nCompacting(0), nCompactions(0), nCompactMicros(0), nLastCompactMicros(0) {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(tuning);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -51,15 +77,25 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
             leveldb::DestroyDB(path.string(), options);
         }
         boost::filesystem::create_directory(path);
-        printf("Opening LevelDB in %s\n", path.string().c_str());
+        printf("Opening LevelDB in %s (%s)\n", path.string().c_str(), tuning.ToString().c_str());
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     if (!status.ok())
         throw std::runtime_error(strprintf("CLevelDB(): error opening database environment %s", status.ToString().c_str()));
     printf("Opened LevelDB successfully\n");
+
+    boost::unique_lock<boost::mutex> lock(mutexLevelDBs);
+    vLevelDBs.push_back(this);
 }
 
 CLevelDB::~CLevelDB() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexLevelDBs);
+        vLevelDBs.erase(std::remove(vLevelDBs.begin(), vLevelDBs.end(), this), vLevelDBs.end());
+        // compactions run outside the lock, let them finish
+        while (nCompacting > 0)
+            condLevelDBs.wait(lock);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -79,3 +115,53 @@ bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error)
     }
     return true;
 }
+
+void GetLevelDBStats(std::vector<CLevelDBStats> &vStats) {
+    boost::unique_lock<boost::mutex> lock(mutexLevelDBs);
+    for (std::vector<CLevelDB*>::const_iterator it = vLevelDBs.begin(); it != vLevelDBs.end(); it++) {
+        CLevelDB *pdb = *it;
+        CLevelDBStats stats(pdb->tuning);
+        pdb->pdb->GetProperty("leveldb.stats", &stats.strStats);
+        std::string strFiles;
+        while (pdb->pdb->GetProperty(strprintf("leveldb.num-files-at-level%u", (unsigned int)stats.vFilesAtLevel.size()), &strFiles))
+            stats.vFilesAtLevel.push_back(atoi(strFiles));
+        pdb->pdb->GetProperty("leveldb.approximate-memory-usage", &stats.strMemoryUsage);
+        stats.nCompactions = pdb->nCompactions;
+        stats.nCompactMicros = pdb->nCompactMicros;
+        stats.nLastCompactMicros = pdb->nLastCompactMicros;
+        vStats.push_back(stats);
+    }
+}
+
+bool CompactLevelDB(const std::string &strName, int64 &nMicros) {
+    CLevelDB *pdb = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexLevelDBs);
+        for (std::vector<CLevelDB*>::const_iterator it = vLevelDBs.begin(); it != vLevelDBs.end(); it++) {
+            if ((*it)->tuning.strName == strName) {
+                pdb = *it;
+                break;
+            }
+        }
+        if (pdb == NULL)
+            return false;
+        // keeps the database open; the other databases stay available meanwhile
+        pdb->nCompacting++;
+    }
+
+    printf("Compacting LevelDB %s...\n", strName.c_str());
+    int64 nStart = GetTimeMicros();
+    pdb->pdb->CompactRange(NULL, NULL);
+    nMicros = GetTimeMicros() - nStart;
+    printf("Compacted LevelDB %s in %"PRI64d"ms\n", strName.c_str(), nMicros / 1000);
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexLevelDBs);
+        pdb->nCompactions++;
+        pdb->nCompactMicros += nMicros;
+        pdb->nLastCompactMicros = nMicros;
+        pdb->nCompacting--;
+    }
+    condLevelDBs.notify_all();
+    return true;
+}
@@ -19,6 +19,43 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Options of one CLevelDB. The defaults come from the share of -dbcache
+ * the database gets; -<name>.<option> overrides them per database. */
+class CLevelDBTuning
+{
+public:
+    std::string strName;        // chainstate, blockindex or blockfilter
+    int nMaxOpenFiles;          // table files kept open
+    size_t nBlockCacheSize;     // uncompressed blocks cached
+    size_t nWriteBufferSize;    // up to two may be held in memory
+    size_t nBlockSize;          // uncompressed size of a table block
+    bool fCompression;          // Snappy, if LevelDB was built with it
+
+    CLevelDBTuning(const std::string &strNameIn, size_t nCacheSize, int nDefaultMaxOpenFiles = 64, bool fDefaultCompression = false);
+
+    std::string ToString() const;
+};
+
+/** Internals of an open CLevelDB, see GetLevelDBStats() */
+class CLevelDBStats
+{
+public:
+    CLevelDBTuning tuning;
+    std::string strStats;           // leveldb.stats: files, size and compaction time per level
+    std::vector<int> vFilesAtLevel;
+    std::string strMemoryUsage;     // leveldb.approximate-memory-usage, empty if this LevelDB lacks it
+    uint64 nCompactions;            // manual compactions
+    int64 nCompactMicros;
+    int64 nLastCompactMicros;
+
+    CLevelDBStats(const CLevelDBTuning &tuningIn) : tuning(tuningIn), nCompactions(0), nCompactMicros(0), nLastCompactMicros(0) {}
+};
+
+/** Statistics of all open databases */
+void GetLevelDBStats(std::vector<CLevelDBStats> &vStats);
+/** Compact the whole key range of the open database strName; false if none has that name */
+bool CompactLevelDB(const std::string &strName, int64 &nMicros);
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -76,18 +113,31 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    CLevelDBTuning tuning;
+
+    // manual compactions (CompactLevelDB), under its lock
+    int nCompacting;
+    uint64 nCompactions;
+    int64 nCompactMicros;
+    int64 nLastCompactMicros;
+
+    friend void GetLevelDBStats(std::vector<CLevelDBStats> &vStats);
+    friend bool CompactLevelDB(const std::string &strName, int64 &nMicros);
+
 public:
-    CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDB(const boost::filesystem::path &path, const CLevelDBTuning &tuningIn, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
 
-    template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
+    template<typename K, typename V> bool Read(const K& key, V& value, const leveldb::Snapshot *psnapshot = NULL) throw(leveldb_error) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -109,14 +159,16 @@ public:
         return WriteBatch(batch, fSync);
     }
 
-    template<typename K> bool Exists(const K& key) throw(leveldb_error) {
+    template<typename K> bool Exists(const K& key, const leveldb::Snapshot *psnapshot = NULL) throw(leveldb_error) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -145,8 +197,19 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator *NewIterator() {
-        return pdb->NewIterator(iteroptions);
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *psnapshot = NULL) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
+    }
+
+    // reads passing a snapshot see the database as it was when the snapshot was taken
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) {
+        pdb->ReleaseSnapshot(psnapshot);
     }
 };
 
@@ -4,26 +4,68 @@
 #ifndef BITCOIN_LIMITEDMAP_H
 #define BITCOIN_LIMITEDMAP_H
 
-#include <map>
-#include <deque>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
 
-/** STL-like map container that only keeps the N elements with the highest value. */
-template <typename K, typename V> class limitedmap
+/** STL-like map container that only keeps the N elements with the highest value.
+ *
+ * Lookups go through a hash table. The lowest value is found with a lazy
+ * min-heap of (value, key) entries: erase() and update() leave the old entry
+ * in the heap, and it is skipped when it reaches the top because it no longer
+ * matches the table. The heap is rebuilt when stale entries pile up.
+ */
+template <typename K, typename V, typename H = boost::hash<K> > class limitedmap
 {
 public:
     typedef K key_type;
     typedef V mapped_type;
     typedef std::pair<const key_type, mapped_type> value_type;
-    typedef typename std::map<K, V>::const_iterator const_iterator;
-    typedef typename std::map<K, V>::size_type size_type;
+    typedef typename boost::unordered_map<K, V, H>::const_iterator const_iterator;
+    typedef typename boost::unordered_map<K, V, H>::size_type size_type;
 
 protected:
-    std::map<K, V> map;
-    typedef typename std::map<K, V>::iterator iterator;
-    std::multimap<V, iterator> rmap;
-    typedef typename std::multimap<V, iterator>::iterator rmap_iterator;
+    boost::unordered_map<K, V, H> map;
+    typedef typename boost::unordered_map<K, V, H>::iterator iterator;
+    typedef std::pair<V, K> heap_entry;
+    std::vector<heap_entry> heap;
     size_type nMaxSize;
 
+    void push(const K& k, const V& v)
+    {
+        heap.push_back(heap_entry(v, k));
+        std::push_heap(heap.begin(), heap.end(), std::greater<heap_entry>());
+        if (heap.size() > 2 * map.size() + 64)
+            rebuild();
+    }
+
+    void rebuild()
+    {
+        heap.clear();
+        heap.reserve(map.size());
+        for (const_iterator it = map.begin(); it != map.end(); ++it)
+            heap.push_back(heap_entry(it->second, it->first));
+        std::make_heap(heap.begin(), heap.end(), std::greater<heap_entry>());
+    }
+
+    void evict()
+    {
+        while (!heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<heap_entry>());
+            heap_entry entry = heap.back();
+            heap.pop_back();
+            iterator it = map.find(entry.second);
+            if (it != map.end() && it->second == entry.first)
+            {
+                map.erase(it);
+                return;
+            }
+        }
+    }
+
 public:
     limitedmap(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
     const_iterator begin() const { return map.begin(); }
@@ -38,60 +80,31 @@ public:
         if (ret.second)
         {
             if (nMaxSize && map.size() == nMaxSize)
-            {
-                map.erase(rmap.begin()->second);
-                rmap.erase(rmap.begin());
-            }
-            rmap.insert(make_pair(x.second, ret.first));
+                evict();
+            push(x.first, x.second);
         }
         return;
     }
     void erase(const key_type& k)
     {
-        iterator itTarget = map.find(k);
-        if (itTarget == map.end())
-            return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget)
-            {
-                rmap.erase(it);
-                map.erase(itTarget);
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0); //TODO remove me
-        map.erase(itTarget);
+        map.erase(k);
+        if (map.empty())
+            heap.clear();
     }
     void update(const_iterator itIn, const mapped_type& v)
     {
-        //TODO: When we switch to C++11, use map.erase(itIn, itIn) to get the non-const iterator
         iterator itTarget = map.find(itIn->first);
         if (itTarget == map.end())
             return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget)
-            {
-                rmap.erase(it);
-                itTarget->second = v;
-                rmap.insert(make_pair(v, itTarget));
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0); //TODO remove me
         itTarget->second = v;
-        rmap.insert(make_pair(v, itTarget));
+        push(itTarget->first, v);
     }
     size_type max_size() const { return nMaxSize; }
     size_type max_size(size_type s)
     {
         if (s)
             while (map.size() > s)
-            {
-                map.erase(rmap.begin()->second);
-                rmap.erase(rmap.begin());
-            }
+                evict();
         nMaxSize = s;
         return nMaxSize;
     }
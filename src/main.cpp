@@ -54,6 +54,15 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fBlockFilterIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64 nPruneTarget = 0;
+static bool fCheckForPruning = false;
+// set while ThreadVerifyDB reads old blocks and undo data; requires LOCK(cs_main)
+static bool fVerifyingDB = false;
 int pzy = 4*4+2;
 int RequestedMasterNodeList = 0;
 unsigned int nCoinCacheSize = 5000;
@@ -76,8 +85,27 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// Headers-first sync: header-only index entries for blocks that are not in the
+// block tree yet, in chain order. The first entry's pprev is in mapBlockIndex,
+// so retarget checks can walk back through both.
+map<uint256, CBlockIndex*> mapHeaderIndex;
+deque<CBlockIndex*> vHeaderChain;
+
+struct CBlockInFlight
+{
+    CNode* pnode; // referenced while the request is outstanding
+    int64 nTime;
+};
+map<uint256, CBlockInFlight> mapBlocksInFlight;
+
+boost::unordered_map<uint256, COrphanTx, CUint256Hasher> mapOrphanTransactions;
+boost::unordered_map<uint256, set<uint256>, CUint256Hasher> mapOrphanTransactionsByPrev;
+vector<uint256> vOrphanList;
+unsigned int nOrphanTransactionsSize = 0;
+static map<NodeId, unsigned int> mapOrphanTransactionsSizeByPeer;
+static int64 nNextOrphanSweep = 0;
+// Accepted transactions whose dependent orphans still need to be re-tried
+static deque<uint256> vOrphanWorkQueue;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -192,6 +220,8 @@ CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
 bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) { return false; }
+CCoinsView *CCoinsView::NewSnapshot() { return NULL; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
@@ -203,6 +233,8 @@ bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestB
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) { return base->DumpCoins(fileout, hasher, header); }
+CCoinsView *CCoinsViewBacked::NewSnapshot() { return base->NewSnapshot(); }
 
 CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
 
@@ -236,8 +268,20 @@ CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
     return it->second;
 }
 
+// An entry keeps the origin it was read with; only new entries take the one passed in
+void static MergeCoins(std::map<uint256, CCoins> &mapCoins, const uint256 &txid, const CCoins &coins) {
+    std::map<uint256, CCoins>::iterator it = mapCoins.lower_bound(txid);
+    if (it != mapCoins.end() && it->first == txid) {
+        CCoinsOrigin origin = it->second.origin;
+        it->second = coins;
+        it->second.origin = origin;
+    } else {
+        mapCoins.insert(it, std::make_pair(txid, coins));
+    }
+}
+
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    MergeCoins(cacheCoins, txid, coins);
     return true;
 }
 
@@ -258,7 +302,7 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
 
 bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
     for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+        MergeCoins(cacheCoins, it->first, it->second);
     pindexTip = pindex;
     return true;
 }
@@ -294,14 +338,16 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewFlusher *pcoinsflusher = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CBlockFilterDB *pblockfilterdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -312,54 +358,169 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is also bounded by MAX_ORPHAN_TRANSACTIONS_SIZE,
+    // and a single peer can only fill a tenth of it.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
     if (sz > 5000)
     {
         printf("ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString().c_str());
         return false;
     }
+    if (peer >= 0 && mapOrphanTransactionsSizeByPeer[peer] + sz > MAX_PEER_ORPHAN_TRANSACTIONS_SIZE)
+    {
+        printf("ignoring orphan tx %s, peer=%d is over its quota\n", hash.ToString().c_str(), peer);
+        return false;
+    }
 
-    mapOrphanTransactions[hash] = tx;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = sz;
+    orphan.nListPos = vOrphanList.size();
+    vOrphanList.push_back(hash);
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    nOrphanTransactionsSize += sz;
+    if (peer >= 0)
+        mapOrphanTransactionsSizeByPeer[peer] += sz;
 
-    printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().c_str(),
-        mapOrphanTransactions.size());
+    printf("stored orphan tx %s (mapsz %"PRIszu", %u bytes)\n", hash.ToString().c_str(),
+        mapOrphanTransactions.size(), nOrphanTransactionsSize);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+void EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    boost::unordered_map<uint256, COrphanTx, CUint256Hasher>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        boost::unordered_map<uint256, set<uint256>, CUint256Hasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+
+    // Move the last entry of vOrphanList into the hole
+    uint256 hashLast = vOrphanList.back();
+    vOrphanList[orphan.nListPos] = hashLast;
+    mapOrphanTransactions[hashLast].nListPos = orphan.nListPos;
+    vOrphanList.pop_back();
+
+    nOrphanTransactionsSize -= orphan.nSize;
+    if (orphan.fromPeer >= 0)
+    {
+        map<NodeId, unsigned int>::iterator itPeer = mapOrphanTransactionsSizeByPeer.find(orphan.fromPeer);
+        itPeer->second -= orphan.nSize;
+        if (itPeer->second == 0)
+            mapOrphanTransactionsSizeByPeer.erase(itPeer);
+    }
+    mapOrphanTransactions.erase(it);
+}
+
+void EraseOrphansFor(NodeId peer)
+{
+    if (!mapOrphanTransactionsSizeByPeer.count(peer))
+        return;
+    unsigned int nErased = 0;
+    for (unsigned int i = 0; i < vOrphanList.size(); )
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        if (mapOrphanTransactions[vOrphanList[i]].fromPeer == peer)
+        {
+            // the last entry moves into position i
+            EraseOrphanTx(vOrphanList[i]);
+            ++nErased;
+        }
+        else
+            i++;
     }
-    mapOrphanTransactions.erase(hash);
+    // EraseOrphanTx dropped the peer's entry with its last orphan
+    assert(!mapOrphanTransactionsSizeByPeer.count(peer));
+    printf("erased %u orphan tx from peer=%d\n", nErased, peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Expired orphans go first. The pool is swept on a timer rather than on
+    // every store, so a flood of orphans doesn't turn into a scan per message.
+    int64 nNow = GetTime();
+    if (nNextOrphanSweep <= nNow)
+    {
+        for (unsigned int i = 0; i < vOrphanList.size(); )
+        {
+            if (mapOrphanTransactions[vOrphanList[i]].nTimeExpire <= nNow)
+            {
+                // the last entry moves into position i
+                EraseOrphanTx(vOrphanList[i]);
+                ++nEvicted;
+            }
+            else
+                i++;
+        }
+        nNextOrphanSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxBytes)
     {
         // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        EraseOrphanTx(vOrphanList[GetRand(vOrphanList.size())]);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+void ProcessOrphanWork(unsigned int nMaxWork)
+{
+    unsigned int nWork = 0;
+    vector<uint256> vEraseQueue;
+    while (!vOrphanWorkQueue.empty() && nWork < nMaxWork)
+    {
+        uint256 hashPrev = vOrphanWorkQueue.front();
+        vOrphanWorkQueue.pop_front();
+        boost::unordered_map<uint256, set<uint256>, CUint256Hasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(hashPrev);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+
+        BOOST_FOREACH(const uint256& orphanHash, itPrev->second)
+        {
+            CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+            nWork++;
+
+            if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+            {
+                printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
+                RelayTransaction(orphanTx, orphanHash);
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+                vOrphanWorkQueue.push_back(orphanHash);
+                vEraseQueue.push_back(orphanHash);
+            }
+            else if (!fMissingInputs2)
+            {
+                // invalid or too-little-fee orphan
+                vEraseQueue.push_back(orphanHash);
+                printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
+            }
+        }
+
+        // Erasing invalidates itPrev, so it waits until the set is done
+        BOOST_FOREACH(const uint256& hash, vEraseQueue)
+            EraseOrphanTx(hash);
+        vEraseQueue.clear();
+    }
+}
+
 
 
 
@@ -1062,11 +1223,78 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        if (fAddressIndex)
+            addAddressIndex(hash, tx);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::addAddressIndex(const uint256& hash, const CTransaction &tx)
+{
+    // requires LOCK(cs) and LOCK(cs_main), for the coins of the inputs
+    int64 nTime = GetTime();
+    std::vector<CMempoolAddressDeltaKey>& vInserted = mapAddressInserted[hash];
+
+    for (unsigned int j = 0; j < tx.vin.size(); j++) {
+        const COutPoint &prevout = tx.vin[j].prevout;
+        CTxOut txout;
+        std::map<uint256, CTransaction>::const_iterator it = mapTx.find(prevout.hash);
+        if (it != mapTx.end()) {
+            if (prevout.n >= it->second.vout.size())
+                continue;
+            txout = it->second.vout[prevout.n];
+        } else {
+            CCoins coins;
+            if (!pcoinsTip->GetCoins(prevout.hash, coins) || !coins.IsAvailable(prevout.n))
+                continue;
+            txout = coins.vout[prevout.n];
+        }
+
+        int nType;
+        uint160 hashBytes;
+        if (!GetAddressIndexDestination(txout.scriptPubKey, nType, hashBytes))
+            continue;
+        CMempoolAddressDeltaKey key(nType, hashBytes, hash, j, true);
+        mapAddress[key] = CMempoolAddressDelta(nTime, -txout.nValue, prevout.hash, prevout.n);
+        vInserted.push_back(key);
+    }
+
+    for (unsigned int k = 0; k < tx.vout.size(); k++) {
+        int nType;
+        uint160 hashBytes;
+        if (!GetAddressIndexDestination(tx.vout[k].scriptPubKey, nType, hashBytes))
+            continue;
+        CMempoolAddressDeltaKey key(nType, hashBytes, hash, k, false);
+        mapAddress[key] = CMempoolAddressDelta(nTime, tx.vout[k].nValue);
+        vInserted.push_back(key);
+    }
+}
+
+void CTxMemPool::removeAddressIndex(const uint256& hash)
+{
+    // requires LOCK(cs)
+    std::map<uint256, std::vector<CMempoolAddressDeltaKey> >::iterator it = mapAddressInserted.find(hash);
+    if (it == mapAddressInserted.end())
+        return;
+    BOOST_FOREACH(const CMempoolAddressDeltaKey& key, it->second)
+        mapAddress.erase(key);
+    mapAddressInserted.erase(it);
+}
+
+void CTxMemPool::getAddressIndex(const std::vector<std::pair<uint160, int> >& vAddresses,
+                                 std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >& vResults)
+{
+    LOCK(cs);
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta>::const_iterator mi = mapAddress.lower_bound(CMempoolAddressDeltaKey(it->second, it->first));
+        while (mi != mapAddress.end() && mi->first.nType == it->second && mi->first.hashBytes == it->first) {
+            vResults.push_back(*mi);
+            mi++;
+        }
+    }
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -1086,6 +1314,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+            removeAddressIndex(hash);
             nTransactionsUpdated++;
         }
     }
@@ -1112,6 +1341,8 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapAddress.clear();
+    mapAddressInserted.clear();
     ++nTransactionsUpdated;
 }
 
@@ -1710,6 +1941,30 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         return VirtualGravityWave3(pindexLast, pblock);
 }
 
+// Check a block's nBits against the retarget rules, given its parent
+bool static CheckNextWorkRequired(CValidationState &state, const CBlockHeader& block, const CBlockIndex* pindexPrev)
+{
+    int Vcoinh = pindexPrev->Vcoinh+1;
+    if(fTestNet) {
+        if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+            return state.DoS(100, error("CheckNextWorkRequired() : incorrect proof of work"));
+    } else {
+        // Check proof of work (Here for the architecture issues with DGW v1 and v2)
+        if(Vcoinh <= 10000){
+            unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, &block);
+            double n1 = ConvertBitsToDouble(block.nBits);
+            double n2 = ConvertBitsToDouble(nBitsNext);
+
+            if (abs(n1-n2) > n1*0.2) 
+                return state.DoS(100, error("CheckNextWorkRequired() : incorrect proof of work (DGW pre-fork)"));
+        } else {
+            if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+                return state.DoS(100, error("CheckNextWorkRequired() : incorrect proof of work"));
+        }
+    }
+    return true;
+}
+
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
@@ -2056,11 +2311,30 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // VerifyDB disconnects blocks on a scratch view (and asks for pfClean);
+    // the address and spent indexes only follow the real chain
+    bool fUpdateIndexes = fAddressIndex && !pfClean;
+    bool fUpdateSpentIndex = fSpentIndex && !pfClean;
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+
     // undo transactions in reverse order
     for (int i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fUpdateIndexes) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                int nType;
+                uint160 hashBytes;
+                if (!GetAddressIndexDestination(tx.vout[k].scriptPubKey, nType, hashBytes))
+                    continue;
+                vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->Vcoinh, i, hash, k, false), tx.vout[k].nValue));
+                vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
@@ -2078,7 +2352,7 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
             fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
-        outs = CCoins();
+        outs.Clear();
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -2109,10 +2383,34 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 coins.vout[out.n] = undo.txout;
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
+
+                if (fUpdateSpentIndex)
+                    vSpentIndex.push_back(make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+
+                if (fUpdateIndexes) {
+                    int nType;
+                    uint160 hashBytes;
+                    if (GetAddressIndexDestination(undo.txout.scriptPubKey, nType, hashBytes)) {
+                        vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->Vcoinh, i, hash, j, true), -undo.txout.nValue));
+                        vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, out.hash, out.n),
+                                                                 CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins.Vcoinh)));
+                    }
+                }
             }
         }
     }
 
+    if (fUpdateIndexes) {
+        if (!pblocktree->EraseAddressIndex(vAddressIndex))
+            return state.Abort(_("Failed to delete address index"));
+        if (!pblocktree->UpdateAddressUnspentIndex(vAddressUnspentIndex))
+            return state.Abort(_("Failed to write address unspent index"));
+    }
+
+    if (fUpdateSpentIndex)
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return state.Abort(_("Failed to write spent index"));
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev);
 
@@ -2147,6 +2445,202 @@ void static FlushBlockFile(bool fFinalize = false)
     }
 }
 
+//
+// CCoinsViewFlusher
+//
+
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsView &baseIn) : CCoinsViewBacked(baseIn),
+    pindexQueued(NULL), pindexWriting(NULL), fWriting(false), fFailed(false), fQuit(false)
+{
+    pthread = new boost::thread(boost::bind(&CCoinsViewFlusher::ThreadWrite, this));
+}
+
+CCoinsViewFlusher::~CCoinsViewFlusher()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condWrite.notify_all();
+    // the writer drains the queue before it exits
+    pthread->join();
+    delete pthread;
+}
+
+void CCoinsViewFlusher::ThreadWrite()
+{
+    RenameThread("bitcoin-coinsflush");
+
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && mapQueued.empty() && pindexQueued == NULL)
+                condWrite.wait(lock);
+            if (mapQueued.empty() && pindexQueued == NULL)
+                return;
+            mapWriting.swap(mapQueued);
+            pindexWriting = pindexQueued;
+            pindexQueued = NULL;
+            fWriting = true;
+        }
+
+        // Blocks and undo data first, then the block index, then the coins
+        // that depend on them
+        int64 nStart = GetTimeMicros();
+        FlushBlockFile();
+        bool fOk = pblocktree->Sync();
+        int64 nSynced = GetTimeMicros();
+        uint64 nBytes = 0;
+        for (std::map<uint256, CCoins>::const_iterator it = mapWriting.begin(); it != mapWriting.end(); it++)
+            nBytes += ::GetSerializeSize(it->second, SER_DISK, CLIENT_VERSION);
+        try {
+            fOk = fOk && base->BatchWrite(mapWriting, pindexWriting);
+        } catch (std::exception &e) {
+            printf("CCoinsViewFlusher::ThreadWrite() : %s\n", e.what());
+            fOk = false;
+        }
+        int64 nEnd = GetTimeMicros();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            stats.nWrites++;
+            stats.nSyncMicros += nSynced - nStart;
+            stats.nWriteMicros += nEnd - nSynced;
+            stats.nLastMicros = nEnd - nStart;
+            stats.nMaxMicros = std::max(stats.nMaxMicros, nEnd - nStart);
+            if (fOk) {
+                stats.nCoinsWritten += mapWriting.size();
+                stats.nBytesWritten += nBytes;
+                mapWriting.clear();
+                pindexWriting = NULL;
+            } else {
+                // keep serving the unwritten changes until shutdown
+                fFailed = true;
+            }
+            fWriting = false;
+        }
+        condWritten.notify_all();
+        if (fOk && fBenchmark)
+            printf("- Coins write: %.2fms (sync %.2fms)\n", (nEnd - nStart) * 0.001, (nSynced - nStart) * 0.001);
+        if (!fOk) {
+            AbortNode(_("Failed to write to coin database"));
+            return;
+        }
+    }
+}
+
+// Changes that are queued or being written, newest first
+bool CCoinsViewFlusher::Find(const uint256 &txid, CCoins &coins)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<uint256, CCoins>::const_iterator it = mapQueued.find(txid);
+    if (it == mapQueued.end()) {
+        it = mapWriting.find(txid);
+        if (it == mapWriting.end())
+            return false;
+    }
+    coins = it->second;
+    return true;
+}
+
+bool CCoinsViewFlusher::GetCoins(const uint256 &txid, CCoins &coins) {
+    // the database drops spent records, so hide them here as well
+    if (Find(txid, coins)) {
+        if (coins.IsPruned())
+            return false;
+        // once written, this is what the database holds
+        coins.origin = CCoinsOrigin(txid, coins);
+        return true;
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewFlusher::HaveCoins(const uint256 &txid) {
+    CCoins coins;
+    if (Find(txid, coins))
+        return !coins.IsPruned();
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewFlusher::SetCoins(const uint256 &txid, const CCoins &coins) {
+    std::map<uint256, CCoins> mapCoins;
+    mapCoins[txid] = coins;
+    return BatchWrite(mapCoins, NULL);
+}
+
+CBlockIndex *CCoinsViewFlusher::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pindexQueued)
+            return pindexQueued;
+        if (pindexWriting)
+            return pindexWriting;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlusher::SetBestBlock(CBlockIndex *pindex) {
+    return BatchWrite(std::map<uint256, CCoins>(), pindex);
+}
+
+bool CCoinsViewFlusher::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
+    int64 nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // While a write is running, queue up at most one more cache's worth of
+    // changes: the cache flushes once it holds more than nCoinCacheSize during
+    // the initial download, so a single flush always goes through, the next
+    // one waits
+    bool fStalled = false;
+    while (fWriting && !fFailed && mapQueued.size() + mapCoins.size() > 2 * nCoinCacheSize) {
+        fStalled = true;
+        condWritten.wait(lock);
+    }
+    if (fFailed)
+        return false;
+    // Changes to an entry that is being written came with it as their origin,
+    // which is what the database holds by the time they are written
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        MergeCoins(mapQueued, it->first, it->second);
+    if (pindex)
+        pindexQueued = pindex;
+    stats.nFlushes++;
+    stats.nCoinsFlushed += mapCoins.size();
+    if (fStalled) {
+        stats.nStalls++;
+        stats.nStallMicros += GetTimeMicros() - nStart;
+    }
+    condWrite.notify_one();
+    return true;
+}
+
+bool CCoinsViewFlusher::Sync() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fFailed && (fWriting || !mapQueued.empty() || pindexQueued != NULL))
+        condWritten.wait(lock);
+    return !fFailed;
+}
+
+// These read the database directly, so it has to be complete first
+bool CCoinsViewFlusher::GetStats(CCoinsStats &stats) {
+    return Sync() && base->GetStats(stats);
+}
+
+bool CCoinsViewFlusher::DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) {
+    return Sync() && base->DumpCoins(fileout, hasher, header);
+}
+
+CCoinsView *CCoinsViewFlusher::NewSnapshot() {
+    if (!Sync())
+        return NULL;
+    return base->NewSnapshot();
+}
+
+void CCoinsViewFlusher::GetFlushStats(CCoinsFlushStats &statsOut) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    statsOut = stats;
+    statsOut.nQueued = mapQueued.size() + mapWriting.size();
+}
+
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
@@ -2156,6 +2650,115 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+// Add the compact filter of a main chain block to the index, chained to the
+// filter header of its parent. fParentIndexed is false (and nothing is
+// written) if the parent isn't indexed yet; false is returned on write errors.
+static bool WriteBlockFilter(const CBlock& block, CBlockIndex* pindex, bool& fParentIndexed)
+{
+    uint256 prevHeader = 0, hashPrevFilter;
+    fParentIndexed = !pindex->pprev || pblockfilterdb->ReadFilterHeader(pindex->pprev->GetBlockHash(), prevHeader, hashPrevFilter);
+    if (!fParentIndexed)
+        return true;
+    CBlockFilter filter(block);
+    return pblockfilterdb->WriteFilter(filter, filter.GetHeader(prevHeader));
+}
+
+bool GetAddressIndex(const uint160& hashBytes, int nType, std::vector<std::pair<CAddressIndexKey, int64> >& vAddressIndex,
+                     int nStart, int nEnd)
+{
+    if (!fAddressIndex)
+        return error("GetAddressIndex() : address index not enabled");
+    return pblocktree->ReadAddressIndex(hashBytes, nType, vAddressIndex, nStart, nEnd);
+}
+
+bool GetAddressUnspent(const uint160& hashBytes, int nType, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("GetAddressUnspent() : address index not enabled");
+    return pblocktree->ReadAddressUnspentIndex(hashBytes, nType, vUnspentOutputs);
+}
+
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return false;
+
+    // Unconfirmed spenders aren't in the index; the memory pool knows them
+    {
+        LOCK(mempool.cs);
+        std::map<COutPoint, CInPoint>::const_iterator it = mempool.mapNextTx.find(COutPoint(key.txid, key.nOut));
+        if (it != mempool.mapNextTx.end()) {
+            value = CSpentIndexValue(it->second.ptx->GetHash(), it->second.n, -1, 0, 0, 0);
+            CTxOut txout;
+            std::map<uint256, CTransaction>::const_iterator mi = mempool.mapTx.find(key.txid);
+            if (mi != mempool.mapTx.end() && key.nOut < mi->second.vout.size()) {
+                txout = mi->second.vout[key.nOut];
+            } else {
+                CCoins coins;
+                if (pcoinsTip->GetCoins(key.txid, coins) && coins.IsAvailable(key.nOut))
+                    txout = coins.vout[key.nOut];
+            }
+            if (!txout.IsNull()) {
+                value.nValue = txout.nValue;
+                if (!GetAddressIndexDestination(txout.scriptPubKey, value.nType, value.hashBytes))
+                    value.nType = 0;
+            }
+            return true;
+        }
+    }
+
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetBlockFilter(const uint256& hash, CBlockFilter& filter, uint256& header)
+{
+    uint256 hashFilter;
+    if (!pblockfilterdb)
+        return false;
+    return pblockfilterdb->ReadFilter(hash, filter) && pblockfilterdb->ReadFilterHeader(hash, header, hashFilter);
+}
+
+void ThreadBlockFilterIndex()
+{
+    RenameThread("bitcoin-filterindex");
+
+    int64 nStart = GetTimeMillis();
+    int nBuilt = 0;
+    CBlockIndex* pindex = NULL;
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        {
+            LOCK(cs_main);
+            // Step back over blocks a reorganization took out of the main chain
+            while (pindex && !pindex->IsInMainChain())
+                pindex = pindex->pprev;
+            pindex = pindex ? pindex->pnext : pindexGenesisBlock;
+        }
+        // From the tip on ConnectBlock indexes new blocks itself, so only now
+        // can we serve filters for the whole chain
+        if (!pindex)
+        {
+            LOCK(cs_main);
+            nLocalServices |= NODE_COMPACT_FILTERS;
+            break;
+        }
+
+        uint256 header, hashFilter;
+        if (pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), header, hashFilter))
+            continue;
+        CBlock block;
+        bool fParentIndexed;
+        if (!block.ReadFromDisk(pindex) || !WriteBlockFilter(block, pindex, fParentIndexed) || !fParentIndexed)
+        {
+            printf("ThreadBlockFilterIndex() : failed to index block %s\n", pindex->GetBlockHash().ToString().c_str());
+            break;
+        }
+        nBuilt++;
+    }
+    printf("ThreadBlockFilterIndex() : built %d block filters in %"PRI64d"ms\n", nBuilt, GetTimeMillis() - nStart);
+}
+
 bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in
@@ -2214,6 +2817,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
@@ -2244,6 +2850,35 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            if ((fAddressIndex || fSpentIndex) && !fJustCheck) {
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const CTxOut &prevout = view.GetCoins(tx.vin[j].prevout.hash).vout[tx.vin[j].prevout.n];
+                    int nType = 0;
+                    uint160 hashBytes = 0;
+                    bool fIndexed = GetAddressIndexDestination(prevout.scriptPubKey, nType, hashBytes);
+                    if (fSpentIndex)
+                        vSpentIndex.push_back(make_pair(CSpentIndexKey(tx.vin[j].prevout.hash, tx.vin[j].prevout.n),
+                                                        CSpentIndexValue(GetTxHash(i), j, pindex->Vcoinh, prevout.nValue, fIndexed ? nType : 0, hashBytes)));
+                    if (!fAddressIndex || !fIndexed)
+                        continue;
+                    vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->Vcoinh, i, GetTxHash(i), j, true), -prevout.nValue));
+                    vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, tx.vin[j].prevout.hash, tx.vin[j].prevout.n),
+                                                             CAddressUnspentValue()));
+                }
+            }
+        }
+
+        if (fAddressIndex && !fJustCheck) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                int nType;
+                uint160 hashBytes;
+                if (!GetAddressIndexDestination(tx.vout[k].scriptPubKey, nType, hashBytes))
+                    continue;
+                vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->Vcoinh, i, GetTxHash(i), k, false), tx.vout[k].nValue));
+                vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, GetTxHash(i), k),
+                                                         CAddressUnspentValue(tx.vout[k].nValue, tx.vout[k].scriptPubKey, pindex->Vcoinh)));
+            }
         }
 
         CTxUndo txundo;
@@ -2296,6 +2931,25 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (fAddressIndex) {
+        if (!pblocktree->WriteAddressIndex(vAddressIndex))
+            return state.Abort(_("Failed to write address index"));
+        if (!pblocktree->UpdateAddressUnspentIndex(vAddressUnspentIndex))
+            return state.Abort(_("Failed to write address unspent index"));
+    }
+
+    if (fSpentIndex)
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return state.Abort(_("Failed to write spent index"));
+
+    // Before its parent is indexed ThreadBlockFilterIndex is still catching up
+    // and will get to this block
+    if (fBlockFilterIndex) {
+        bool fParentIndexed;
+        if (!WriteBlockFilter(*this, pindex, fParentIndexed))
+            return state.Abort(_("Failed to write block filter index"));
+    }
+
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
@@ -2306,6 +2960,90 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     return true;
 }
 
+// Delete the oldest block and undo files while the files on disk take more
+// than nPruneTarget bytes. Only files that were left behind by FindBlockPos are
+// candidates, and none holding a block within MIN_BLOCKS_TO_KEEP of the tip.
+// requires LOCK(cs_main)
+bool static PruneBlockFiles(CValidationState &state)
+{
+    if (fReindex || fImporting)
+        return true;
+    // Not while the background verification reads the files; the flag below
+    // stays set, so the next flush looks again
+    if (fVerifyingDB)
+        return true;
+
+    // The flag stays set until a pass gets usage within the target, so
+    // files that are still too recent to prune are looked at again later
+    LOCK(cs_LastBlockFile);
+    if (!fCheckForPruning)
+        return true;
+
+    uint64 nUsage = infoLastBlockFile.nSize + infoLastBlockFile.nUndoSize;
+    std::vector<CBlockFileInfo> vinfoBlockFile(nLastBlockFile);
+    for (int nFile = 0; nFile < nLastBlockFile; nFile++) {
+        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+        nUsage += vinfoBlockFile[nFile].nSize + vinfoBlockFile[nFile].nUndoSize;
+    }
+    if (nUsage <= nPruneTarget) {
+        fCheckForPruning = false;
+        return true;
+    }
+
+    std::set<int> setFilesToPrune;
+    for (int nFile = 0; nFile < nLastBlockFile && nUsage > nPruneTarget; nFile++) {
+        const CBlockFileInfo &info = vinfoBlockFile[nFile];
+        if (info.nSize == 0 && info.nUndoSize == 0)
+            continue; // already pruned
+        if ((int)info.VcoinhLast + MIN_BLOCKS_TO_KEEP > nBestHeight)
+            continue;
+        setFilesToPrune.insert(nFile);
+        nUsage -= info.nSize + info.nUndoSize;
+    }
+    if (setFilesToPrune.empty())
+        return true;
+
+    // The coin database must not depend on undo data that is about to go away
+    FlushBlockFile();
+    if (!pcoinsTip->Flush() || (pcoinsflusher && !pcoinsflusher->Sync()))
+        return state.Abort(_("Failed to write to coin database"));
+
+    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi) {
+        CBlockIndex *pindex = mi->second;
+        if ((pindex->nStatus & BLOCK_HAVE_MASK) && setFilesToPrune.count(pindex->nFile)) {
+            pindex->nStatus &= ~BLOCK_HAVE_MASK;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+                return state.Abort(_("Failed to write block index"));
+        }
+    }
+
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        if (!pblocktree->WriteBlockFileInfo(nFile, CBlockFileInfo()))
+            return state.Abort(_("Failed to write file info"));
+    }
+    fHavePruned = true;
+    pblocktree->WriteFlag("prunedblockfiles", true);
+    if (!pblocktree->Sync())
+        return state.Abort(_("Failed to sync block index"));
+
+    // Only remove the files once the index no longer points into them
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        boost::filesystem::path pathBlocks = GetDataDir() / "blocks";
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathBlocks / strprintf("blk%05u.dat", nFile), ec);
+        boost::filesystem::remove(pathBlocks / strprintf("rev%05u.dat", nFile), ec);
+        printf("Pruned block file %i: %s\n", nFile, vinfoBlockFile[nFile].ToString().c_str());
+    }
+    printf("PruneBlockFiles(): %u files pruned, %"PRI64u" MiB of block data left (target %"PRI64u" MiB)\n",
+        (unsigned int)setFilesToPrune.size(), nUsage / 1024 / 1024, nPruneTarget / 1024 / 1024);
+    if (nUsage <= nPruneTarget)
+        fCheckForPruning = false;
+    return true;
+}
+
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 {
     // All modifications to the coin state will be done in this cache.
@@ -2403,12 +3141,15 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error();
-        FlushBlockFile();
-        pblocktree->Sync();
+        // pcoinsflusher syncs the block files and the block index before
+        // it writes the coins, off cs_main
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
     }
 
+    if (fPruneMode && !PruneBlockFiles(state))
+        return false;
+
     // At this point, all changes have been done to the database.
     // Proceed by updating the memory structures.
 
@@ -2554,6 +3295,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
             printf("Leaving block file %i: %s\n", nLastBlockFile, infoLastBlockFile.ToString().c_str());
             FlushBlockFile(true);
             nLastBlockFile++;
+            fCheckForPruning = true;
             infoLastBlockFile.SetNull();
             pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
             fUpdatedLast = true;
@@ -2821,8 +3563,11 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
 
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
-    // recalculated many times during this block's validation.
-    BuildMerkleTree();
+    // recalculated many times during this block's validation. A caller that
+    // checked the merkle root itself has built it already.
+    uint256 hashMerkleRootBuilt = 0;
+    if (fCheckMerkleRoot || vMerkleTree.empty())
+        hashMerkleRootBuilt = BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2842,7 +3587,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
@@ -2865,23 +3610,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         pindexPrev = (*mi).second;
         Vcoinh = pindexPrev->Vcoinh+1;
 
-        if(fTestNet) {
-            if (nBits != GetNextWorkRequired(pindexPrev, this))
-                return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
-        } else {
-            // Check proof of work (Here for the architecture issues with DGW v1 and v2)
-            if(Vcoinh <= 10000){
-                unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, this);
-                double n1 = ConvertBitsToDouble(nBits);
-                double n2 = ConvertBitsToDouble(nBitsNext);
-
-                if (abs(n1-n2) > n1*0.2) 
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work (DGW pre-fork)"));
-            } else {
-                if (nBits != GetNextWorkRequired(pindexPrev, this))
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
-            }
-        }
+        if (!CheckNextWorkRequired(state, *this, pindexPrev))
+            return error("AcceptBlock() : incorrect proof of work");
 
         // Prevent blocks from too far in the future
         if(fTestNet || Vcoinh >= 10000){
@@ -2983,7 +3713,7 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fPreChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2993,7 +3723,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!pblock->CheckBlock(state, !fPreChecked, !fPreChecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -3020,8 +3750,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            if (pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2)))
+            // Ask this guy to fill in what we're missing, unless headers-first
+            // sync already knows the blocks in between
+            if (!mapHeaderIndex.count(hash) && pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2)))
                 printf("send fill-in getblocks for %s peer=%d\n", hash.ToString().c_str(), pfrom->id);
         }
         return true;
@@ -3075,53 +3806,178 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 {
     header = block.GetBlockHeader();
 
-    vector<bool> vMatch;
-    vector<uint256> vHashes;
-
-    vMatch.reserve(block.vtx.size());
-    vHashes.reserve(block.vtx.size());
+    // The first vtx.size() entries of the merkle tree are the txids
+    if (block.vMerkleTree.empty())
+        block.BuildMerkleTree();
+    const vector<uint256>& vTree = block.vMerkleTree;
 
+    vector<bool> vMatch(block.vtx.size(), false);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i], hash))
+        if (filter.IsRelevantAndUpdate(block.vtx[i], vTree[i]))
         {
-            vMatch.push_back(true);
-            vMatchedTxn.push_back(make_pair(i, hash));
+            vMatch[i] = true;
+            vMatchedTxn.push_back(make_pair(i, vTree[i]));
         }
-        else
-            vMatch.push_back(false);
-        vHashes.push_back(hash);
     }
 
-    txn = CPartialMerkleTree(vHashes, vMatch);
+    txn = CPartialMerkleTree(vTree, block.vtx.size(), vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlock& block, const std::vector<CBloomTxKeys>& vKeys, CBloomFilter& filter)
+{
+    header = block.GetBlockHeader();
+    assert(vKeys.size() == block.vtx.size() && !block.vMerkleTree.empty());
+    const vector<uint256>& vTree = block.vMerkleTree;
+
+    vector<bool> vMatch(block.vtx.size(), false);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (filter.IsRelevantAndUpdate(block.vtx[i], vKeys[i]))
+        {
+            vMatch[i] = true;
+            vMatchedTxn.push_back(make_pair(i, vTree[i]));
+        }
+    }
 
+    txn = CPartialMerkleTree(vTree, block.vtx.size(), vMatch);
+}
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    nShortIDNonce = GetRand(std::numeric_limits<uint64>::max());
+
+    // The receiver can never have the coinbase in its memory pool
+    CPrefilledTransaction prefilled;
+    prefilled.nIndex = 0;
+    prefilled.tx = block.vtx[0];
+    vPrefilledTxn.push_back(prefilled);
+
+    uint64 k0, k1;
+    GetSipHashKeys(k0, k1);
+    vchShortTxIDs.reserve((block.vtx.size() - 1) * SHORTTXID_SIZE);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        uint64 nShortID = GetShortID(k0, k1, block.vtx[i].GetHash());
+        for (unsigned int j = 0; j < SHORTTXID_SIZE; j++)
+            vchShortTxIDs.push_back((unsigned char)(nShortID >> (8 * j)));
+    }
+}
 
+void CCompactBlock::GetSipHashKeys(uint64& k0, uint64& k1) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nShortIDNonce;
+    uint256 hash = ss.GetHash();
+    k0 = hash.Get64(0);
+    k1 = hash.Get64(1);
+}
 
+uint64 CCompactBlock::GetShortID(unsigned int n) const
+{
+    uint64 nShortID = 0;
+    for (unsigned int j = 0; j < SHORTTXID_SIZE; j++)
+        nShortID |= (uint64)vchShortTxIDs[n * SHORTTXID_SIZE + j] << (8 * j);
+    return nShortID;
+}
 
+int CPartialBlock::Init(const CCompactBlock& cmpctblock, const CTxMemPool& pool)
+{
+    header = cmpctblock.header;
+    nTime = GetTime();
+    vtx.clear();
+    vHave.clear();
+
+    if (cmpctblock.vchShortTxIDs.size() % CCompactBlock::SHORTTXID_SIZE != 0)
+        return READ_INVALID;
+    unsigned int nTxCount = cmpctblock.GetTxCount();
+    if (nTxCount == 0 || nTxCount > MAX_BLOCK_SIZE / 60)
+        return READ_INVALID;
+
+    vtx.resize(nTxCount);
+    vHave.resize(nTxCount, false);
+
+    // Prefilled transactions first, the short ids fill the remaining slots in order
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex])
+            return READ_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
 
+    map<uint64, unsigned int> mapShortIDs;
+    unsigned int nShortID = 0;
+    for (unsigned int i = 0; i < nTxCount; i++)
+    {
+        if (vHave[i])
+            continue;
+        if (!mapShortIDs.insert(make_pair(cmpctblock.GetShortID(nShortID++), i)).second)
+            return READ_FAILED;
+    }
 
-
-uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyong the end of the array - copy left hash otherwise1
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+    uint64 k0, k1;
+    cmpctblock.GetSipHashKeys(k0, k1);
+    vector<bool> vMatched(nTxCount, false);
+    for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end() && !mapShortIDs.empty(); ++mi)
+    {
+        map<uint64, unsigned int>::iterator it = mapShortIDs.find(CCompactBlock::GetShortID(k0, k1, (*mi).first));
+        if (it == mapShortIDs.end())
+            continue;
+        unsigned int nIndex = (*it).second;
+        if (vMatched[nIndex])
+        {
+            // Two pool transactions map to the same slot, don't guess which one
+            vHave[nIndex] = false;
+            vtx[nIndex] = CTransaction();
+            mapShortIDs.erase(it);
+            continue;
+        }
+        vtx[nIndex] = (*mi).second;
+        vHave[nIndex] = true;
+        vMatched[nIndex] = true;
+    }
+    return READ_OK;
+}
+
+void CPartialBlock::GetMissing(std::vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillMissing(const std::vector<CTransaction>& vtxMissing)
+{
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return false;
+        vtx[i] = vtxMissing[nMissing++];
+        vHave[i] = true;
     }
+    return nMissing == vtxMissing.size();
+}
+
+void CPartialBlock::GetBlock(CBlock& block) const
+{
+    block = CBlock(header);
+    block.vtx = vtx;
 }
 
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+
+
+
+
+
+
+
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<bool> &vMatch) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -3130,12 +3986,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(vTree[CalcTreeOffset(height) + pos]);
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vTree, vMatch);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vTree, vMatch);
     }
 }
 
@@ -3170,6 +4026,25 @@ uint256 CPartialMerkleTree::TraverseAndExtract(int height, unsigned int pos, uns
 }
 
 CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) : nTransactions(vTxid.size()), fBad(false) {
+    // hash the levels above the txids once, laid out as in CBlock::vMerkleTree
+    std::vector<uint256> vTree(vTxid);
+    for (unsigned int nSize = vTxid.size(), j = 0; nSize > 1; j += nSize, nSize = (nSize + 1) / 2)
+    {
+        for (unsigned int i = 0; i < nSize; i += 2)
+        {
+            unsigned int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                 BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+    }
+    Build(vTree, vMatch);
+}
+
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTree, unsigned int nTransactionsIn, const std::vector<bool> &vMatch) : nTransactions(nTransactionsIn), fBad(false) {
+    Build(vTree, vMatch);
+}
+
+void CPartialMerkleTree::Build(const std::vector<uint256> &vTree, const std::vector<bool> &vMatch) {
     // reset state
     vBits.clear();
     vHash.clear();
@@ -3180,7 +4055,7 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
         Vcoinh++;
 
     // traverse the partial tree
-    TraverseAndBuild(Vcoinh, 0, vTxid, vMatch);
+    TraverseAndBuild(Vcoinh, 0, vTree, vMatch);
 }
 
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
@@ -3348,6 +4223,25 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    printf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    printf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether block files have ever been pruned
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        printf("LoadBlockIndexDB(): block files have previously been pruned\n");
+
+    // A snapshot load that didn't finish leaves a coin database matching no block
+    bool fLoadingSnapshot = false;
+    pblocktree->ReadFlag("loadingsnapshot", fLoadingSnapshot);
+    if (fLoadingSnapshot)
+        return error("LoadBlockIndexDB() : loading a UTXO snapshot was interrupted, the coin database is incomplete");
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -3370,79 +4264,313 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-bool VerifyDB(int nCheckLevel, int nCheckDepth)
+/** VerifyDB levels 0-2 (read, CheckBlock, undo data) of a list of blocks,
+ * handed out one at a time to a small pool of worker threads. CheckBlock of
+ * blocks under masternode payment enforcement takes cs_main, so the workers
+ * leave those to the calling thread, which may be holding it.
+ */
+class CVerifyDBWorkQueue
 {
-    if (pindexBest == NULL || pindexBest->pprev == NULL)
-        return true;
+public:
+    static const int CHECK_OK = -1;
+    static const int CHECK_DEFERRED = -2;  // CheckBlock left for the caller
 
-    // Verify blocks in the best chain
-    if (nCheckDepth <= 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(*pcoinsTip, true);
-    CBlockIndex* pindexState = pindexBest;
-    CBlockIndex* pindexFailure = NULL;
-    int nGoodTransactions = 0;
-    CValidationState state;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // per block: CHECK_OK, CHECK_DEFERRED or the check level that failed
+    std::vector<int> vResult;
+
+private:
+    boost::mutex mutex;
+    const std::vector<CBlockIndex*>& vBlocks;
+    unsigned int nNext;
+    int nCheckLevel;
+
+    void ThreadCheck()
+    {
+        while (true) {
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nNext >= vBlocks.size())
+                    return;
+                i = nNext++;
+            }
+            vResult[i] = Check(vBlocks[i], false);
+        }
+    }
+
+public:
+    CVerifyDBWorkQueue(const std::vector<CBlockIndex*>& vBlocksIn, int nCheckLevelIn) :
+        vResult(vBlocksIn.size(), CHECK_OK), vBlocks(vBlocksIn), nNext(0), nCheckLevel(nCheckLevelIn) {}
+
+    int Check(CBlockIndex* pindex, bool fCaller)
     {
-        boost::this_thread::interruption_point();
-        if (pindex->Vcoinh < nBestHeight-nCheckDepth)
-            break;
         CBlock block;
         // check level 0: read from disk
         if (!block.ReadFromDisk(pindex))
-            return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+            return 0;
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state, true, true, false))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+        if (nCheckLevel >= 1) {
+            if (!fCaller && block.MasterNodePaymentsOn() && block.MasterNodePaymentsEnforcing())
+                return CHECK_DEFERRED;
+            CValidationState state;
+            if (!block.CheckBlock(state, true, true, false))
+                return 1;
+        }
         // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
+        if (nCheckLevel >= 2) {
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+            if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                return 2;
+        }
+        return CHECK_OK;
+    }
+
+    void Run()
+    {
+        boost::thread_group threads;
+        int nWorkers = std::max(nScriptCheckThreads, 1);
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CVerifyDBWorkQueue::ThreadCheck, this));
+        try {
+            threads.join_all();
+        } catch (boost::thread_interrupted) {
+            // the workers use this object, let them finish their current block first
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nNext = vBlocks.size();
             }
+            threads.join_all();
+            throw;
         }
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+            if (vResult[i] == CHECK_DEFERRED)
+                vResult[i] = Check(vBlocks[i], true);
+    }
+};
+
+// Background verification (-checkbackground)
+static CCriticalSection cs_verifydb;
+static CVerifyDBStatus verifyDBStatus;
+
+void GetVerifyDBStatus(CVerifyDBStatus& status)
+{
+    LOCK(cs_verifydb);
+    status = verifyDBStatus;
+}
+
+/** VerifyDB levels 3 and 4: disconnect the blocks down from pindexTip in
+ * memory on top of coins, then connect them again. In the background coins
+ * is a snapshot of the database and cs_main is only taken around
+ * ConnectBlock (the script check queue has a single master); the blocks are
+ * then connected with fJustCheck, so no undo data is rewritten.
+ */
+bool static VerifyDBCoins(CCoinsViewCache& coins, CBlockIndex* pindexTip, int nCheckLevel, int nCheckDepth, bool fBackground, std::string& strError)
+{
+    CBlockIndex* pindexState = pindexTip;
+    CBlockIndex* pindexFailure = NULL;
+    std::vector<CBlockIndex*> vDisconnected;
+    int nGoodTransactions = 0;
+    CValidationState state;
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
+    {
+        boost::this_thread::interruption_point();
+        if (pindex->Vcoinh < pindexTip->Vcoinh-nCheckDepth)
+            break;
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
-            bool fClean = true;
-            if (!block.DisconnectBlock(state, pindex, coins, &fClean))
-                return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
+        if (coins.GetCacheSize() + (fBackground ? 0 : pcoinsTip->GetCacheSize()) > 2*nCoinCacheSize + 32000)
+            break;
+        // the status and file positions of a block index entry change under cs_main
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA))
+                break;
+            pos = pindex->GetBlockPos();
+        }
+        CBlock block;
+        if (!block.ReadFromDisk(pos) || block.GetHash() != pindex->GetBlockHash()) {
+            strError = strprintf("block.ReadFromDisk failed at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+            return error("VerifyDB() : *** %s", strError.c_str());
+        }
+        bool fClean = true;
+        bool fDisconnected;
+        {
+            LOCK(cs_main); // for the undo position
+            fDisconnected = block.DisconnectBlock(state, pindex, coins, &fClean);
+        }
+        if (!fDisconnected) {
+            strError = strprintf("irrecoverable inconsistency in block data at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+            return error("VerifyDB() : *** %s", strError.c_str());
         }
+        pindexState = pindex->pprev;
+        vDisconnected.push_back(pindex);
+        if (!fClean) {
+            nGoodTransactions = 0;
+            pindexFailure = pindex;
+        } else
+            nGoodTransactions += block.vtx.size();
+        if (fBackground) {
+            LOCK(cs_verifydb);
+            verifyDBStatus.nBlocksChecked++;
+        }
+    }
+    if (pindexFailure) {
+        strError = strprintf("coin database inconsistencies found (last %i blocks, %i good transactions before that)", pindexTip->Vcoinh - pindexFailure->Vcoinh + 1, nGoodTransactions);
+        return error("VerifyDB() : *** %s", strError.c_str());
     }
-    if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexBest->Vcoinh - pindexFailure->Vcoinh + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
-        CBlockIndex *pindex = pindexState;
-        while (pindex != pindexBest) {
+        BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vDisconnected) {
             boost::this_thread::interruption_point();
-            pindex = pindex->pnext;
+            CDiskBlockPos pos;
+            {
+                LOCK(cs_main);
+                pos = pindex->GetBlockPos();
+            }
             CBlock block;
-            if (!block.ReadFromDisk(pindex))
-                return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
-            if (!block.ConnectBlock(state, pindex, coins))
-                return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+            if (!block.ReadFromDisk(pos) || block.GetHash() != pindex->GetBlockHash()) {
+                strError = strprintf("block.ReadFromDisk failed at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+                return error("VerifyDB() : *** %s", strError.c_str());
+            }
+            LOCK(cs_main);
+            if (!block.ConnectBlock(state, pindex, coins, fBackground)) {
+                strError = strprintf("found unconnectable block at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+                return error("VerifyDB() : *** %s", strError.c_str());
+            }
+            if (fBackground)
+                coins.SetBestBlock(pindex);
         }
     }
 
-    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexBest->Vcoinh - pindexState->Vcoinh, nGoodTransactions);
+    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->Vcoinh - pindexState->Vcoinh, nGoodTransactions);
 
     return true;
 }
 
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool fDeferCoins)
+{
+    if (pindexBest == NULL || pindexBest->pprev == NULL)
+        return true;
+
+    // Verify blocks in the best chain
+    if (nCheckDepth <= 0)
+        nCheckDepth = 1000000000; // suffices until the year 19000
+    if (nCheckDepth > nBestHeight)
+        nCheckDepth = nBestHeight;
+    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
+    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+
+    std::vector<CBlockIndex*> vBlocks;
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    {
+        if (pindex->Vcoinh < nBestHeight-nCheckDepth)
+            break;
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // nothing older is left to verify (pruned, or below a UTXO snapshot)
+            printf("VerifyDB(): no block data below height %d, stopping\n", pindex->Vcoinh + 1);
+            break;
+        }
+        vBlocks.push_back(pindex);
+    }
+
+    // levels 0-2 look at each block on its own, so they run in parallel
+    int64 nStart = GetTimeMillis();
+    CVerifyDBWorkQueue queue(vBlocks, nCheckLevel);
+    queue.Run();
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        CBlockIndex* pindex = vBlocks[i];
+        switch (queue.vResult[i]) {
+        case 0:
+            return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+        case 1:
+            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+        case 2:
+            return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->Vcoinh, pindex->GetBlockHash().ToString().c_str());
+        }
+    }
+    printf("VerifyDB(): checked %u blocks at level %i in %"PRI64d"ms\n", (unsigned int)vBlocks.size(), std::min(nCheckLevel, 2), GetTimeMillis() - nStart);
+
+    if (nCheckLevel < 3)
+        return true;
+    if (fDeferCoins) {
+        LOCK(cs_verifydb);
+        verifyDBStatus.strState = "pending";
+        return true;
+    }
+    CCoinsViewCache coins(*pcoinsTip, true);
+    std::string strError;
+    return VerifyDBCoins(coins, pindexBest, nCheckLevel, nCheckDepth, false, strError);
+}
+
+void ThreadVerifyDB()
+{
+    RenameThread("bitcoin-verifydb");
+
+    int nCheckLevel = std::max(0, std::min(4, (int)GetArg("-checklevel", 3)));
+    int nCheckDepth = GetArg("-checkblocks", 288);
+    CCoinsView* pviewSnapshot = NULL;
+    CBlockIndex* pindexTip = NULL;
+    {
+        LOCK(cs_main);
+        // the snapshot only sees what has been written to the database
+        if (pcoinsTip->Flush())
+            pviewSnapshot = pcoinsTip->NewSnapshot();
+        if (pviewSnapshot)
+            pindexTip = pviewSnapshot->GetBestBlock();
+        // keep pruning away from the blocks about to be read
+        fVerifyingDB = (pindexTip != NULL && pindexTip->pprev != NULL);
+    }
+    if (pindexTip == NULL || pindexTip->pprev == NULL) {
+        delete pviewSnapshot;
+        LOCK(cs_verifydb);
+        verifyDBStatus.strState = "done";
+        return;
+    }
+    if (nCheckDepth <= 0 || nCheckDepth > pindexTip->Vcoinh)
+        nCheckDepth = pindexTip->Vcoinh;
+
+    {
+        LOCK(cs_verifydb);
+        verifyDBStatus.strState = "running";
+        verifyDBStatus.nCheckLevel = nCheckLevel;
+        verifyDBStatus.nCheckDepth = nCheckDepth;
+        verifyDBStatus.Vcoinh = pindexTip->Vcoinh;
+        verifyDBStatus.hashBlock = pindexTip->GetBlockHash();
+        verifyDBStatus.nTimeStart = GetTime();
+    }
+    printf("ThreadVerifyDB() : verifying coins of last %i blocks at level %i below height %d\n", nCheckDepth, nCheckLevel, pindexTip->Vcoinh);
+
+    std::string strError;
+    bool fOk;
+    try {
+        CCoinsViewCache coins(*pviewSnapshot, true);
+        fOk = VerifyDBCoins(coins, pindexTip, nCheckLevel, nCheckDepth, true, strError);
+    } catch (...) {
+        delete pviewSnapshot;
+        LOCK(cs_main);
+        fVerifyingDB = false;
+        throw;
+    }
+    delete pviewSnapshot;
+    {
+        LOCK(cs_main);
+        fVerifyingDB = false;
+    }
+
+    {
+        LOCK(cs_verifydb);
+        verifyDBStatus.strState = fOk ? "done" : "failed";
+        verifyDBStatus.strError = strError;
+        verifyDBStatus.nTimeEnd = GetTime();
+    }
+    if (!fOk) {
+        strMiscWarning = _("Warning: Background block database verification failed, see getverificationinfo.");
+        uiInterface.NotifyBlocksChanged();
+    }
+}
+
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
@@ -3488,6 +4616,10 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
     printf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3638,33 +4770,123 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+/** Staged block import for -reindex, -loadblock and bootstrap.dat. A reader
+ * thread cuts the file into raw blocks, a pool of workers deserializes them
+ * and does the work that needs no chain state (header hash and proof of work,
+ * transaction hashes and merkle root), and the caller connects them in file
+ * order. At most MAX_IMPORT_BYTES_IN_FLIGHT of raw blocks are held in between.
+ */
+class CBlockImportPipeline
 {
-    int64 nStart = GetTimeMillis();
+public:
+    struct CItem
+    {
+        uint64 nPos;                // position of the block in the file
+        std::vector<char> vchData;  // raw block, until deserialized
+        CBlock block;
+        bool fOk;                   // deserialized and passed the checks
+        unsigned int nSize;
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRead;     // reader waits for room
+    boost::condition_variable condCheck;    // workers wait for raw blocks
+    boost::condition_variable condConnect;  // caller waits for the next block in order
+
+    std::deque<std::pair<uint64, CItem*> > queueRaw;
+    std::map<uint64, CItem*> mapChecked;
+    uint64 nBytesInFlight;
+    uint64 nRead;           // blocks handed out by the reader
+    uint64 nNextConnect;    // sequence number the caller waits for
+    bool fReadDone;
+    bool fQuit;
+
+    FILE* fileIn;
+    uint64 nStartByte;
+    boost::thread_group threads;
+    int nWorkers;
+
+    // per stage statistics
+    int64 nTimeStart;
+    int64 nReadMicros, nCheckMicros, nConnectMicros, nWaitMicros;
+    uint64 nBytesRead, nChecked, nConnected;
+    int64 nLastReport;
+
+    void ThreadRead();
+    void ThreadCheck();
+    bool Push(CItem* pitem);
 
-    unsigned char pchMessageStart[4];
+public:
+    CBlockImportPipeline(FILE* fileInIn, uint64 nStartByteIn);
+    ~CBlockImportPipeline();
 
-    int nLoaded = 0;
+    // Next block in file order, NULL at the end (requires the caller to be the connect stage)
+    CItem* Next();
+    void Connected(CItem* pitem, int64 nMicros);
+    void Report(bool fFinal);
+};
+
+CBlockImportPipeline::CBlockImportPipeline(FILE* fileInIn, uint64 nStartByteIn) :
+    nBytesInFlight(0), nRead(0), nNextConnect(0), fReadDone(false), fQuit(false),
+    fileIn(fileInIn), nStartByte(nStartByteIn),
+    nReadMicros(0), nCheckMicros(0), nConnectMicros(0), nWaitMicros(0),
+    nBytesRead(0), nChecked(0), nConnected(0)
+{
+    nTimeStart = GetTimeMicros();
+    nLastReport = nTimeStart;
+    nWorkers = std::max(nScriptCheckThreads, 1);
+    threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+    for (int i = 0; i < nWorkers; i++)
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+}
+
+CBlockImportPipeline::~CBlockImportPipeline()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condRead.notify_all();
+    condCheck.notify_all();
+    threads.join_all();
+    for (std::deque<std::pair<uint64, CItem*> >::iterator it = queueRaw.begin(); it != queueRaw.end(); it++)
+        delete it->second;
+    for (std::map<uint64, CItem*>::iterator it = mapChecked.begin(); it != mapChecked.end(); it++)
+        delete it->second;
+}
+
+// Hand a raw block to the workers, waiting while too much is in flight
+bool CBlockImportPipeline::Push(CItem* pitem)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fQuit && nBytesInFlight > 0 && nBytesInFlight + pitem->nSize > MAX_IMPORT_BYTES_IN_FLIGHT)
+        condRead.wait(lock);
+    if (fQuit)
+        return false;
+    nBytesInFlight += pitem->nSize;
+    queueRaw.push_back(std::make_pair(nRead++, pitem));
+    condCheck.notify_one();
+    return true;
+}
+
+void CBlockImportPipeline::ThreadRead()
+{
+    RenameThread("bitcoin-importrd");
+
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
     try {
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
-        }
+        if (nStartByte)
+            blkdat.Seek(nStartByte);
         uint64 nRewind = blkdat.GetPos();
         while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
-            GetMessageStart(pchMessageStart);
-
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            int64 nStart = GetTimeMicros();
             try {
                 // locate a header
                 unsigned char buf[4];
@@ -3681,36 +4903,174 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // no valid block header found; don't complain
                 break;
             }
+            CItem* pitem = new CItem();
             try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                // read the raw block, the workers deserialize it
+                pitem->nPos = blkdat.GetPos();
+                pitem->nSize = nSize;
+                pitem->fOk = false;
+                blkdat.SetLimit(pitem->nPos + nSize);
+                pitem->vchData.resize(nSize);
+                blkdat.read(&pitem->vchData[0], nSize);
                 nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
             } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                printf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+                delete pitem;
+                continue;
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nReadMicros += GetTimeMicros() - nStart;
+                nBytesRead += nSize;
+            }
+            if (!Push(pitem)) {
+                delete pitem;
+                break;
             }
         }
-        fclose(fileIn);
-    } catch(std::runtime_error &e) {
-        AbortNode(_("Error: system error: ") + e.what());
+    } catch (std::exception &e) {
+        printf("%s() : %s\n", __PRETTY_FUNCTION__, e.what());
     }
-    if (nLoaded > 0)
-        printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fReadDone = true;
+    condCheck.notify_all();
+    condConnect.notify_all();
+}
+
+void CBlockImportPipeline::ThreadCheck()
+{
+    RenameThread("bitcoin-importchk");
+
+    while (true) {
+        std::pair<uint64, CItem*> work;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && !fReadDone && queueRaw.empty())
+                condCheck.wait(lock);
+            if (fQuit || queueRaw.empty())
+                return;
+            work = queueRaw.front();
+            queueRaw.pop_front();
+        }
+
+        int64 nStart = GetTimeMicros();
+        CItem* pitem = work.second;
+        try {
+            CDataStream ss(&pitem->vchData[0], &pitem->vchData[0] + pitem->vchData.size(), SER_DISK, CLIENT_VERSION);
+            ss >> pitem->block;
+            const CBlock& block = pitem->block;
+            // the rest of CheckBlock needs the chain, ProcessBlock does it
+            if (block.vtx.empty())
+                printf("LoadExternalBlockFile() : block at %"PRI64u" has no transactions\n", pitem->nPos);
+            else if (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+                printf("LoadExternalBlockFile() : proof of work failed for block at %"PRI64u"\n", pitem->nPos);
+            else if (block.BuildMerkleTree() != block.hashMerkleRoot)
+                printf("LoadExternalBlockFile() : hashMerkleRoot mismatch for block at %"PRI64u"\n", pitem->nPos);
+            else
+                pitem->fOk = true;
+        } catch (std::exception &e) {
+            printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+        std::vector<char>().swap(pitem->vchData);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nCheckMicros += GetTimeMicros() - nStart;
+        nChecked++;
+        mapChecked.insert(work);
+        if (work.first == nNextConnect)
+            condConnect.notify_one();
+    }
+}
+
+CBlockImportPipeline::CItem* CBlockImportPipeline::Next()
+{
+    int64 nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<uint64, CItem*>::iterator it;
+    while ((it = mapChecked.find(nNextConnect)) == mapChecked.end()) {
+        if (fReadDone && nNextConnect == nRead)
+            return NULL;
+        condConnect.wait(lock);
+    }
+    CItem* pitem = it->second;
+    mapChecked.erase(it);
+    nNextConnect++;
+    nBytesInFlight -= pitem->nSize;
+    condRead.notify_one();
+    nWaitMicros += GetTimeMicros() - nStart;
+    return pitem;
+}
+
+void CBlockImportPipeline::Connected(CItem* pitem, int64 nMicros)
+{
+    delete pitem;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nConnectMicros += nMicros;
+        nConnected++;
+    }
+    if (GetTimeMicros() - nLastReport > 30 * 1000000)
+        Report(false);
+}
+
+void CBlockImportPipeline::Report(bool fFinal)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nLastReport = GetTimeMicros();
+    double dElapsed = std::max(nLastReport - nTimeStart, (int64)1) * 0.000001;
+    printf("%s: read %.1f MiB (%.1f MiB/s, busy %.2fs), checked %"PRI64u" blocks on %d threads (%.1f/s, busy %.2fs), "
+           "connected %"PRI64u" blocks (%.1f/s, busy %.2fs, waited %.2fs for input), %.1f MiB in flight\n",
+        fFinal ? "Import finished" : "Import progress",
+        nBytesRead / 1048576.0, nBytesRead / 1048576.0 / dElapsed, nReadMicros * 0.000001,
+        nChecked, nWorkers, nChecked / dElapsed, nCheckMicros * 0.000001,
+        nConnected, nConnected / dElapsed, nConnectMicros * 0.000001, nWaitMicros * 0.000001,
+        nBytesInFlight / 1048576.0);
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64 nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        uint64 nStartByte = 0;
+        if (dbp) {
+            // (try to) skip already indexed part
+            CBlockFileInfo info;
+            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
+                nStartByte = info.nSize;
+        }
+        CBlockImportPipeline pipeline(fileIn, nStartByte);
+        while (true) {
+            boost::this_thread::interruption_point();
+            CBlockImportPipeline::CItem* pitem = pipeline.Next();
+            if (pitem == NULL)
+                break;
+            int64 nStartConnect = GetTimeMicros();
+            bool fError = false;
+            if (pitem->fOk) {
+                // process block
+                LOCK(cs_main);
+                if (dbp)
+                    dbp->nPos = pitem->nPos;
+                CValidationState state;
+                if (ProcessBlock(state, NULL, &pitem->block, dbp, true))
+                    nLoaded++;
+                fError = state.IsError();
+            }
+            pipeline.Connected(pitem, GetTimeMicros() - nStartConnect);
+            if (fError)
+                break;
+        }
+        pipeline.Report(true);
+    } catch(std::runtime_error &e) {
+        AbortNode(_("Error: system error: ") + e.what());
+    }
+    fclose(fileIn);
+    if (nLoaded > 0)
+        printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
 }
 
 
@@ -3801,34 +5161,883 @@ string GetWarnings(string strFor)
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Messages
+// Messages
+//
+
+
+// Masternode announcements and pings already verified, by inv, and those
+// still waiting in the verification queue
+static CRollingBloomFilter filterMasterNodeMessages(50000, 0.000001);
+static std::set<uint256> setMasterNodeMessagesPending;
+static CCriticalSection cs_filterMasterNodeMessages;
+
+// Note a masternode message received from pfrom; returns false if we had it
+// already or it is waiting to be verified. requires LOCK(cs_main) for
+// mapAlreadyAskedFor.
+static bool ReceivedMasterNodeMessage(CNode* pfrom, const CInv& inv)
+{
+    pfrom->AddInventoryKnown(inv);
+    mapAlreadyAskedFor.erase(inv);
+    unsigned char pchKey[36];
+    CNode::GetInventoryKnownKey(inv, pchKey);
+    LOCK(cs_filterMasterNodeMessages);
+    if (filterMasterNodeMessages.contains(pchKey, sizeof(pchKey)))
+        return false;
+    return setMasterNodeMessagesPending.insert(inv.hash).second;
+}
+
+// Done with a message ReceivedMasterNodeMessage let through. Only a message
+// that was verified (or proven invalid) is remembered as seen; one that failed
+// for a reason that may pass later, like an unconfirmed collateral, can be
+// received again.
+static void FinishedMasterNodeMessage(const CInv& inv, bool fSeen)
+{
+    unsigned char pchKey[36];
+    CNode::GetInventoryKnownKey(inv, pchKey);
+    LOCK(cs_filterMasterNodeMessages);
+    setMasterNodeMessagesPending.erase(inv.hash);
+    if (fSeen)
+        filterMasterNodeMessages.insert(pchKey, sizeof(pchKey));
+}
+
+bool static AlreadyHave(const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+            bool txInMap = false;
+            {
+                LOCK(mempool.cs);
+                txInMap = mempool.exists(inv.hash);
+            }
+            return txInMap || mapOrphanTransactions.count(inv.hash) ||
+                pcoinsTip->HaveCoins(inv.hash);
+        }
+    case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
+        return mapBlockIndex.count(inv.hash) ||
+               mapOrphanBlocks.count(inv.hash) ||
+               mapBlocksInFlight.count(inv.hash);
+    case MSG_MASTERNODE_ANNOUNCE:
+    case MSG_MASTERNODE_PING:
+        {
+            unsigned char pchKey[36];
+            CNode::GetInventoryKnownKey(inv, pchKey);
+            LOCK(cs_filterMasterNodeMessages);
+            return filterMasterNodeMessages.contains(pchKey, sizeof(pchKey)) ||
+                   setMasterNodeMessagesPending.count(inv.hash);
+        }
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+unsigned char pchMessageStart[4] = { 0xfb, 0xc0, 0xb6, 0xdb }; // VirtualCoin: increase each by adding 2 to bitcoin's value.
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first block download
+//
+
+void static ReleaseBlockRequest(map<uint256, CBlockInFlight>::iterator mi)
+{
+    CNode* pnode = (*mi).second.pnode;
+    pnode->nBlocksInFlight--;
+    {
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+    mapBlocksInFlight.erase(mi);
+}
+
+// Take back all outstanding block requests of a node so others can pick them up
+void static ReleaseBlockRequests(CNode* pnode)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        if ((*mi).second.pnode == pnode)
+            ReleaseBlockRequest(mi++);
+        else
+            mi++;
+    }
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+
+    // Every few full request windows delivered earn back one stall
+    CNode* pnode = (*mi).second.pnode;
+    if (++pnode->nBlocksDelivered % (4 * MAX_BLOCKS_IN_TRANSIT_PER_PEER) == 0 && pnode->nBlockStalls > 0)
+        pnode->nBlockStalls--;
+    ReleaseBlockRequest(mi);
+}
+
+// Drop the header-only entries after pindexLast (all of them if it isn't one)
+void static TruncateHeaderChain(const CBlockIndex* pindexLast)
+{
+    while (!vHeaderChain.empty() && vHeaderChain.back() != pindexLast)
+    {
+        CBlockIndex* pindex = vHeaderChain.back();
+        uint256 hash = pindex->GetBlockHash();
+        map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end())
+            ReleaseBlockRequest(mi);
+        vHeaderChain.pop_back();
+        mapHeaderIndex.erase(hash);
+        delete pindex;
+    }
+}
+
+// Drop the header-only entries whose blocks made it into the block tree
+void static PruneHeaderChain()
+{
+    while (!vHeaderChain.empty())
+    {
+        CBlockIndex* pindex = vHeaderChain.front();
+        uint256 hash = pindex->GetBlockHash();
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            break;
+        vHeaderChain.pop_front();
+        if (!vHeaderChain.empty())
+            vHeaderChain.front()->pprev = (*mi).second;
+        mapHeaderIndex.erase(hash);
+        delete pindex;
+    }
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// UTXO snapshots
+//
+
+// The coin database is read through a LevelDB snapshot, so only taking that
+// snapshot needs cs_main; writing the file doesn't hold up the node.
+bool DumpTxOutSet(const boost::filesystem::path& path, CCoinsSnapshotHeader& header, uint256& hashSnapshot, uint256& hashMuHash, std::string& strError)
+{
+    CCoinsView* pview = NULL;
+    header.SetNull();
+    GetMessageStart(header.pchMessageStart, true);
+    {
+        LOCK(cs_main);
+        if (pindexBest == NULL) {
+            strError = "No block chain loaded";
+            return false;
+        }
+
+        // Everything has to be in the database before it is iterated
+        CCoinsStats stats;
+        if (!pcoinsTip->Flush() || !pcoinsTip->GetStats(stats)) {
+            strError = "Failed to write to coin database";
+            return false;
+        }
+        pview = pcoinsTip->NewSnapshot();
+        if (pview == NULL || pview->GetBestBlock() == NULL || pview->GetBestBlock()->GetBlockHash() != stats.hashBlock) {
+            delete pview;
+            strError = "Failed to read the coin database";
+            return false;
+        }
+        header.hashBlock = stats.hashBlock;
+        header.Vcoinh = stats.Vcoinh;
+        hashMuHash = stats.hashMuHash;
+    }
+
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file) {
+        delete pview;
+        strError = strprintf("Cannot create %s", pathTmp.string().c_str());
+        return false;
+    }
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << header.hashBlock;
+    try {
+        // the record count is only known at the end, the header is written again then
+        fileout << header;
+        if (!pview->DumpCoins(fileout, hasher, header))
+            throw runtime_error("failed to read the coin database");
+        hashSnapshot = hasher.GetHash();
+        fileout << hashSnapshot;
+        if (fseek(fileout, 0, SEEK_SET))
+            throw runtime_error("seek failed");
+        fileout << header;
+        FileCommit(fileout);
+    } catch (std::exception &e) {
+        delete pview;
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        strError = strprintf("Failed to write snapshot: %s", e.what());
+        return false;
+    }
+    delete pview;
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("Cannot rename %s", pathTmp.string().c_str());
+        return false;
+    }
+    printf("DumpTxOutSet(): wrote %"PRI64u" coins at height %d to %s, hash=%s muhash=%s\n",
+        header.nCoins, header.Vcoinh, path.string().c_str(), hashSnapshot.ToString().c_str(), hashMuHash.ToString().c_str());
+    return true;
+}
+
+// Read a snapshot, check its checksum and compute the MuHash of its records
+// the way the coin database does; the records also go to pview if it isn't NULL
+bool static ReadTxOutSet(const boost::filesystem::path& path, CCoinsSnapshotHeader& header, uint256& hashMuHash,
+                         CCoinsViewCache* pview, std::string& strError)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        strError = strprintf("Cannot open %s", path.string().c_str());
+        return false;
+    }
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+
+    try {
+        filein >> header;
+        unsigned char pchMessageStart[4];
+        GetMessageStart(pchMessageStart, true);
+        if (memcmp(header.pchMessageStart, pchMessageStart, sizeof(pchMessageStart))) {
+            strError = "Snapshot is for a different network";
+            return false;
+        }
+        if (header.nVersion > CCoinsSnapshotHeader::CURRENT_VERSION) {
+            strError = strprintf("Unknown snapshot version %d", header.nVersion);
+            return false;
+        }
+
+        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+        hasher << header.hashBlock;
+        CCoinsTotals totals;
+        for (uint64 n = 0; n < header.nCoins; n++) {
+            uint256 txhash;
+            CCoins coins;
+            filein >> txhash >> coins;
+            hasher << txhash << coins;
+            totals.Add(txhash, coins);
+            if (pview) {
+                pview->SetCoins(txhash, coins);
+                if (pview->GetCacheSize() >= SNAPSHOT_LOAD_BATCH_SIZE) {
+                    boost::this_thread::interruption_point();
+                    if (!pview->Flush()) {
+                        strError = "Failed to write to coin database";
+                        return false;
+                    }
+                }
+            }
+        }
+        uint256 hashExpected;
+        filein >> hashExpected;
+        if (hasher.GetHash() != hashExpected) {
+            strError = "Snapshot checksum mismatch";
+            return false;
+        }
+        hashMuHash = totals.muhash.GetHash();
+    } catch (std::exception &e) {
+        strError = strprintf("Snapshot is truncated or corrupt: %s", e.what());
+        return false;
+    }
+    if (pview && !pview->Flush()) {
+        strError = "Failed to write to coin database";
+        return false;
+    }
+    return true;
+}
+
+// Loading happens in three steps. The file is checked without any lock. Then
+// block processing is stopped (fImporting) under cs_main, and the records are
+// streamed into the coin database without the lock. Finally the snapshot
+// block becomes the tip under cs_main. Once records have been written, a
+// failure leaves the "loadingsnapshot" flag set and the node won't start on
+// the half-loaded database.
+bool LoadTxOutSet(const boost::filesystem::path& path, CCoinsSnapshotHeader& header, std::string& strError)
+{
+    // Check the whole file before the coin database is touched
+    uint256 hashMuHash;
+    if (!ReadTxOutSet(path, header, hashMuHash, NULL, strError))
+        return false;
+    if (!Checkpoints::CheckSnapshot(header.Vcoinh, header.hashBlock, hashMuHash)) {
+        strError = strprintf("Snapshot of block %s at height %d with muhash %s is not a known snapshot",
+            header.hashBlock.ToString().c_str(), header.Vcoinh, hashMuHash.ToString().c_str());
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        if (fImporting || fReindex) {
+            strError = "Cannot load a snapshot while blocks are being imported";
+            return false;
+        }
+        if (pindexBest == NULL || pindexBest != pindexGenesisBlock) {
+            strError = "A snapshot can only be loaded before any blocks are connected";
+            return false;
+        }
+        if (fTxIndex || fAddressIndex || fSpentIndex) {
+            strError = "A snapshot cannot be combined with -txindex, -addressindex or -spentindex";
+            return false;
+        }
+        map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(header.hashBlock);
+        if (mi == mapHeaderIndex.end() || (*mi).second->Vcoinh != header.Vcoinh) {
+            strError = "The header of the snapshot block has not been received yet";
+            return false;
+        }
+
+        // No blocks are connected while the records are written, and the
+        // cache above the database starts out empty
+        if (!pcoinsTip->Flush() || !pcoinsflusher->Sync()) {
+            strError = "Failed to write to coin database";
+            return false;
+        }
+        pblocktree->WriteFlag("loadingsnapshot", true);
+        if (!pblocktree->Sync()) {
+            strError = "Failed to sync block index";
+            return false;
+        }
+        fImporting = true;
+    }
+
+    printf("LoadTxOutSet(): loading %"PRI64u" coins of block %s\n", header.nCoins, header.hashBlock.ToString().c_str());
+    CCoinsSnapshotHeader headerLoaded;
+    uint256 hashMuHashLoaded;
+    bool fLoaded = false;
+    try {
+        CCoinsViewCache viewLoad(*pcoinsflusher);
+        fLoaded = ReadTxOutSet(path, headerLoaded, hashMuHashLoaded, &viewLoad, strError) && pcoinsflusher->Sync();
+        if (!fLoaded && strError.empty())
+            strError = "Failed to write to coin database";
+    } catch (...) {
+        fImporting = false;
+        throw;
+    }
+    if (fLoaded && (headerLoaded.hashBlock != header.hashBlock || hashMuHashLoaded != hashMuHash)) {
+        strError = "Snapshot file changed while it was loaded";
+        fLoaded = false;
+    }
+
+    LOCK(cs_main);
+    fImporting = false;
+    if (!fLoaded)
+        return false;
+
+    // Header sync went on meanwhile, so look the block up again
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(header.hashBlock);
+    if (mi == mapHeaderIndex.end() || pindexBest != pindexGenesisBlock) {
+        strError = "The block chain changed while the snapshot was loaded";
+        return false;
+    }
+    CBlockIndex* pindexSnapshot = (*mi).second;
+
+    // Move the headers up to the snapshot block into the block tree; their
+    // blocks are never downloaded
+    while (!vHeaderChain.empty())
+    {
+        CBlockIndex* pindex = vHeaderChain.front();
+        uint256 hash = pindex->GetBlockHash();
+        map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+        if (it != mapBlocksInFlight.end())
+            ReleaseBlockRequest(it);
+        vHeaderChain.pop_front();
+        mapHeaderIndex.erase(hash);
+        mi = mapBlockIndex.insert(make_pair(hash, pindex)).first;
+        pindex->phashBlock = &((*mi).first);
+        pindex->nChainWork = pindex->pprev->nChainWork + pindex->GetBlockWork().getuint256();
+        pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        if (pindex == pindexSnapshot)
+            break;
+    }
+    for (CBlockIndex* pindex = pindexSnapshot; pindex->pprev != NULL; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+
+    // The database keeps its own MuHash of what was actually stored
+    CCoinsStats stats;
+    pcoinsTip->SetBestBlock(pindexSnapshot);
+    if (!pcoinsTip->Flush() || !pcoinsTip->GetStats(stats)) {
+        strError = "Failed to write to coin database";
+        return false;
+    }
+    if (stats.hashMuHash != hashMuHash) {
+        strError = strprintf("Coin database muhash %s does not match the snapshot", stats.hashMuHash.ToString().c_str());
+        return false;
+    }
+
+    hashBestChain = header.hashBlock;
+    pindexBest = pindexSnapshot;
+    pblockindexFBBHLast = NULL;
+    nBestHeight = pindexBest->Vcoinh;
+    nBestChainWork = pindexBest->nChainWork;
+    nTimeBestReceived = GetTime();
+    nTransactionsUpdated++;
+    mempool.clear();
+    ::SetBestChain(CBlockLocator(pindexBest));
+
+    // Missing blocks below the snapshot look just like pruned ones to the rest of the node
+    fHavePruned = true;
+    pblocktree->WriteFlag("prunedblockfiles", true);
+    nLocalServices &= ~NODE_NETWORK;
+    pblocktree->WriteFlag("loadingsnapshot", false);
+    if (!pblocktree->Sync()) {
+        strError = "Failed to sync block index";
+        return false;
+    }
+
+    printf("LoadTxOutSet(): new best=%s  height=%d\n", hashBestChain.ToString().c_str(), nBestHeight);
+    uiInterface.NotifyBlocksChanged();
+    return true;
+}
+
+// Check a header against its parent, which is in the block tree, the header chain
+// or is a header checked just before it
+bool static CheckBlockHeader(CValidationState &state, const CBlockHeader& header, const uint256& hash, const CBlockIndex* pindexPrev)
+{
+    int Vcoinh = pindexPrev->Vcoinh+1;
+
+    if (!CheckProofOfWork(hash, header.nBits))
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"));
+    if (!CheckNextWorkRequired(state, header, pindexPrev))
+        return false;
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"));
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("CheckBlockHeader() : block's timestamp is too early"));
+    if (!Checkpoints::CheckBlock(Vcoinh, hash))
+        return state.DoS(100, error("CheckBlockHeader() : rejected by checkpoint lock-in at %d", Vcoinh));
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && Vcoinh <= pcheckpoint->Vcoinh)
+        return state.DoS(100, error("CheckBlockHeader() : forks the chain below checkpoint %d", pcheckpoint->Vcoinh));
+    return true;
+}
+
+// Check the headers of a "headers" message and add the new ones to the header
+// chain. Headers that branch off it only replace its tail if their branch has
+// more work than the header chain (or the block tree, if that is all there is);
+// a branch with less work is ignored, so an old fork header can't throw away
+// the header chain. nAccepted is the number of headers added.
+bool AcceptBlockHeaders(CValidationState &state, const vector<CBlock>& vHeaders, unsigned int& nAccepted)
+{
+    nAccepted = 0;
+    // The new headers, in order, and the index entries made for them. These
+    // only join mapHeaderIndex and vHeaderChain once the branch is chosen.
+    map<uint256, CBlockIndex*> mapNew;
+    vector<CBlockIndex*> vNew;
+    CBlockIndex* pindexFork = NULL;
+    bool fForkIsHeader = false;
+    bool fOk = true;
+    BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        CBlockIndex* pindexPrev = NULL;
+        if (vNew.empty()) {
+            // skip what we already have up to the first new header
+            if (mapBlockIndex.count(hash) || mapHeaderIndex.count(hash))
+                continue;
+            map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(header.hashPrevBlock);
+            if (mi != mapHeaderIndex.end())
+                fForkIsHeader = true;
+            else if ((mi = mapBlockIndex.find(header.hashPrevBlock)) == mapBlockIndex.end()) {
+                fOk = state.Invalid(error("AcceptBlockHeaders() : prev block not found"));
+                break;
+            }
+            pindexFork = pindexPrev = (*mi).second;
+        } else {
+            pindexPrev = vNew.back();
+            if (header.hashPrevBlock != pindexPrev->GetBlockHash()) {
+                fOk = state.DoS(20, error("AcceptBlockHeaders() : non-continuous headers sequence"));
+                break;
+            }
+        }
+        if (!CheckBlockHeader(state, header, hash, pindexPrev)) {
+            fOk = false;
+            break;
+        }
+
+        CBlockHeader headerNew = header;
+        CBlockIndex* pindexNew = new CBlockIndex(headerNew);
+        pindexNew->phashBlock = &(mapNew.insert(make_pair(hash, pindexNew)).first->first);
+        pindexNew->pprev = pindexPrev;
+        pindexNew->Vcoinh = pindexPrev->Vcoinh + 1;
+        pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+        pindexNew->nStatus = BLOCK_VALID_TREE;
+        vNew.push_back(pindexNew);
+    }
+
+    const CBlockIndex* pindexTip = vHeaderChain.empty() ? pindexBest : vHeaderChain.back();
+    if (!fOk || vNew.empty() || vNew.back()->nChainWork <= pindexTip->nChainWork) {
+        if (fOk && !vNew.empty())
+            printf("AcceptBlockHeaders() : ignoring %"PRIszu" headers of a branch from height %d with less work than the header chain\n", vNew.size(), pindexFork->Vcoinh);
+        BOOST_FOREACH(CBlockIndex* pindex, vNew)
+            delete pindex;
+        return fOk;
+    }
+
+    // Forget the part of the header chain the better branch replaces
+    TruncateHeaderChain(fForkIsHeader ? pindexFork : NULL);
+    BOOST_FOREACH(CBlockIndex* pindex, vNew)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(make_pair(pindex->GetBlockHash(), pindex)).first;
+        pindex->phashBlock = &((*mi).first);
+        vHeaderChain.push_back(pindex);
+    }
+    nAccepted = vNew.size();
+    return true;
+}
+
+/** The main chain by height, and the wire form of its headers as "headers"
+ * messages carry them, kept in runs of MAX_HEADERS_RESULTS that start at
+ * multiples of it. Syncing peers mostly ask for the same ranges, which are
+ * then copied into the send buffer as they are. The main chain normally
+ * only grows at the tip, which appends to the last run; a reorganization
+ * cuts the chain and the runs back to the fork.
+ * requires LOCK(cs_main)
+ */
+class CHeadersCache
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+    std::map<int, std::vector<char> > mapRuns;  // first height -> serialized headers
+    std::list<int> listRunsUsed;                // least recently used first
+    unsigned int nEntrySize;
+    CBlockIndex* pindexLocator;
+    std::vector<uint256> vLocator;              // locator of pindexLocator
+
+    std::vector<char>& GetRun(int nStart)
+    {
+        std::map<int, std::vector<char> >::iterator it = mapRuns.find(nStart);
+        if (it != mapRuns.end()) {
+            listRunsUsed.remove(nStart);
+            listRunsUsed.push_back(nStart);
+            return it->second;
+        }
+        if (mapRuns.size() >= MAX_HEADERS_CACHE_RUNS) {
+            mapRuns.erase(listRunsUsed.front());
+            listRunsUsed.pop_front();
+        }
+        listRunsUsed.push_back(nStart);
+        return mapRuns[nStart];
+    }
+
+public:
+    uint64 nServed;     // headers sent
+    uint64 nBuilt;      // headers serialized for it
+
+    CHeadersCache() : pindexLocator(NULL), nServed(0), nBuilt(0)
+    {
+        nEntrySize = ::GetSerializeSize(CBlock(), SER_NETWORK, PROTOCOL_VERSION);
+    }
+
+    // Follow the best chain
+    void Update()
+    {
+        if (pindexBest == NULL || (!vChain.empty() && vChain.back() == pindexBest))
+            return;
+
+        std::vector<CBlockIndex*> vNew;
+        CBlockIndex* pindex = pindexBest;
+        while (pindex && !Contains(pindex)) {
+            vNew.push_back(pindex);
+            pindex = pindex->pprev;
+        }
+        int nFork = pindex ? pindex->Vcoinh + 1 : 0;
+        if (nFork < (int)vChain.size()) {
+            vChain.resize(nFork);
+            std::map<int, std::vector<char> >::iterator it = mapRuns.begin();
+            while (it != mapRuns.end()) {
+                if (it->first >= nFork) {
+                    listRunsUsed.remove(it->first);
+                    mapRuns.erase(it++);
+                } else {
+                    if (it->second.size() > (nFork - it->first) * nEntrySize)
+                        it->second.resize((nFork - it->first) * nEntrySize);
+                    it++;
+                }
+            }
+        }
+        vChain.insert(vChain.end(), vNew.rbegin(), vNew.rend());
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return pindex->Vcoinh < (int)vChain.size() && vChain[pindex->Vcoinh] == pindex;
+    }
+
+    int Height() const
+    {
+        return (int)vChain.size() - 1;
+    }
+
+    // Write the headers of heights nHeight to nHeight+nCount-1
+    void Write(CDataStream& ss, int nHeight, unsigned int nCount)
+    {
+        nServed += nCount;
+        while (nCount > 0) {
+            int nStart = nHeight - nHeight % MAX_HEADERS_RESULTS;
+            std::vector<char>& vRun = GetRun(nStart);
+            unsigned int nHave = vRun.size() / nEntrySize;
+            unsigned int nNeed = std::min(nHeight - nStart + nCount, MAX_HEADERS_RESULTS);
+            if (nHave < nNeed) {
+                // runs fill up from their start, whatever was asked for
+                CDataStream ssRun(SER_NETWORK, PROTOCOL_VERSION);
+                for (unsigned int i = nHave; i < nNeed; i++)
+                    ssRun << CBlock(vChain[nStart + i]->GetBlockHeader());
+                vRun.insert(vRun.end(), ssRun.begin(), ssRun.end());
+                nBuilt += nNeed - nHave;
+            }
+            unsigned int n = nNeed - (nHeight - nStart);
+            ss.write(&vRun[(nHeight - nStart) * nEntrySize], n * nEntrySize);
+            nHeight += n;
+            nCount -= n;
+        }
+    }
+
+    // Same as CBlockLocator(pindex), but stepping back through the main
+    // chain by height instead of block by block
+    CBlockLocator GetLocator(CBlockIndex* pindex)
+    {
+        // the locator of the tip goes out to every peer we sync from
+        if (pindex != NULL && pindex == pindexLocator)
+            return CBlockLocator(vLocator);
+        CBlockIndex* pindexStart = pindex;
+
+        std::vector<uint256> vHave;
+        int nStep = 1;
+        while (pindex)
+        {
+            vHave.push_back(pindex->GetBlockHash());
+
+            // Exponentially larger steps back
+            if (Contains(pindex))
+                pindex = pindex->Vcoinh >= nStep ? vChain[pindex->Vcoinh - nStep] : NULL;
+            else
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
+            if (vHave.size() > 10)
+                nStep *= 2;
+        }
+        vHave.push_back(hashGenesisBlock);
+
+        if (pindexStart == pindexBest) {
+            pindexLocator = pindexStart;
+            vLocator = vHave;
+        }
+        return CBlockLocator(vHave);
+    }
+};
+static CHeadersCache headersCache;
+
+CBlockLocator GetBlockLocator(CBlockIndex* pindex)
+{
+    headersCache.Update();
+    return headersCache.GetLocator(pindex);
+}
+
+void static PushGetHeaders(CNode* pnode)
+{
+    CBlockIndex* pindexLast = vHeaderChain.empty() ? pindexBest : vHeaderChain.back();
+    printf("send getheaders from %d peer=%d\n", pindexLast->Vcoinh, pnode->id);
+    pnode->PushMessage("getheaders", GetBlockLocator(pindexLast), uint256(0));
+    pnode->nGetHeadersTime = GetTime();
+}
+
+// Fill a node's request window with blocks from the front of the header chain
+void static RequestBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    int nMaxInFlight = max(1, MAX_BLOCKS_IN_TRANSIT_PER_PEER >> min(pto->nBlockStalls, 4));
+    int64 nNow = GetTime();
+    unsigned int nWindow = min((unsigned int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < nWindow && pto->nBlocksInFlight < nMaxInFlight; i++)
+    {
+        CBlockIndex* pindex = vHeaderChain[i];
+        // The node may not have what it didn't announce when it connected
+        if (pindex->Vcoinh > pto->nStartingHeight)
+            break;
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        // Right after stalling on the first block the node doesn't get it back
+        if (i == 0 && nNow - pto->nLastBlockStall < BLOCK_STALLING_TIMEOUT)
+            continue;
+
+        CBlockInFlight request;
+        request.pnode = pto;
+        request.nTime = nNow;
+        mapBlocksInFlight.insert(make_pair(hash, request));
+        {
+            LOCK(cs_vNodes);
+            pto->AddRef();
+        }
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        if (fDebugNet)
+            printf("sending getdata: block %d %s peer=%d\n", pindex->Vcoinh, hash.ToString().c_str(), pto->id);
+    }
+}
+
+// The first block of the download window holds back everything behind it.
+// If the node it was requested from sits on it, hand all of that node's
+// requests to faster nodes and shrink its window.
+void static CheckBlockStall()
+{
+    // Requests to nodes that went away are never answered
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin();
+    while (mi != mapBlocksInFlight.end())
+    {
+        if ((*mi).second.pnode->fDisconnect)
+            ReleaseBlockRequest(mi++);
+        else
+            mi++;
+    }
+
+    if (vHeaderChain.empty())
+        return;
+    mi = mapBlocksInFlight.find(vHeaderChain.front()->GetBlockHash());
+    if (mi == mapBlocksInFlight.end() || GetTime() - (*mi).second.nTime < BLOCK_STALLING_TIMEOUT)
+        return;
+
+    CNode* pnode = (*mi).second.pnode;
+    pnode->nBlockStalls++;
+    pnode->nLastBlockStall = GetTime();
+    printf("block download stalled by peer=%d (%d stalls), reassigning %d blocks\n", pnode->id, pnode->nBlockStalls, pnode->nBlocksInFlight);
+    ReleaseBlockRequests(pnode);
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Compact blocks
 //
 
+// Blocks being rebuilt from a "cmpctblock", one per peer. Protected by cs_main.
+static map<NodeId, CPartialBlock> mapPartialBlocks;
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static const int64 PARTIAL_BLOCK_TIMEOUT = 60;
 
-bool static AlreadyHave(const CInv& inv)
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
 {
-    switch (inv.type)
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(inv.hash);
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
     {
-    case MSG_TX:
-        {
-            bool txInMap = false;
-            {
-                LOCK(mempool.cs);
-                txInMap = mempool.exists(inv.hash);
-            }
-            return txInMap || mapOrphanTransactions.count(inv.hash) ||
-                pcoinsTip->HaveCoins(inv.hash);
-        }
-    case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+        mapAlreadyAskedFor.erase(inv);
+        mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, inv.hash));
     }
-    // Don't know what it is, just say we already got one
-    return true;
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+
+        // Headers past a rejected block lead nowhere
+        map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(inv.hash);
+        if (mi != mapHeaderIndex.end() && !state.CorruptionPossible() &&
+            !mapBlockIndex.count(inv.hash) && !mapOrphanBlocks.count(inv.hash))
+            TruncateHeaderChain((*mi).second->pprev);
+    }
+    PruneHeaderChain();
 }
 
-unsigned char pchMessageStart[4] = { 0xfb, 0xc0, 0xb6, 0xdb }; // VirtualCoin: increase each by adding 2 to bitcoin's value.
+void static PrunePartialBlocks()
+{
+    int64 nNow = GetTime();
+    for (map<NodeId, CPartialBlock>::iterator it = mapPartialBlocks.begin(); it != mapPartialBlocks.end(); )
+    {
+        const CPartialBlock& partial = (*it).second;
+        uint256 hash = partial.header.GetHash();
+        if (nNow - partial.nTime > PARTIAL_BLOCK_TIMEOUT || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            mapPartialBlocks.erase(it++);
+        else
+            it++;
+    }
+}
+
+// Hand a fully rebuilt compact block to ProcessReceivedBlock. Short id
+// collisions with the wrong transaction show up as a bad merkle root, which is
+// our problem rather than the peer's, so fetch the full block instead.
+void static ProcessPartialBlock(CNode* pfrom, const CPartialBlock& partial)
+{
+    CBlock block;
+    partial.GetBlock(block);
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not rebuild, asking for the full block peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
+        vector<CInv> vGetData;
+        vGetData.push_back(CInv(MSG_BLOCK, block.GetHash()));
+        pfrom->PushMessage("getdata", vGetData);
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block);
+}
+
+// The most recently served block, kept as a finished wire message: right after
+// a block is announced most peers ask for the same one. Protected by cs_main.
+static uint256 hashLastBlockMsg = 0;
+static CSerializeDataRef msgLastBlock;
+static uint256 hashLastCompactBlockMsg = 0;
+static CSerializeDataRef msgLastCompactBlock;
+
+// The most recently filtered block with its merkle tree and the bloom keys of
+// its transactions, shared by all the SPV peers asking for it at the same
+// moment. Protected by cs_main.
+static uint256 hashLastFilteredBlock = 0;
+static CBlock blockLastFiltered;
+static vector<CBloomTxKeys> vLastFilteredKeys;
+
+// Upload budget for blocks more than a week behind the tip, refilled at
+// -maxhistoricalupload kB/s and allowed to build up for 10 seconds. Blocks
+// are only sent while it is positive, then charged for afterwards.
+static int64 nHistoricalUploadRate = -1;     // bytes per second, 0 for no limit
+static int64 nHistoricalUploadAllowance = 0;
+static int64 nHistoricalUploadLastRefill = 0;
+static uint64 nHistoricalBytesSent = 0;
+static uint64 nHistoricalUploadThrottled = 0;
+
+// requires LOCK(cs_main)
+static bool IsHistoricalBlockRequest(const CInv& inv)
+{
+    if (inv.type != MSG_BLOCK && inv.type != MSG_FILTERED_BLOCK && inv.type != MSG_CMPCT_BLOCK)
+        return false;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+    return mi != mapBlockIndex.end() && (*mi).second->GetBlockTime() < pindexBest->GetBlockTime() - 7 * 24 * 60 * 60;
+}
+
+// requires LOCK(cs_main)
+static bool HistoricalUploadAvailable()
+{
+    if (nHistoricalUploadRate < 0)
+        nHistoricalUploadRate = GetArg("-maxhistoricalupload", 0) * 1000;
+    if (nHistoricalUploadRate == 0)
+        return true;
+    int64 nNow = GetTimeMillis();
+    nHistoricalUploadAllowance = min(nHistoricalUploadAllowance + (nNow - nHistoricalUploadLastRefill) * nHistoricalUploadRate / 1000,
+                                     nHistoricalUploadRate * 10);
+    nHistoricalUploadLastRefill = nNow;
+    if (nHistoricalUploadAllowance > 0)
+        return true;
+    nHistoricalUploadThrottled++;
+    return false;
+}
 
+void GetHistoricalUploadStats(int64& nRate, uint64& nBytesSent, uint64& nThrottled)
+{
+    LOCK(cs_main);
+    nRate = max(nHistoricalUploadRate, (int64)0);
+    nBytesSent = nHistoricalBytesSent;
+    nThrottled = nHistoricalUploadThrottled;
+}
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -3847,12 +6056,24 @@ void static ProcessGetData(CNode* pfrom)
         if (pfrom->nBlocksRequested * 80 > pfrom->nSendBytes)
             break;
 
+        // Old blocks aren't served while the historical upload budget is used
+        // up. They are answered with notfound so the peer can ask someone
+        // else, and the rest of the queue is served as usual.
+        bool fHistorical = IsHistoricalBlockRequest(*it);
+        if (fHistorical && !HistoricalUploadAvailable())
+        {
+            vNotFound.push_back(*it);
+            it++;
+            continue;
+        }
+        uint64 nQueuedBefore = pfrom->nSendBytesQueued;
+
         const CInv &inv = *it;
         {
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = true;
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3870,22 +6091,68 @@ void static ProcessGetData(CNode* pfrom)
                          send = false;
                        }
                     }
+                    // Pruned blocks are answered with notfound, the peer will ask someone else
+                    if (send && !(((*mi).second)->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        if (fDebug)
+                            printf("ProcessGetData(): block %s has been pruned, peer=%d\n", inv.hash.ToString().c_str(), pfrom->id);
+                        vNotFound.push_back(inv);
+                        send = false;
+                    }
                 } else {
                     send = false;
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        if (!msgLastBlock || hashLastBlockMsg != inv.hash)
+                        {
+                            // Send block from disk, serialized once for every peer that asks
+                            CBlock block;
+                            block.ReadFromDisk((*mi).second);
+                            CDataStream ssMsg = BeginSerializedMessage("block");
+                            ssMsg << block;
+                            msgLastBlock = EndSerializedMessage(ssMsg);
+                            hashLastBlockMsg = inv.hash;
+                        }
+                        pfrom->PushSerializedMessage(msgLastBlock);
+                    }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        if (!msgLastCompactBlock || hashLastCompactBlockMsg != inv.hash)
+                        {
+                            CBlock block;
+                            block.ReadFromDisk((*mi).second);
+                            CDataStream ssMsg = BeginSerializedMessage("cmpctblock");
+                            ssMsg << CCompactBlock(block);
+                            msgLastCompactBlock = EndSerializedMessage(ssMsg);
+                            hashLastCompactBlockMsg = inv.hash;
+                        }
+                        pfrom->PushSerializedMessage(msgLastCompactBlock);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        if (pfrom->pfilter && hashLastFilteredBlock != inv.hash)
+                        {
+                            // Send block from disk, its txids, merkle tree and bloom keys computed once
+                            hashLastFilteredBlock = 0;
+                            vLastFilteredKeys.clear();
+                            blockLastFiltered.SetNull();
+                            if (blockLastFiltered.ReadFromDisk((*mi).second))
+                            {
+                                blockLastFiltered.BuildMerkleTree();
+                                vLastFilteredKeys.reserve(blockLastFiltered.vtx.size());
+                                for (unsigned int i = 0; i < blockLastFiltered.vtx.size(); i++)
+                                    vLastFilteredKeys.push_back(CBloomTxKeys(blockLastFiltered.vtx[i], blockLastFiltered.vMerkleTree[i]));
+                                hashLastFilteredBlock = inv.hash;
+                            }
+                        }
+                        if (pfrom->pfilter && hashLastFilteredBlock == inv.hash)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            const CBlock& block = blockLastFiltered;
+                            CMerkleBlock merkleBlock(block, vLastFilteredKeys, *pfrom->pfilter);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3895,7 +6162,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->IsInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3919,13 +6186,10 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send stream from relay memory
                 bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                CSerializeDataRef msg = mapRelay.Find(inv);
+                if (msg) {
+                    pfrom->PushSerializedMessage(msg);
+                    pushed = true;
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
@@ -3943,10 +6207,17 @@ void static ProcessGetData(CNode* pfrom)
                 }
             }
 
+            if (fHistorical)
+            {
+                uint64 nBytes = pfrom->nSendBytesQueued - nQueuedBefore;
+                nHistoricalUploadAllowance -= nBytes;
+                nHistoricalBytesSent += nBytes;
+            }
+
             // Track requests for our stuff.
             Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4139,17 +6410,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return false;
         }
 
-        int count = virtualSendMasterNodes.size()-1;
-        int i = 0;
-
-        BOOST_FOREACH(CMasterNode mn, virtualSendMasterNodes) {
-            printf("Sending master node entry - %s \n", mn.addr.ToString().c_str());
-            mn.Check();
-            if(mn.IsEnabled()) {
-                pfrom->PushMessage("dsee", mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, i, mn.lastTimeSeen);
-                i++;
-            }
-        }
+        // The list is streamed from SendMessages a chunk at a time, so it
+        // doesn't crowd out everything else queued for this peer. Entries are
+        // remembered by collateral, as the list may change in the meantime.
+        pfrom->vMasterNodeListToSend.clear();
+        pfrom->vMasterNodeListToSend.reserve(virtualSendMasterNodes.size());
+        BOOST_FOREACH(const CMasterNode& mn, virtualSendMasterNodes)
+            pfrom->vMasterNodeListToSend.push_back(make_pair(mn.vin.prevout.hash, mn.vin.prevout.n));
+        pfrom->nMasterNodeListNext = 0;
+        pfrom->nMasterNodeListSent = 0;
     }
 
     else if (strCommand == "dsee") { //VirtualSend Election Entry   
@@ -4159,21 +6428,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         bool fIsInitialDownload = IsInitialBlockDownload();
         if(fIsInitialDownload) return true;
 
-        CTxIn vin;
-        CService addr;
-        CPubKey pubkey;
-        CPubKey pubkey2;
-        vector<unsigned char> vchSig;
-        int64 sigTime;
-        int count;
-        int current;
-        int64 lastUpdated;
-        vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated;
-
-        std::string vchPubKey(pubkey.begin(), pubkey.end());
-        
+        CMasterNodeMessage msg;
+        msg.inv = CInv(MSG_MASTERNODE_ANNOUNCE, Hash(vRecv.begin(), vRecv.end()));
+        msg.fPing = false;
+        vRecv >> msg.vin >> msg.addr >> msg.vchSig >> msg.sigTime >> msg.pubkey >> msg.pubkey2 >> msg.count >> msg.current >> msg.lastUpdated;
+
         CScript pubkeyScript;
-        pubkeyScript.SetDestination(pubkey.GetID());
+        pubkeyScript.SetDestination(msg.pubkey.GetID());
 
         if(pubkeyScript.size() != 25) {
             printf("dsee - pubkey the wrong size\n");
@@ -4181,10 +6442,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return false;  
         }
 
-        std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey; 
-
         CScript pubkeyScript2;
-        pubkeyScript2.SetDestination(pubkey2.GetID());
+        pubkeyScript2.SetDestination(msg.pubkey2.GetID());
         
         if(pubkeyScript2.size() != 25) {
             printf("dsee - pubkey the wrong size\n");
@@ -4192,119 +6451,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return false;  
         }
 
-        std::string errorMessage = "";
-        if(!virtualSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
-            printf("dsee - Got bad masternode address signature\n");
-            pfrom->Misbehaving(100);
-            return false;
-        }
-
-        if((fTestNet && addr.GetPort() != 19999) || (!fTestNet && addr.GetPort() != 9999)) return true;
-
-        printf("Searching existing supernodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
-        
-        BOOST_FOREACH(CMasterNode& mn, virtualSendMasterNodes) {
-            printf(" -- %s\n", mn.vin.ToString().c_str());
-
-            if(mn.vin == vin) {
-                if(!mn.UpdatedWithin(MASTERNODE_MIN_MICROSECONDS)){
-                    mn.UpdateLastSeen();
-
-                    if(count == -1)
-                        RelayVirtualSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated);
-                }
-
-                return true;
-            }
-        }
-
-        printf("dsee - Got NEW masternode entry %s\n", addr.ToString().c_str());
-
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, virtualSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-        if(tx.AcceptableInputs(state, true)){
-            printf("dsee - Accepted masternode entry %i %i\n", count, current);
-
-            if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
-                printf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
-                pfrom->Misbehaving(20);
-                return false;
-            }
-
-            addrman.Add(CAddress(addr), pfrom->addr, 2*60*60);
+        if((fTestNet && msg.addr.GetPort() != 19999) || (!fTestNet && msg.addr.GetPort() != 9999)) return true;
 
-            CMasterNode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2);
-            mn.UpdateLastSeen(lastUpdated);
-            virtualSendMasterNodes.push_back(mn);
-
-            if(count == -1)
-                RelayVirtualSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated); 
+        if (!ReceivedMasterNodeMessage(pfrom, msg.inv))
+            return true;
 
-        } else {
-            printf("dsee - Rejected masternode entry\n");
-            // if caught up on blocks, then do this:
-            //pfrom->Misbehaving(20);
-        }
+        // The signature is checked and the entry applied by ThreadMasterNodeVerify
+        std::string vchPubKey(msg.pubkey.begin(), msg.pubkey.end());
+        msg.strMessage = msg.addr.ToString() + boost::lexical_cast<std::string>(msg.sigTime) + vchPubKey; 
+        if (!QueueMasterNodeMessage(pfrom, msg))
+            FinishedMasterNodeMessage(msg.inv, false);
     }
 
     else if (strCommand == "dseep") { //VirtualSend Election Entry Ping 
         if (pfrom->nVersion < virtualSendPool.MIN_PEER_PROTO_VERSION) {
             return false;
         }
-        bool fIsInitialDownload = IsInitialBlockDownload();
-        if(fIsInitialDownload) return true;
-
-        CTxIn vin;
-        vector<unsigned char> vchSig;
-        int64 sigTime;
-        bool stop;
-        vRecv >> vin >> vchSig >> sigTime >> stop;
-
-        CBlockIndex* pindexPrev = pindexBest;
-
-        if (sigTime/1000000 > GetAdjustedTime() + 15 * 60) {
-            printf("dseep: Signature rejected, too far into the future");
-            //pfrom->Misbehaving(20);
-            return false;
-        }
-
-        if (sigTime/1000000 <= pindexPrev->GetBlockTime() - 15 * 60) {
-            printf("dseep: Signature rejected, too far into the past");
-            //pfrom->Misbehaving(20);
-            return false;
-        }
-
-        //printf("Searching existing masternodes : %s - %s\n", addr.ToString().c_str(),  vin.ToString().c_str());
 
-        BOOST_FOREACH(CMasterNode& mn, virtualSendMasterNodes) {
+        CMasterNodeMessage msg;
+        msg.inv = CInv(MSG_MASTERNODE_PING, Hash(vRecv.begin(), vRecv.end()));
+        msg.fPing = true;
+        vRecv >> msg.vin >> msg.vchSig >> msg.sigTime >> msg.stop;
 
-            if(mn.vin == vin) {
-                std::string strMessage = mn.addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop); 
-
-                std::string errorMessage = "";
-                if(!virtualSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                    printf("Got bad masternode address signature\n");
-                    //pfrom->Misbehaving(20);
-                    return false;
-                }
+        // dseep is handled without cs_main, which is only taken for the
+        // duplicate check. ThreadMasterNodeVerify does the rest.
+        {
+            LOCK(cs_main);
+            bool fIsInitialDownload = IsInitialBlockDownload();
+            if(fIsInitialDownload) return true;
 
-                if(stop) {
-                    if(mn.IsEnabled()){
-                        mn.Disable();
-                        mn.Check();
-                        RelayVirtualSendElectionEntryPing(vin, vchSig, sigTime, stop);
-                    }
-                    return true;
-                } else if(!mn.UpdatedWithin(MASTERNODE_MIN_MICROSECONDS)){
-                    mn.UpdateLastSeen();
-                    RelayVirtualSendElectionEntryPing(vin, vchSig, sigTime, stop);
-                    return true;
-                }
-            }
+            if (!ReceivedMasterNodeMessage(pfrom, msg.inv))
+                return true;
         }
+        if (!QueueMasterNodeMessage(pfrom, msg))
+            FinishedMasterNodeMessage(msg.inv, false);
     }
 
     else if (strCommand == "addr")
@@ -4407,8 +6587,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
-                    pfrom->AskFor(inv);
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+                {
+                    // A fresh block at the tip is mostly in our memory pool already
+                    if (inv.type == MSG_BLOCK && pfrom->nVersion >= COMPACT_BLOCKS_VERSION &&
+                        vHeaderChain.empty() && !IsInitialBlockDownload())
+                        pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                    else
+                        pfrom->AskFor(inv);
+                }
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapHeaderIndex.count(inv.hash)) {
                 if (pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash])))
                     printf("send getblocks for %s peer=%d\n", inv.hash.ToString().c_str(), pfrom->id);
             } else if (nInv == nLastBlock) {
@@ -4505,25 +6692,91 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 pindex = pindex->pnext;
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = 2000;
         printf("getheaders %d to %s\n", (pindex ? pindex->Vcoinh : -1), hashStop.ToString().c_str());
-        for (; pindex; pindex = pindex->pnext)
+        headersCache.Update();
+        if (pindex && !headersCache.Contains(pindex))
         {
+            // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+            vector<CBlock> vHeaders;
             vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+            pfrom->PushMessage("headers", vHeaders);
+            return true;
+        }
+
+        // Main chain headers come out of the cache in their wire form
+        unsigned int nCount = 0;
+        if (pindex)
+        {
+            nCount = std::min((unsigned int)(headersCache.Height() - pindex->Vcoinh + 1), MAX_HEADERS_RESULTS);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            if (mi != mapBlockIndex.end() && headersCache.Contains((*mi).second) && (*mi).second->Vcoinh >= pindex->Vcoinh)
+                nCount = std::min(nCount, (unsigned int)((*mi).second->Vcoinh - pindex->Vcoinh + 1));
+        }
+        pfrom->BeginMessage("headers");
+        try
+        {
+            WriteCompactSize(pfrom->ssSend, nCount);
+            if (nCount > 0)
+                headersCache.Write(pfrom->ssSend, pindex->Vcoinh, nCount);
+            pfrom->EndMessage();
+        }
+        catch (...)
+        {
+            pfrom->AbortMessage();
+            throw;
+        }
+        if (fDebug)
+            printf("  sent %u headers, %"PRI64u" of %"PRI64u" sent so far were serialized for it\n",
+                nCount, headersCache.nBuilt, headersCache.nServed);
+    }
+
+
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        // CBlocks with an empty transaction list, see getheaders
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+
+        // Only answers to our getheaders (sent to the sync node) are used
+        if (pfrom->nGetHeadersTime == 0)
+        {
+            if (fDebugNet)
+                printf("ignoring %"PRIszu" unrequested headers peer=%d\n", vHeaders.size(), pfrom->id);
+            return true;
+        }
+        pfrom->nGetHeadersTime = 0;
+
+        CValidationState state;
+        unsigned int nAccepted;
+        if (!AcceptBlockHeaders(state, vHeaders, nAccepted))
+        {
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+            return error("ProcessMessage() : headers rejected peer=%d", pfrom->id);
+        }
+        printf("received %"PRIszu" headers (%u new), %"PRIszu" headers ahead of the block tree peer=%d\n", vHeaders.size(), nAccepted, vHeaderChain.size(), pfrom->id);
+
+        // A full batch that ends on our header chain means the peer has more;
+        // keep going while there is room
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && !vHeaderChain.empty() &&
+            vHeaderChain.back()->GetBlockHash() == vHeaders.back().GetHash())
+        {
+            if (vHeaderChain.size() < MAX_HEADERS_AHEAD)
+                PushGetHeaders(pfrom);
+            else
+                pfrom->fSyncHeaders = true;
         }
-        pfrom->PushMessage("headers", vHeaders);
     }
 
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
@@ -4534,96 +6787,254 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CValidationState state;
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
         {
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            RelayTransaction(tx, inv.hash);
+            mapAlreadyAskedFor.erase(inv);
+
+            printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                tx.GetHash().ToString().c_str(),
+                mempool.mapTx.size());
+
+            // It may have been stored as an orphan when it first came in
+            EraseOrphanTx(inv.hash);
+
+            // Orphans that depended on this one are re-tried in batches, here
+            // and from SendMessages, so a long chain doesn't stall this peer
+            vOrphanWorkQueue.push_back(inv.hash);
+            ProcessOrphanWork();
+        }
+        else if (fMissingInputs)
+        {
+            AddOrphanTx(tx, pfrom->id);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            if (nEvicted > 0)
+                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        }
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS))
+        {
+            printf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
+            if (nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+        }
+    }
+
+
+    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlock block;
+        vRecv >> block;
+
+        printf("received block %s peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
+        // block.print();
+
+        mapPartialBlocks.erase(pfrom->id);
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        printf("received cmpctblock %s (%u txes) peer=%d\n", hash.ToString().c_str(), cmpctblock.GetTxCount(), pfrom->id);
+
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        {
+            mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hash));
+            return true;
+        }
+        if (!CheckProofOfWork(hash, cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+
+        // Only rebuild blocks that extend the block tree; anything else is
+        // fetched through the regular block download
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+        {
+            pfrom->PushGetBlocks(pindexBest, hash);
+            return true;
+        }
+        CValidationState state;
+        if (!CheckNextWorkRequired(state, cmpctblock.header, (*mi).second))
+        {
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+            return error("message cmpctblock : incorrect proof of work");
+        }
+
+        PrunePartialBlocks();
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS && !mapPartialBlocks.count(pfrom->id))
+            mapPartialBlocks.erase(mapPartialBlocks.begin());
+
+        CPartialBlock& partial = mapPartialBlocks[pfrom->id];
+        int nRead;
+        {
+            LOCK(mempool.cs);
+            nRead = partial.Init(cmpctblock, mempool);
+        }
+        if (nRead != CPartialBlock::READ_OK)
+        {
+            mapPartialBlocks.erase(pfrom->id);
+            if (nRead == CPartialBlock::READ_INVALID)
+            {
+                pfrom->Misbehaving(100);
+                return error("message cmpctblock : invalid compact block");
+            }
+            vector<CInv> vGetData;
+            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        partial.GetMissing(req.vIndexes);
+        if (req.vIndexes.empty())
+        {
+            CPartialBlock complete = partial;
+            mapPartialBlocks.erase(pfrom->id);
+            ProcessPartialBlock(pfrom, complete);
+        }
+        else
+        {
+            if (fDebugNet)
+                printf("cmpctblock %s missing %"PRIszu" txes peer=%d\n", hash.ToString().c_str(), req.vIndexes.size(), pfrom->id);
+            req.blockhash = hash;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        // Only recent blocks are worth rebuilding, anything older is sent whole
+        CBlockIndex* pindex = (*mi).second;
+        if (pindex->Vcoinh < nBestHeight - 10 || !pindex->IsInMainChain())
+        {
+            vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_BLOCK, req.blockhash));
+            pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+            ProcessGetData(pfrom);
+            return true;
+        }
 
-            printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str(),
-                mempool.mapTx.size());
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("message getblocktxn : failed to read block %s", req.blockhash.ToString().c_str());
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanHash);
-                        printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
-                    }
-                }
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            resp.vtx.push_back(block.vtx[nIndex]);
         }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
+        pfrom->PushMessage("blocktxn", resp);
+    }
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<NodeId, CPartialBlock>::iterator it = mapPartialBlocks.find(pfrom->id);
+        if (it == mapPartialBlocks.end() || (*it).second.header.GetHash() != resp.blockhash)
+            return true;
+
+        CPartialBlock partial = (*it).second;
+        mapPartialBlocks.erase(it);
+        if (!partial.FillMissing(resp.vtx))
         {
-            printf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+            pfrom->Misbehaving(100);
+            return error("message blocktxn : wrong number of transactions");
         }
+        ProcessPartialBlock(pfrom, partial);
     }
 
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    else if ((strCommand == "getcfilters" || strCommand == "getcfheaders") && (nLocalServices & NODE_COMPACT_FILTERS))
     {
-        CBlock block;
-        vRecv >> block;
+        unsigned char nFilterType;
+        unsigned int nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
 
-        printf("received block %s peer=%d\n", block.GetHash().ToString().c_str(), pfrom->id);
-        // block.print();
+        bool fHeaders = (strCommand == "getcfheaders");
+        unsigned int nMax = fHeaders ? MAX_GETCFHEADERS_SIZE : MAX_GETCFILTERS_SIZE;
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+        if (nFilterType != BLOCK_FILTER_BASIC || mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+            return true;
+        CBlockIndex* pindexStop = (*mi).second;
+        if (nStartHeight > (unsigned int)pindexStop->Vcoinh || pindexStop->Vcoinh - nStartHeight >= nMax)
+        {
+            pfrom->Misbehaving(10);
+            return error("message %s : bad range %u-%d", strCommand.c_str(), nStartHeight, pindexStop->Vcoinh);
+        }
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        vector<CBlockIndex*> vIndex(pindexStop->Vcoinh - nStartHeight + 1);
+        CBlockIndex* pindex = pindexStop;
+        for (int i = vIndex.size() - 1; i >= 0; i--, pindex = pindex->pprev)
+            vIndex[i] = pindex;
 
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        if (fHeaders)
+        {
+            // The header before the range, then the filter hashes to chain onto it
+            uint256 prevHeader = 0, hashFilter;
+            if (pindex && !pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), prevHeader, hashFilter))
+                return true;
+            vector<uint256> vFilterHashes;
+            vFilterHashes.reserve(vIndex.size());
+            BOOST_FOREACH(CBlockIndex* pindexFilter, vIndex)
+            {
+                uint256 header;
+                if (!pblockfilterdb->ReadFilterHeader(pindexFilter->GetBlockHash(), header, hashFilter))
+                    break; // still being built
+                vFilterHashes.push_back(hashFilter);
+            }
+            pfrom->PushMessage("cfheaders", nFilterType, hashStop, prevHeader, vFilterHashes);
+        }
+        else
+        {
+            BOOST_FOREACH(CBlockIndex* pindexFilter, vIndex)
+            {
+                CBlockFilter filter;
+                if (!pblockfilterdb->ReadFilter(pindexFilter->GetBlockHash(), filter))
+                    break;
+                pfrom->PushMessage("cfilter", nFilterType, filter.GetBlockHash(), filter.GetEncoded());
+            }
+        }
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4794,6 +7205,45 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Commands whose handlers only touch per-node state, addrman or the peer's
+// bloom filter (or take cs_main themselves, like dseep). They run without
+// cs_main so one peer's slow block or dseg request doesn't stall them.
+static bool IsLockFreeCommand(const string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "addr" || strCommand == "getaddr" ||
+           strCommand == "verack" || strCommand == "misbehave" || strCommand == "dseep" ||
+           strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear";
+}
+
+// Bound on distinct commands tracked; anything beyond is counted as "other"
+static const unsigned int MAX_MESSAGE_TIMING_COMMANDS = 64;
+
+static map<string, CMessageTiming> mapMessageTimings;
+static CCriticalSection cs_mapMessageTimings;
+
+static void RecordMessageTiming(const string& strCommand, int64 nMicros)
+{
+    LOCK(cs_mapMessageTimings);
+    map<string, CMessageTiming>::iterator mi = mapMessageTimings.find(strCommand);
+    if (mi == mapMessageTimings.end())
+    {
+        if (mapMessageTimings.size() >= MAX_MESSAGE_TIMING_COMMANDS)
+            mi = mapMessageTimings.insert(make_pair(string("other"), CMessageTiming())).first;
+        else
+            mi = mapMessageTimings.insert(make_pair(strCommand, CMessageTiming())).first;
+    }
+    CMessageTiming& timing = (*mi).second;
+    timing.nCount++;
+    timing.nTotalMicros += nMicros;
+    timing.nMaxMicros = max(timing.nMaxMicros, nMicros);
+}
+
+void GetMessageTimings(map<string, CMessageTiming>& mapTimingsOut)
+{
+    LOCK(cs_mapMessageTimings);
+    mapTimingsOut = mapMessageTimings;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4814,7 +7264,10 @@ bool ProcessMessages(CNode* pfrom)
     GetMessageStart(pchMessageStart);
 
     if (!pfrom->vRecvGetData.empty())
+    {
+        LOCK(cs_main);
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -4873,8 +7326,12 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64 nTimeStart = GetTimeMicros();
         try
         {
+            if (IsLockFreeCommand(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4907,6 +7364,12 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        int64 nTimeElapsed = GetTimeMicros() - nTimeStart;
+        RecordMessageTiming(strCommand, nTimeElapsed);
+        pfrom->RecordRecvMsg(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, nTimeElapsed);
+        if (fBenchmark)
+            printf("- %s from peer=%d: %.2fms\n", strCommand.c_str(), pfrom->id, nTimeElapsed * 0.001);
+
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
 
@@ -4915,7 +7378,10 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->nRecvMsgCount = pfrom->vRecvMsg.size();
+    }
 
     return fOk;
 }
@@ -4939,16 +7405,39 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("ping");
         }
 
-        // Start block sync
-        if (!pto->fAskedForBlocks && !fImporting && !fReindex && !pto->fClient && !pto->fOneShot &&
+        // Finish re-trying orphans left over by the "tx" handler
+        ProcessOrphanWork();
+
+        // Start block sync. Within a day of the tip plain getblocks catches up
+        // quickly; further behind, headers are fetched from the sync node and
+        // the blocks from everyone.
+        bool fSyncCandidate = !fImporting && !fReindex && !pto->fClient && !pto->fOneShot &&
             !pto->fDisconnect && pto->fSuccessfullyConnected &&
             (pto->nStartingHeight > (nBestHeight - 144)) &&
-            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END)) {
+            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END);
+        bool fHeadersFirst = pindexBest->GetBlockTime() < GetAdjustedTime() - 24 * 60 * 60 || !vHeaderChain.empty();
+        if (!pto->fAskedForBlocks && fSyncCandidate && !fHeadersFirst) {
             nAskedForBlocks++;
             pto->fAskedForBlocks = true;
             if (pto->PushGetBlocks(pindexBest, uint256(0)))
                 printf("send initial getblocks peer=%d\n", pto->id);
         }
+        if (pto->fStartSync && fSyncCandidate) {
+            pto->fStartSync = false;
+            if (fHeadersFirst)
+                PushGetHeaders(pto);
+        }
+        if (pto->fSyncHeaders && vHeaderChain.size() < MAX_HEADERS_AHEAD) {
+            pto->fSyncHeaders = false;
+            PushGetHeaders(pto);
+        }
+        // A node that doesn't answer its getheaders loses header sync to another
+        if (pto->nGetHeadersTime != 0 && GetTime() - pto->nGetHeadersTime > HEADERS_RESPONSE_TIMEOUT) {
+            printf("getheaders timed out, peer=%d\n", pto->id);
+            pto->nGetHeadersTime = 0;
+            pto->nBlockStalls++;
+            ReleaseSyncNode(pto);
+        }
 
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
@@ -4968,7 +7457,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4988,24 +7480,56 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
+                }
+                pto->vAddrToSend.clear();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+            {
+                vector<CAddress> vAddrChunk(vAddr.begin() + i, vAddr.begin() + min((size_t)i + 1000, vAddr.size()));
+                pto->PushMessage("addr", vAddrChunk);
+            }
+        }
+
+
+        //
+        // Message: masternode list (dseg reply)
+        //
+        if (!pto->vMasterNodeListToSend.empty())
+        {
+            // Entries are sent a chunk at a time and only while the send buffer
+            // has room; the rest go out on later passes. Masternodes removed
+            // since the request are skipped.
+            int count = pto->vMasterNodeListToSend.size() - 1;
+            unsigned int nEnd = min(pto->nMasterNodeListNext + MASTERNODE_LIST_CHUNK, (unsigned int)pto->vMasterNodeListToSend.size());
+            for (; pto->nMasterNodeListNext < nEnd && pto->nSendSize < SendBufferSize(); pto->nMasterNodeListNext++)
+            {
+                COutPoint prevout(pto->vMasterNodeListToSend[pto->nMasterNodeListNext].first, pto->vMasterNodeListToSend[pto->nMasterNodeListNext].second);
+                BOOST_FOREACH(const CMasterNode& mnListed, virtualSendMasterNodes) {
+                    if (mnListed.vin.prevout != prevout)
+                        continue;
+                    CMasterNode mn = mnListed;
+                    mn.Check();
+                    if(mn.IsEnabled()) {
+                        pto->PushMessage("dsee", mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, pto->nMasterNodeListSent, mn.lastTimeSeen);
+                        pto->nMasterNodeListSent++;
                     }
+                    break;
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            if (pto->nMasterNodeListNext == pto->vMasterNodeListToSend.size())
+            {
+                std::vector<std::pair<uint256, unsigned int> >().swap(pto->vMasterNodeListToSend);
+                pto->nMasterNodeListNext = 0;
+            }
         }
 
 
@@ -5020,7 +7544,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->IsInventoryKnown(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5050,15 +7574,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->AddInventoryKnown(inv);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -5071,6 +7592,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        CheckBlockStall();
+        if (!pto->fClient && !pto->fDisconnect && pto->fSuccessfullyConnected && !fImporting && !fReindex)
+            RequestBlocks(pto, vGetData);
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
@@ -5880,6 +8404,10 @@ public:
 
         // orphan transactions
         mapOrphanTransactions.clear();
+        mapOrphanTransactionsByPrev.clear();
+        vOrphanList.clear();
+        mapOrphanTransactionsSizeByPeer.clear();
+        nOrphanTransactionsSize = 0;
     }
 } instance_of_cmaincleanup;
 
@@ -6049,17 +8577,324 @@ bool CVirtualSendSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
+/** Valid masternode message signatures, so the same announcements and pings
+ *  relayed again by the network don't need another public key recovery.
+ *  Entries are keyed by the hash of (message hash, signature, key id).
+ */
+class CMasterNodeSigCache
+{
+private:
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_sigcache;
+
+public:
+    bool Get(const uint256& hash)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.count(hash) > 0;
+    }
+
+    void Set(const uint256& hash)
+    {
+        // Same limit as the script signature cache; entries are 32 bytes
+        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize <= 0) return;
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+
+        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        {
+            // Evict a random entry, like CSignatureCache
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+        setValid.insert(hash);
+    }
+};
+
+static CMasterNodeSigCache masterNodeSigCache;
+
 bool CVirtualSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
+
+    CHashWriter ssCache(SER_GETHASH, 0);
+    ssCache << hashMessage << vchSig << pubkey.GetID();
+    uint256 hashCache = ssCache.GetHash();
+    if (masterNodeSigCache.Get(hashCache))
+        return true;
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
         errorMessage = "Error recovering pubkey";
         return false;
     }
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    if (pubkey2.GetID() != pubkey.GetID())
+        return false;
+
+    masterNodeSigCache.Set(hashCache);
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Masternode message verification
+//
+// dsee and dseep messages are parsed by ProcessMessage and queued here.
+// ThreadMasterNodeVerify takes them in batches: it looks up what the
+// signatures are checked against under one cs_main lock, checks all the
+// signatures in parallel on the mnsigcheckqueue workers without holding any
+// lock, then applies the results to the masternode list under one more lock.
+//
+
+/** Signature check of a queued masternode message. It always succeeds as far
+ *  as the check queue is concerned; the result goes to *pfValid. */
+class CMasterNodeSigCheck
+{
+private:
+    CPubKey pubkey;
+    std::vector<unsigned char> vchSig;
+    std::string strMessage;
+    bool* pfValid;
+
+public:
+    CMasterNodeSigCheck() : pfValid(NULL) {}
+    CMasterNodeSigCheck(const CPubKey& pubkeyIn, const std::vector<unsigned char>& vchSigIn, const std::string& strMessageIn, bool* pfValidIn) :
+        pubkey(pubkeyIn), vchSig(vchSigIn), strMessage(strMessageIn), pfValid(pfValidIn) {}
+
+    bool operator()()
+    {
+        std::string errorMessage;
+        *pfValid = virtualSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage);
+        return true;
+    }
+
+    void swap(CMasterNodeSigCheck& check)
+    {
+        std::swap(pubkey, check.pubkey);
+        vchSig.swap(check.vchSig);
+        strMessage.swap(check.strMessage);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
+static CCheckQueue<CMasterNodeSigCheck> mnsigcheckqueue(16);
+
+static std::deque<CMasterNodeMessage> vMasterNodeMessages;
+static boost::mutex csMasterNodeMessages;
+static boost::condition_variable condMasterNodeMessages;
+
+bool QueueMasterNodeMessage(CNode* pfrom, const CMasterNodeMessage& msg)
+{
+    boost::unique_lock<boost::mutex> lock(csMasterNodeMessages);
+    if (vMasterNodeMessages.size() >= MAX_MASTERNODE_QUEUE)
+    {
+        printf("QueueMasterNodeMessage() : queue full, dropping message from peer=%d\n", pfrom->id);
+        return false;
+    }
+    vMasterNodeMessages.push_back(msg);
+    vMasterNodeMessages.back().pfrom = pfrom->AddRef();
+    vMasterNodeMessages.back().addrFrom = pfrom->addr;
+    condMasterNodeMessages.notify_one();
+    return true;
+}
+
+void ThreadMasterNodeSigCheck() {
+    RenameThread("bitcoin-mnsigch");
+    mnsigcheckqueue.Thread();
+}
+
+// Look up the masternode a ping is for and build the message it signed.
+// requires LOCK(cs_main)
+static bool PrepareMasterNodePing(CMasterNodeMessage& msg)
+{
+    if (msg.sigTime/1000000 > GetAdjustedTime() + 15 * 60) {
+        printf("dseep: Signature rejected, too far into the future");
+        //msg.pfrom->Misbehaving(20);
+        return false;
+    }
+
+    if (msg.sigTime/1000000 <= pindexBest->GetBlockTime() - 15 * 60) {
+        printf("dseep: Signature rejected, too far into the past");
+        //msg.pfrom->Misbehaving(20);
+        return false;
+    }
+
+    BOOST_FOREACH(CMasterNode& mn, virtualSendMasterNodes) {
+        if(mn.vin == msg.vin) {
+            msg.pubkey2 = mn.pubkey2;
+            msg.strMessage = mn.addr.ToString() + boost::lexical_cast<std::string>(msg.sigTime) + boost::lexical_cast<std::string>(msg.stop); 
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns false if the entry was turned down for a reason that may pass later.
+// requires LOCK(cs_main)
+static bool ApplyMasterNodeEntry(CMasterNodeMessage& msg)
+{
+    if(!msg.fValid){
+        printf("dsee - Got bad masternode address signature\n");
+        msg.pfrom->Misbehaving(100);
+        return true;
+    }
+
+    BOOST_FOREACH(CMasterNode& mn, virtualSendMasterNodes) {
+        if(mn.vin == msg.vin) {
+            if(!mn.UpdatedWithin(MASTERNODE_MIN_MICROSECONDS)){
+                mn.UpdateLastSeen();
+
+                if(msg.count == -1)
+                    RelayVirtualSendElectionEntry(msg.vin, msg.addr, msg.vchSig, msg.sigTime, msg.pubkey, msg.pubkey2, msg.count, msg.current, msg.lastUpdated);
+            }
+
+            return true;
+        }
+    }
+
+    printf("dsee - Got NEW masternode entry %s\n", msg.addr.ToString().c_str());
+
+    CValidationState state;
+    CTransaction tx = CTransaction();
+    CTxOut vout = CTxOut(999.99*COIN, virtualSendPool.collateralPubKey);
+    tx.vin.push_back(msg.vin);
+    tx.vout.push_back(vout);
+    if(tx.AcceptableInputs(state, true)){
+        printf("dsee - Accepted masternode entry %i %i\n", msg.count, msg.current);
+
+        if(GetInputAge(msg.vin) < MASTERNODE_MIN_CONFIRMATIONS){
+            printf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
+            msg.pfrom->Misbehaving(20);
+            return false;
+        }
+
+        addrman.Add(CAddress(msg.addr), msg.addrFrom, 2*60*60);
+
+        CMasterNode mn(msg.addr, msg.vin, msg.pubkey, msg.vchSig, msg.sigTime, msg.pubkey2);
+        mn.UpdateLastSeen(msg.lastUpdated);
+        virtualSendMasterNodes.push_back(mn);
+
+        if(msg.count == -1)
+            RelayVirtualSendElectionEntry(msg.vin, msg.addr, msg.vchSig, msg.sigTime, msg.pubkey, msg.pubkey2, msg.count, msg.current, msg.lastUpdated); 
+
+        return true;
+    } else {
+        printf("dsee - Rejected masternode entry\n");
+        // if caught up on blocks, then do this:
+        //msg.pfrom->Misbehaving(20);
+        return false;
+    }
+}
+
+// requires LOCK(cs_main)
+static void ApplyMasterNodePing(CMasterNodeMessage& msg)
+{
+    if(!msg.fValid){
+        printf("Got bad masternode address signature\n");
+        //msg.pfrom->Misbehaving(20);
+        return;
+    }
+
+    BOOST_FOREACH(CMasterNode& mn, virtualSendMasterNodes) {
+
+        if(mn.vin == msg.vin) {
+            if(msg.stop) {
+                if(mn.IsEnabled()){
+                    mn.Disable();
+                    mn.Check();
+                    RelayVirtualSendElectionEntryPing(msg.vin, msg.vchSig, msg.sigTime, msg.stop);
+                }
+                return;
+            } else if(!mn.UpdatedWithin(MASTERNODE_MIN_MICROSECONDS)){
+                mn.UpdateLastSeen();
+                RelayVirtualSendElectionEntryPing(msg.vin, msg.vchSig, msg.sigTime, msg.stop);
+                return;
+            }
+        }
+    }
+}
+
+void ThreadMasterNodeVerify()
+{
+    RenameThread("bitcoin-mnverify");
+
+    std::vector<CMasterNodeMessage> vBatch;
+    while (true)
+    {
+        vBatch.clear();
+        {
+            boost::unique_lock<boost::mutex> lock(csMasterNodeMessages);
+            while (vMasterNodeMessages.empty())
+                condMasterNodeMessages.wait(lock);
+            while (!vMasterNodeMessages.empty() && vBatch.size() < MASTERNODE_VERIFY_BATCH)
+            {
+                vBatch.push_back(vMasterNodeMessages.front());
+                vMasterNodeMessages.pop_front();
+            }
+        }
+
+        // Pings are signed with the key of a masternode we already know
+        std::vector<bool> vReady(vBatch.size(), true);
+        {
+            LOCK(cs_main);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+                if (vBatch[i].fPing)
+                    vReady[i] = PrepareMasterNodePing(vBatch[i]);
+        }
+
+        std::vector<CMasterNodeSigCheck> vChecks;
+        vChecks.reserve(vBatch.size());
+        for (unsigned int i = 0; i < vBatch.size(); i++)
+        {
+            CMasterNodeMessage& msg = vBatch[i];
+            msg.fValid = false;
+            if (vReady[i])
+                vChecks.push_back(CMasterNodeSigCheck(msg.fPing ? msg.pubkey2 : msg.pubkey, msg.vchSig, msg.strMessage, &msg.fValid));
+        }
+        if (nScriptCheckThreads)
+        {
+            CCheckQueueControl<CMasterNodeSigCheck> control(&mnsigcheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+        }
+        else
+        {
+            BOOST_FOREACH(CMasterNodeSigCheck& check, vChecks)
+                check();
+        }
+
+        {
+            LOCK(cs_main);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+            {
+                // A ping for a masternode we don't know (yet) isn't checked
+                bool fSeen = false;
+                if (vReady[i])
+                {
+                    if (vBatch[i].fPing)
+                    {
+                        ApplyMasterNodePing(vBatch[i]);
+                        fSeen = true;
+                    }
+                    else
+                        fSeen = ApplyMasterNodeEntry(vBatch[i]);
+                }
+                FinishedMasterNodeMessage(vBatch[i].inv, fSeen);
+            }
+        }
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CMasterNodeMessage& msg, vBatch)
+                msg.pfrom->Release();
+        }
+    }
 }
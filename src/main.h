@@ -11,6 +11,8 @@
 #include "script.h"
 #include "hashblock.h"
 #include "base58.h"
+#include "addressindex.h"
+#include "spentindex.h"
 
 #include <list>
 #include <algorithm>
@@ -32,6 +34,7 @@ class CVirtualSendSigner;
 class CMasterNode;
 class CMasterNodeVote;
 class CBitcoinAddress;
+class CTxMemPool;
 
 #define MASTERNODE_PAYMENTS_MIN_VOTES 5
 #define MASTERNODE_PAYMENTS_MAX 1
@@ -44,6 +47,9 @@ class CBitcoinAddress;
 #define MASTERNODE_PING_SECONDS                30*60
 #define MASTERNODE_EXPIRATION_MICROSECONDS     35*60*1000*1000
 #define MASTERNODE_REMOVAL_MICROSECONDS        35.5*60*1000*1000
+#define MASTERNODE_LIST_CHUNK                  100
+#define MASTERNODE_VERIFY_BATCH                64
+#define MAX_MASTERNODE_QUEUE                   10000
 
 struct CBlockIndexWorkComparator;
 
@@ -61,14 +67,52 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum total size of the orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_SIZE = 5 * MAX_BLOCK_SIZE;
+/** The maximum total size of the orphan transactions kept from one peer */
+static const unsigned int MAX_PEER_ORPHAN_TRANSACTIONS_SIZE = MAX_BLOCK_SIZE / 2;
+/** Seconds an orphan transaction waits for its inputs before it is dropped */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Seconds between sweeps of the orphan pool for expired transactions */
+static const int64 ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** The maximum number of orphans re-tried by one call of ProcessOrphanWork() */
+static const unsigned int MAX_ORPHAN_WORK = 100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** The number of serialized runs of MAX_HEADERS_RESULTS headers kept for answering 'getheaders' */
+static const unsigned int MAX_HEADERS_CACHE_RUNS = 32;
+/** The maximum number of blocks in a 'getcfilters' request */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** The maximum number of filter hashes in a 'cfheaders' protocol message */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+/** The only compact block filter type: output scripts and spent outpoints */
+static const unsigned char BLOCK_FILTER_BASIC = 0;
+/** Maximum number of validated headers kept ahead of the block tree during headers-first sync */
+static const unsigned int MAX_HEADERS_AHEAD = 20000;
+/** Number of blocks that can be requested from a single peer at the same time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** How far beyond the block tree (in headers) blocks are fetched in parallel */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Seconds a peer may hold back the first missing block of the download window before it counts as stalling */
+static const int64 BLOCK_STALLING_TIMEOUT = 30;
+/** Seconds the sync node may take to answer a 'getheaders' before header sync moves to another node */
+static const int64 HEADERS_RESPONSE_TIMEOUT = 2 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Raw block bytes the import pipeline may hold between reading and connecting */
+static const unsigned int MAX_IMPORT_BYTES_IN_FLIGHT = 64 * 1024 * 1024;
+/** Number of coins buffered between database writes while loading a UTXO snapshot */
+static const unsigned int SNAPSHOT_LOAD_BATCH_SIZE = 100000;
+/** Block and undo files holding any of this many blocks below the tip are never pruned */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target (in MiB): room for the unpruned tail plus a full block file and its undo data */
+static const uint64 MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 /** Dust Soft Limit, allowed with additional fee per output */
@@ -123,6 +167,12 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern int nAskedForBlocks;    // Nodes sent a getblocks 0
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fBlockFilterIndex;
+extern bool fPruneMode;
+extern bool fHavePruned;
+extern uint64 nPruneTarget;
 extern unsigned int nCoinCacheSize;
 extern CVirtualSendPool virtualSendPool;
 extern CVirtualSendSigner virtualSendSigner;
@@ -144,6 +194,11 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
+class CBlockFilterDB;
+class CBlockFilter;
+class CCoinsSnapshotHeader;
+class CVerifyDBStatus;
+class CBlockLocator;
 struct CDiskBlockPos;
 class CCoins;
 class CTxUndo;
@@ -154,14 +209,24 @@ class CValidationState;
 
 struct CBlockTemplate;
 
+/** Time spent in ProcessMessage() for one command */
+struct CMessageTiming
+{
+    uint64 nCount;
+    int64 nTotalMicros;
+    int64 nMaxMicros;
+
+    CMessageTiming() : nCount(0), nTotalMicros(0), nMaxMicros(0) {}
+};
+
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWallet* pwalletIn);
 /** Unregister a wallet from core */
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block (fPreChecked: proof of work and merkle root were already checked, see LoadExternalBlockFile) */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fPreChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -176,18 +241,43 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
-/** Verify consistency of the block and coin databases */
-bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Verify consistency of the block and coin databases, leaving levels 3 and 4 to ThreadVerifyDB if fDeferCoins */
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool fDeferCoins = false);
+/** Verify the coin database against the last blocks after startup (-checkbackground) */
+void ThreadVerifyDB();
+/** Get the progress of the background verification */
+void GetVerifyDBStatus(CVerifyDBStatus& status);
+/** Write the coin database as a UTXO snapshot of the current tip; hashMuHash is what Checkpoints::CheckSnapshot() expects */
+bool DumpTxOutSet(const boost::filesystem::path& path, CCoinsSnapshotHeader& header, uint256& hashSnapshot, uint256& hashMuHash, std::string& strError);
+/** Replace the coin database of a fresh node with a UTXO snapshot whose MuHash is compiled in */
+bool LoadTxOutSet(const boost::filesystem::path& path, CCoinsSnapshotHeader& header, std::string& strError);
 /** Print the loaded block tree */
 void PrintBlockTree();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int Vcoinh);
+/** Build the locator of a block, looking up main chain blocks by height (requires LOCK(cs_main)) */
+CBlockLocator GetBlockLocator(CBlockIndex* pindex);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Copy the per-command message processing times */
+void GetMessageTimings(std::map<std::string, CMessageTiming>& mapTimingsOut);
+/** Get the -maxhistoricalupload rate in bytes/s (0 for none), bytes of old blocks sent, and times they were held back */
+void GetHistoricalUploadStats(int64& nRate, uint64& nBytesSent, uint64& nThrottled);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Build the missing compact block filters of the main chain */
+void ThreadBlockFilterIndex();
+/** Look up the compact filter of a block and its filter header */
+bool GetBlockFilter(const uint256& hash, CBlockFilter& filter, uint256& header);
+/** Look up the amounts received and spent by an address in blocks nStart to nEnd (0 = no limit) */
+bool GetAddressIndex(const uint160& hashBytes, int nType, std::vector<std::pair<CAddressIndexKey, int64> >& vAddressIndex,
+                     int nStart = 0, int nEnd = 0);
+/** Look up the unspent outputs of an address */
+bool GetAddressUnspent(const uint160& hashBytes, int nType, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentOutputs);
+/** Look up the input that spent an output, in the memory pool or the main chain */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
 //** Get age of an input */
 int GetInputAge(CTxIn& vin);
 /** Run the miner threads */
@@ -881,6 +971,25 @@ public:
     }
 };
 
+/** What the coin database holds for a transaction: the hash and totals of its
+ * record. Cache entries carry it from the read, so that writing them back can
+ * update the database totals without reading the old record again.
+ */
+class CCoinsOrigin
+{
+public:
+    bool fExists;           // false if the database has no record
+    uint256 hashRecord;     // Hash() of the serialized (txid, coins) record
+    unsigned int nValueSize;
+    unsigned int nOutputs;
+    int64 nAmount;
+
+    CCoinsOrigin() : fExists(false), nValueSize(0), nOutputs(0), nAmount(0) { }
+
+    // describe the record that coins are stored as (see txdb.cpp)
+    CCoinsOrigin(const uint256 &txid, const CCoins &coins);
+};
+
 /** pruned version of CTransaction: only retains metadata and unspent transaction outputs
  *
  * Serialized format:
@@ -948,6 +1057,11 @@ public:
     // as new tx version will probably only be introduced at certain heights
     int nVersion;
 
+    // what the coin database held for this txid when a view read it; not serialized.
+    // Coins created by a view start out as absent, since BIP30 only lets them
+    // replace a transaction that is fully spent.
+    CCoinsOrigin origin;
+
     // construct a CCoins from a CTransaction, at a given height
     CCoins(const CTransaction &tx, int VcoinhIn) : fCoinBase(tx.IsCoinBase()), vout(tx.vout), Vcoinh(VcoinhIn), nVersion(tx.nVersion) { }
 
@@ -967,6 +1081,14 @@ public:
         to.vout.swap(vout);
         std::swap(to.Vcoinh, Vcoinh);
         std::swap(to.nVersion, nVersion);
+        std::swap(to.origin, origin);
+    }
+
+    // drop all outputs and metadata, but keep what the database holds
+    void Clear() {
+        CCoinsOrigin originKeep = origin;
+        *this = CCoins();
+        origin = originKeep;
     }
 
     // equality test
@@ -1265,11 +1387,19 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    // calculate the hash of a node in the merkle tree (at leaf level: the txid's themself)
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
+    // index of the first node at the given height in a tree stored level by level, as CBlock::vMerkleTree
+    unsigned int CalcTreeOffset(int height) {
+        unsigned int nOffset = 0;
+        for (int h = 0; h < height; h++)
+            nOffset += CalcTreeWidth(h);
+        return nOffset;
+    }
 
     // recursive function that traverses tree nodes, storing the data as bits and hashes
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<bool> &vMatch);
+
+    // build from the complete tree (txids first, then each level up to the root)
+    void Build(const std::vector<uint256> &vTree, const std::vector<bool> &vMatch);
 
     // recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
     // it returns the hash of the respective node.
@@ -1300,6 +1430,9 @@ public:
     // Construct a partial merkle tree from a list of transaction id's, and a mask that selects a subset of them
     CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    // Same, from a block's complete merkle tree as made by CBlock::BuildMerkleTree
+    CPartialMerkleTree(const std::vector<uint256> &vTree, unsigned int nTransactionsIn, const std::vector<bool> &vMatch);
+
     CPartialMerkleTree();
 
     // extract the matching txid's represented by this partial merkle tree.
@@ -1719,9 +1852,9 @@ public:
              VcoinhFirst = VcoinhIn;
          if (nBlocks==0 || nTimeFirst > nTimeIn)
              nTimeFirst = nTimeIn;
-         nBlocks++;
-         if (VcoinhIn > VcoinhFirst)
+         if (nBlocks==0 || VcoinhIn > VcoinhLast)
              VcoinhLast = VcoinhIn;
+         nBlocks++;
          if (nTimeIn > nTimeLast)
              nTimeLast = nTimeIn;
      }
@@ -2234,6 +2367,9 @@ public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // address index view of the pool, maintained if -addressindex
+    std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta> mapAddress;
+    std::map<uint256, std::vector<CMempoolAddressDeltaKey> > mapAddressInserted;
 
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool acceptable(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
@@ -2244,6 +2380,10 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    void addAddressIndex(const uint256& hash, const CTransaction &tx);
+    void removeAddressIndex(const uint256& hash);
+    void getAddressIndex(const std::vector<std::pair<uint160, int> >& vAddresses,
+                         std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >& vResults);
 
     unsigned long size()
     {
@@ -2264,6 +2404,28 @@ public:
 
 extern CTxMemPool mempool;
 
+/** A transaction waiting for its inputs */
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;        // -1 if it didn't come from a peer
+    int64 nTimeExpire;
+    unsigned int nSize;
+    unsigned int nListPos;  // position in vOrphanList, for random eviction
+};
+
+/** Keep a transaction until its inputs arrive. Returns false if it is known
+ *  already, too big, or its peer has used up MAX_PEER_ORPHAN_TRANSACTIONS_SIZE. */
+bool AddOrphanTx(const CTransaction& tx, NodeId peer = -1);
+/** Drop an orphan, e.g. once it was accepted after all */
+void EraseOrphanTx(uint256 hash);
+/** Drop expired orphans (every ORPHAN_TX_EXPIRE_INTERVAL), then random ones until within the count and size limits */
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes = MAX_ORPHAN_TRANSACTIONS_SIZE);
+/** Drop the orphans a peer sent us, when it disconnects. requires LOCK(cs_main) */
+void EraseOrphansFor(NodeId peer);
+/** Re-try orphans that spend outputs of transactions accepted into the memory pool */
+void ProcessOrphanWork(unsigned int nMaxWork = MAX_ORPHAN_WORK);
+
 struct CCoinsStats
 {
     int Vcoinh;
@@ -2271,10 +2433,68 @@ struct CCoinsStats
     uint64 nTransactions;
     uint64 nTransactionOutputs;
     uint64 nSerializedSize;
-    uint256 hashSerialized;
+    uint256 hashMuHash;
     int64 nTotalAmount;
 
-    CCoinsStats() : Vcoinh(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : Vcoinh(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashMuHash(0), nTotalAmount(0) {}
+};
+
+/** Start of a UTXO snapshot file. It is followed by nCoins (txid, CCoins)
+ * records and a checksum over the base block and all records. What
+ * Checkpoints::CheckSnapshot() compares against is the MuHash of the
+ * records, which the loader computes itself.
+ */
+class CCoinsSnapshotHeader
+{
+public:
+    static const int CURRENT_VERSION=1;
+    unsigned char pchMessageStart[4];
+    int nVersion;
+    uint256 hashBlock;
+    int Vcoinh;
+    uint64 nCoins;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashBlock);
+        READWRITE(Vcoinh);
+        READWRITE(nCoins);
+    )
+
+    CCoinsSnapshotHeader()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        nVersion = CURRENT_VERSION;
+        hashBlock = 0;
+        Vcoinh = 0;
+        nCoins = 0;
+    }
+};
+
+/** Progress of the coin database verification that -checkbackground moves
+ * out of startup (see ThreadVerifyDB) */
+class CVerifyDBStatus
+{
+public:
+    std::string strState;   // disabled, pending, running, done or failed
+    int nCheckLevel;
+    int nCheckDepth;
+    uint256 hashBlock;      // tip of the verified snapshot
+    int Vcoinh;
+    int nBlocksChecked;
+    int64 nTimeStart;
+    int64 nTimeEnd;
+    std::string strError;
+
+    CVerifyDBStatus() : strState("disabled"), nCheckLevel(0), nCheckDepth(0), hashBlock(0), Vcoinh(0),
+        nBlocksChecked(0), nTimeStart(0), nTimeEnd(0) {}
 };
 
 /** Abstract view on the open txout dataset. */
@@ -2303,6 +2523,13 @@ public:
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
 
+    // Write every (txid, CCoins) record to a snapshot file, counting them in header.nCoins
+    virtual bool DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header);
+
+    // Create a read-only view of the stored coins as they are now, which later
+    // writes don't change. NULL if unsupported; the caller deletes it.
+    virtual CCoinsView *NewSnapshot();
+
     // As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -2323,6 +2550,8 @@ public:
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    bool DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header);
+    CCoinsView *NewSnapshot();
 };
 
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
@@ -2359,6 +2588,72 @@ private:
     std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
 };
 
+/** Write statistics of CCoinsViewFlusher */
+struct CCoinsFlushStats
+{
+    uint64 nFlushes;        // flushes handed over by pcoinsTip
+    uint64 nWrites;         // database writes done for them
+    uint64 nCoinsFlushed;   // coin records handed over
+    uint64 nCoinsWritten;   // coin records written, after coalescing
+    uint64 nBytesWritten;   // serialized size of the records written
+    int64 nSyncMicros;      // fsync of block files and block index
+    int64 nWriteMicros;     // coin database writes
+    int64 nLastMicros;      // last write, fsyncs included
+    int64 nMaxMicros;
+    int64 nStallMicros;     // flushes waiting for the writer (on cs_main)
+    uint64 nStalls;
+    unsigned int nQueued;   // records waiting for the next write
+
+    CCoinsFlushStats() : nFlushes(0), nWrites(0), nCoinsFlushed(0), nCoinsWritten(0), nBytesWritten(0),
+        nSyncMicros(0), nWriteMicros(0), nLastMicros(0), nMaxMicros(0), nStallMicros(0), nStalls(0), nQueued(0) {}
+};
+
+/** CCoinsView between pcoinsTip and the coin database that writes flushed
+ * changes from a background thread, so tip updates don't wait for LevelDB
+ * and fsync. Changes flushed while a write is running are merged into one
+ * batch for the next. Before writing coins the block and undo files and the
+ * block index are synced, so the coin database never refers to undo data or
+ * blocks that didn't make it to disk. Until written, changes are served
+ * from memory.
+ */
+class CCoinsViewFlusher : public CCoinsViewBacked
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWrite;    // writer waits for changes
+    boost::condition_variable condWritten;  // flushes wait for the writer
+    std::map<uint256, CCoins> mapQueued;
+    std::map<uint256, CCoins> mapWriting;
+    CBlockIndex *pindexQueued;
+    CBlockIndex *pindexWriting;
+    bool fWriting;
+    bool fFailed;
+    bool fQuit;
+    CCoinsFlushStats stats;
+    boost::thread *pthread;
+
+    void ThreadWrite();
+    bool Find(const uint256 &txid, CCoins &coins);
+
+public:
+    CCoinsViewFlusher(CCoinsView &baseIn);
+    ~CCoinsViewFlusher();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+    bool DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header);
+    CCoinsView *NewSnapshot();
+
+    // Wait until everything flushed so far is in the database
+    bool Sync();
+    void GetFlushStats(CCoinsFlushStats &statsOut);
+};
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 class CCoinsViewMemPool : public CCoinsViewBacked
@@ -2375,9 +2670,15 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Background writer below pcoinsTip */
+extern CCoinsViewFlusher *pcoinsflusher;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Compact block filter index, NULL unless -blockfilterindex */
+extern CBlockFilterDB *pblockfilterdb;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -2414,6 +2715,10 @@ public:
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    // Same, with the merkle tree of block already built and the bloom keys of
+    // its transactions prepared, so they can be shared between filters
+    CMerkleBlock(const CBlock& block, const std::vector<CBloomTxKeys>& vKeys, CBloomFilter& filter);
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(header);
@@ -2421,6 +2726,124 @@ public:
     )
 };
 
+
+
+/** A transaction sent in full inside a compact block, with its position in the block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction()
+    {
+        nIndex = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Used to relay new blocks as the header plus salted 6-byte short ids of the
+ * transactions, which the receiver looks up in its memory pool. Transactions
+ * it can't have (the coinbase, which also pays the masternode) are sent in full.
+ */
+class CCompactBlock
+{
+public:
+    static const unsigned int SHORTTXID_SIZE = 6;
+
+    CBlockHeader header;
+    uint64 nShortIDNonce;
+    std::vector<unsigned char> vchShortTxIDs; // SHORTTXID_SIZE bytes for each transaction not prefilled
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CCompactBlock()
+    {
+        nShortIDNonce = 0;
+    }
+
+    CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nShortIDNonce);
+        READWRITE(vchShortTxIDs);
+        READWRITE(vPrefilledTxn);
+    )
+
+    unsigned int GetTxCount() const
+    {
+        return vchShortTxIDs.size() / SHORTTXID_SIZE + vPrefilledTxn.size();
+    }
+
+    /** SipHash keys for the short ids, derived from the header and the nonce */
+    void GetSipHashKeys(uint64& k0, uint64& k1) const;
+    /** The n'th short id of the message */
+    uint64 GetShortID(unsigned int n) const;
+    static uint64 GetShortID(uint64 k0, uint64 k1, const uint256& txid)
+    {
+        return SipHashUint256(k0, k1, txid) & 0xffffffffffffULL;
+    }
+};
+
+/** Asks for the transactions of a compact block that could not be found in the memory pool */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The transactions asked for by a CBlockTransactionsRequest, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a CCompactBlock (memory only) */
+class CPartialBlock
+{
+public:
+    enum
+    {
+        READ_OK,
+        READ_INVALID,   // malformed compact block
+        READ_FAILED,    // short ids collide, ask for the full block
+    };
+
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+    int64 nTime;
+
+    /** Fill in the prefilled transactions and whatever the memory pool has; requires LOCK(pool.cs) */
+    int Init(const CCompactBlock& cmpctblock, const CTxMemPool& pool);
+    /** Positions of the transactions still missing */
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+    /** Fill in the missing transactions, in order; false if the count doesn't match */
+    bool FillMissing(const std::vector<CTransaction>& vtxMissing);
+    void GetBlock(CBlock& block) const;
+};
+
 class CMasterNode
 {
 public:
@@ -2487,6 +2910,47 @@ public:
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
 };
 
+/** A dsee or dseep message waiting for ThreadMasterNodeVerify */
+class CMasterNodeMessage
+{
+public:
+    CNode* pfrom;           // held with AddRef() while queued
+    CAddress addrFrom;
+    bool fPing;
+    CTxIn vin;
+    CService addr;
+    CPubKey pubkey;
+    CPubKey pubkey2;
+    std::vector<unsigned char> vchSig;
+    int64 sigTime;
+    int count;
+    int current;
+    int64 lastUpdated;
+    bool stop;
+    std::string strMessage; // what vchSig signs
+    bool fValid;
+    CInv inv;               // marked seen once the message has been verified
+
+    CMasterNodeMessage()
+    {
+        pfrom = NULL;
+        fPing = false;
+        sigTime = 0;
+        count = 0;
+        current = 0;
+        lastUpdated = 0;
+        stop = false;
+        fValid = false;
+    }
+};
+
+/** Queue a masternode message for signature verification; false if the queue is full */
+bool QueueMasterNodeMessage(CNode* pfrom, const CMasterNodeMessage& msg);
+/** Verify and apply queued masternode messages in batches */
+void ThreadMasterNodeVerify();
+/** Run an instance of the masternode signature checking thread */
+void ThreadMasterNodeSigCheck();
+
 static const int64 POOL_FEE_AMOUNT = 0.025*COIN;
 
 /** Used to keep track of current status of virtualsend pool
@@ -0,0 +1,82 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "muhash.h"
+#include "hash.h"
+
+using namespace std;
+
+static const unsigned int MUHASH_BYTES = 384;
+
+const CBigNum& CMuHash3072::GetModulus()
+{
+    static const CBigNum bnModulus = (CBigNum(1) << (MUHASH_BYTES * 8)) - CBigNum(1103717);
+    return bnModulus;
+}
+
+// Stretch the hash of the data to 3072 bits and reduce it
+CBigNum CMuHash3072::ToNum(const uint256& hashData)
+{
+    vector<unsigned char> vch;
+    vch.reserve(MUHASH_BYTES + 1);
+    for (unsigned int i = 0; vch.size() < MUHASH_BYTES; i++) {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << hashData << i;
+        uint256 hashBlock = ss.GetHash();
+        vch.insert(vch.end(), hashBlock.begin(), hashBlock.end());
+    }
+    // setvch() reads little endian with a sign bit in the last byte
+    vch.push_back(0);
+    CBigNum bn;
+    bn.setvch(vch);
+    return bn % GetModulus();
+}
+
+static void MulMod(CBigNum& a, const CBigNum& b, const CBigNum& m)
+{
+    CAutoBN_CTX pctx;
+    if (!BN_mod_mul(&a, &a, &b, &m, pctx))
+        throw bignum_error("CMuHash3072 : BN_mod_mul failed");
+}
+
+void CMuHash3072::Insert(const vector<unsigned char>& vchData)
+{
+    InsertHash(Hash(vchData.begin(), vchData.end()));
+}
+
+void CMuHash3072::Remove(const vector<unsigned char>& vchData)
+{
+    RemoveHash(Hash(vchData.begin(), vchData.end()));
+}
+
+void CMuHash3072::InsertHash(const uint256& hashData)
+{
+    MulMod(bnNumerator, ToNum(hashData), GetModulus());
+}
+
+void CMuHash3072::RemoveHash(const uint256& hashData)
+{
+    MulMod(bnDenominator, ToNum(hashData), GetModulus());
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& b)
+{
+    MulMod(bnNumerator, b.bnNumerator, GetModulus());
+    MulMod(bnDenominator, b.bnDenominator, GetModulus());
+    return *this;
+}
+
+uint256 CMuHash3072::GetHash() const
+{
+    CAutoBN_CTX pctx;
+    CBigNum bnInverse;
+    if (!BN_mod_inverse(&bnInverse, &bnDenominator, &GetModulus(), pctx))
+        throw bignum_error("CMuHash3072::GetHash() : BN_mod_inverse failed");
+    CBigNum bn = bnNumerator;
+    MulMod(bn, bnInverse, GetModulus());
+
+    // fixed width, so equal sets always hash the same bytes
+    vector<unsigned char> vch = bn.getvch();
+    vch.resize(MUHASH_BYTES + 1, 0);
+    return Hash(vch.begin(), vch.end());
+}
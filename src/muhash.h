@@ -0,0 +1,51 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include <vector>
+
+#include "bignum.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * A rolling hash of a set: every element is hashed to a number modulo the
+ * 3072-bit prime 2^3072 - 1103717 and the set hash is their product. Adding
+ * multiplies the element into the numerator and removing multiplies it into
+ * the denominator, so both are O(1) and the order doesn't matter; the
+ * division only happens when the digest is asked for.
+ */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+    static const CBigNum& GetModulus();
+    static CBigNum ToNum(const uint256& hashData);
+
+public:
+    CMuHash3072() : bnNumerator(1), bnDenominator(1) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(bnNumerator);
+        READWRITE(bnDenominator);
+    )
+
+    void Insert(const std::vector<unsigned char>& vchData);
+    void Remove(const std::vector<unsigned char>& vchData);
+
+    // The same for an element of which only Hash() is known
+    void InsertHash(const uint256& hashData);
+    void RemoveHash(const uint256& hashData);
+
+    // Combine two set hashes (of disjoint sets) into the hash of their union
+    CMuHash3072& operator*=(const CMuHash3072& b);
+
+    uint256 GetHash() const;
+};
+
+#endif /* BITCOIN_MUHASH_H */
@@ -12,6 +12,8 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -23,11 +25,15 @@
 
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
+// Bound on distinct commands tracked per traffic map
+static const unsigned int MAX_TRAFFIC_COMMANDS = 64;
 
 using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
@@ -55,10 +61,28 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
+limitedmap<CInv, int64, CInvHasher> mapAlreadyAskedFor(MAX_INV_SZ);
+
+CInvHasher::CInvHasher()
+{
+    k0 = GetRand(std::numeric_limits<uint64>::max());
+    k1 = GetRand(std::numeric_limits<uint64>::max());
+}
+
+CUint256Hasher::CUint256Hasher()
+{
+    k0 = GetRand(std::numeric_limits<uint64>::max());
+    k1 = GetRand(std::numeric_limits<uint64>::max());
+}
+
+CRelayCache mapRelay(20 * 1000 * 1000);
+
+// Traffic of all connections since startup
+static uint64 nNetTotalRecv = 0;
+static uint64 nNetTotalSent = 0;
+static CMessageTrafficMap mapNetRecvTraffic;
+static CMessageTrafficMap mapNetSendTraffic;
+static CCriticalSection cs_netTraffic;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -93,7 +117,7 @@ bool CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     pindexLastGetBlocksBegin = pindexBegin;
     hashLastGetBlocksEnd = hashEnd;
 
-    PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    PushMessage("getblocks", GetBlockLocator(pindexBegin), hashEnd);
     return true;
 }
 
@@ -529,7 +553,10 @@ void CNode::CloseSocketDisconnect()
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
     if (lockRecv)
+    {
         vRecvMsg.clear();
+        nRecvMsgCount = 0;
+    }
 
     // if this was the sync node, we'll need a new one
     if (this == pnodeSync)
@@ -607,10 +634,98 @@ bool CNode::Misbehaving(int howmuch)
     return false;
 }
 
+void RecordTraffic(CMessageTrafficMap& mapTraffic, const std::string& strCommand, uint64 nBytes, int64 nMicros)
+{
+    CMessageTrafficMap::iterator mi = mapTraffic.find(strCommand);
+    if (mi == mapTraffic.end())
+    {
+        if (mapTraffic.size() >= MAX_TRAFFIC_COMMANDS)
+            mi = mapTraffic.insert(std::make_pair(std::string("other"), CMessageTraffic())).first;
+        else
+            mi = mapTraffic.insert(std::make_pair(strCommand, CMessageTraffic())).first;
+    }
+    CMessageTraffic& traffic = (*mi).second;
+    traffic.nMessages++;
+    traffic.nBytes += nBytes;
+    traffic.nMicros += nMicros;
+}
+
+void GetNetTraffic(uint64& nTotalRecv, uint64& nTotalSent, CMessageTrafficMap& mapRecvOut, CMessageTrafficMap& mapSentOut)
+{
+    LOCK(cs_netTraffic);
+    nTotalRecv = nNetTotalRecv;
+    nTotalSent = nNetTotalSent;
+    mapRecvOut = mapNetRecvTraffic;
+    mapSentOut = mapNetSendTraffic;
+}
+
+void CNode::RecordSendMsg(const CSerializeData& msg)
+{
+    if (msg.size() < CMessageHeader::HEADER_SIZE)
+        return;
+    const char* pchCommand = &msg[CMessageHeader::MESSAGE_START_SIZE];
+    std::string strCommand(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    {
+        LOCK(cs_traffic);
+        RecordTraffic(mapSendTraffic, strCommand, msg.size(), 0);
+    }
+    {
+        LOCK(cs_netTraffic);
+        RecordTraffic(mapNetSendTraffic, strCommand, msg.size(), 0);
+    }
+}
+
+void CNode::RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64 nMicros)
+{
+    {
+        LOCK(cs_traffic);
+        RecordTraffic(mapRecvTraffic, strCommand, nBytes, nMicros);
+    }
+    {
+        LOCK(cs_netTraffic);
+        RecordTraffic(mapNetRecvTraffic, strCommand, nBytes, nMicros);
+    }
+}
+
+static bool CompareNodeTraffic(const CNodeStats& a, const CNodeStats& b)
+{
+    return a.nSendBytes + a.nRecvBytes > b.nSendBytes + b.nRecvBytes;
+}
+
+void DumpNetTraffic()
+{
+    uint64 nTotalRecv, nTotalSent;
+    CMessageTrafficMap mapRecv, mapSent;
+    GetNetTraffic(nTotalRecv, nTotalSent, mapRecv, mapSent);
+
+    printf("Network traffic: %"PRI64u" bytes received, %"PRI64u" bytes sent\n", nTotalRecv, nTotalSent);
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, mapRecv)
+        printf("  recv %-12s %8"PRI64u" msgs %12"PRI64u" bytes %10.2fms\n", item.first.c_str(), item.second.nMessages, item.second.nBytes, item.second.nMicros * 0.001);
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTraffic)& item, mapSent)
+        printf("  sent %-12s %8"PRI64u" msgs %12"PRI64u" bytes\n", item.first.c_str(), item.second.nMessages, item.second.nBytes);
+
+    std::vector<CNodeStats> vstats;
+    {
+        LOCK(cs_vNodes);
+        vstats.reserve(vNodes.size());
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            CNodeStats stats;
+            pnode->copyStats(stats);
+            vstats.push_back(stats);
+        }
+    }
+    std::sort(vstats.begin(), vstats.end(), CompareNodeTraffic);
+    for (unsigned int i = 0; i < vstats.size() && i < 10; i++)
+        printf("  peer=%d %s: %"PRI64u" bytes received, %"PRI64u" bytes sent, %"PRIszu" messages (%"PRIszu" bytes) queued\n",
+               vstats[i].nodeid, vstats[i].addrName.c_str(), vstats[i].nRecvBytes, vstats[i].nSendBytes,
+               vstats[i].nSendQueueMsgs, vstats[i].nSendQueueBytes);
+}
+
 #undef X
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
 {
+    stats.nodeid = id;
     X(nServices);
     X(nLastSend);
     X(nLastRecv);
@@ -624,7 +739,19 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(nBlocksRequested);
+    X(nBlocksInFlight);
+    X(nBlockStalls);
     stats.fSyncNode = (this == pnodeSync);
+    // Queue depths come from counters kept next to the queues, so neither
+    // queue is touched without its lock
+    stats.nSendQueueMsgs = nSendMsgCount;
+    stats.nSendQueueBytes = nSendSize;
+    stats.nRecvQueueMsgs = nRecvMsgCount;
+    {
+        LOCK(cs_traffic);
+        X(mapRecvTraffic);
+        X(mapSendTraffic);
+    }
 }
 #undef X
 
@@ -636,7 +763,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
+        {
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            nRecvMsgCount = vRecvMsg.size();
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -657,6 +787,113 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// Pooled receive buffers, by capacity. Messages start out with at most
+// RECV_BUFFER_STEP bytes so a header can't make us allocate its full claimed
+// size up front, and move to a bigger class as the data arrives. The pool as a
+// whole holds at most MAX_RECV_BUFFER_POOL_BYTES, and classes nobody has taken
+// a buffer from for RECV_BUFFER_IDLE_TIME seconds are emptied.
+// The buffers keep CDataStream's zero_after_free_allocator, so they are wiped
+// once, when they leave the pool for good. A pool never grows past the room it
+// reserves up front: growing would copy the buffers, dropping their storage.
+static const unsigned int RECV_BUFFER_STEP = 256 * 1024;
+static const unsigned int nRecvBufferClasses[] = { 4 * 1024, 32 * 1024, RECV_BUFFER_STEP, 2 * 1000 * 1000 };
+static const unsigned int MAX_POOLED_RECV_BUFFERS = 32; // per size class
+static const unsigned int MAX_RECV_BUFFER_POOL_BYTES = 4 * 1000 * 1000;
+static const int64 RECV_BUFFER_IDLE_TIME = 60;
+static std::vector<CSerializeData> vRecvBufferPool[ARRAYLEN(nRecvBufferClasses)];
+static int64 nRecvBufferLastTaken[ARRAYLEN(nRecvBufferClasses)];
+static unsigned int nRecvBufferPoolBytes = 0;
+static CCriticalSection cs_vRecvBufferPool;
+
+// requires LOCK(cs_vRecvBufferPool)
+static void TrimRecvBufferPool(int64 nNow)
+{
+    for (unsigned int nClass = 0; nClass < ARRAYLEN(nRecvBufferClasses); nClass++)
+    {
+        std::vector<CSerializeData>& vPool = vRecvBufferPool[nClass];
+        if (vPool.empty() || nNow - nRecvBufferLastTaken[nClass] < RECV_BUFFER_IDLE_TIME)
+            continue;
+        BOOST_FOREACH(const CSerializeData& data, vPool)
+            nRecvBufferPoolBytes -= data.capacity();
+        vPool.clear();
+    }
+}
+
+static void ReturnRecvBuffer(CSerializeData& data)
+{
+    // Pool the buffer in the largest class it can hold, as long as it isn't
+    // much bigger than that class; odd sizes are simply freed
+    unsigned int nCapacity = data.capacity();
+    if (nCapacity < nRecvBufferClasses[0])
+        return;
+    unsigned int nClass = 0;
+    while (nClass + 1 < ARRAYLEN(nRecvBufferClasses) && nRecvBufferClasses[nClass + 1] <= nCapacity)
+        nClass++;
+    if (nCapacity > nRecvBufferClasses[nClass] + nRecvBufferClasses[nClass] / 8)
+        return;
+
+    LOCK(cs_vRecvBufferPool);
+    TrimRecvBufferPool(GetTime());
+    std::vector<CSerializeData>& vPool = vRecvBufferPool[nClass];
+    if (vPool.size() >= MAX_POOLED_RECV_BUFFERS || nRecvBufferPoolBytes + nCapacity > MAX_RECV_BUFFER_POOL_BYTES)
+        return;
+    data.clear();
+    if (vPool.capacity() < MAX_POOLED_RECV_BUFFERS)
+        vPool.reserve(MAX_POOLED_RECV_BUFFERS); // only while it is empty
+    vPool.push_back(CSerializeData());
+    vPool.back().swap(data);
+    nRecvBufferPoolBytes += nCapacity;
+}
+
+static void TakeRecvBuffer(CSerializeData& data, unsigned int nSize)
+{
+    unsigned int nClass = 0;
+    while (nClass < ARRAYLEN(nRecvBufferClasses) && nRecvBufferClasses[nClass] < nSize)
+        nClass++;
+    if (nClass == ARRAYLEN(nRecvBufferClasses))
+    {
+        data.reserve(nSize);
+        return;
+    }
+
+    {
+        LOCK(cs_vRecvBufferPool);
+        nRecvBufferLastTaken[nClass] = GetTime();
+        std::vector<CSerializeData>& vPool = vRecvBufferPool[nClass];
+        if (!vPool.empty())
+        {
+            data.swap(vPool.back());
+            vPool.pop_back();
+            nRecvBufferPoolBytes -= data.capacity();
+            return;
+        }
+    }
+    data.reserve(nRecvBufferClasses[nClass]);
+}
+
+void ReserveRecvBuffer(CDataStream& vRecv, unsigned int nSize)
+{
+    if (vRecv.capacity() >= nSize)
+        return;
+    CSerializeData data;
+    TakeRecvBuffer(data, nSize);
+    data.insert(data.end(), vRecv.begin(), vRecv.end());
+    vRecv.Swap(data);
+    ReturnRecvBuffer(data);
+}
+
+void ReleaseRecvBuffer(CDataStream& vRecv)
+{
+    CSerializeData data;
+    vRecv.GetAndClear(data);
+    ReturnRecvBuffer(data);
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -684,7 +921,7 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    ReserveRecvBuffer(vRecv, std::min(hdr.nMessageSize, RECV_BUFFER_STEP));
 
     return nCopy;
 }
@@ -694,7 +931,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Grow geometrically up to the announced size; appending doesn't zero-fill
+    if (vRecv.capacity() < nDataPos + nCopy)
+        ReserveRecvBuffer(vRecv, std::min(hdr.nMessageSize, std::max(nDataPos + nCopy, 2 * (unsigned int)vRecv.capacity())));
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -708,24 +948,89 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+void SetMessageSizeAndChecksum(CDataStream& ssMsg)
+{
+    // Set the size
+    unsigned int nSize = ssMsg.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMsg[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ssMsg.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMsg[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+CDataStream BeginSerializedMessage(const char* pszCommand)
+{
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader(pszCommand, 0);
+    return ssMsg;
+}
+
+CSerializeDataRef EndSerializedMessage(CDataStream& ssMsg)
+{
+    SetMessageSizeAndChecksum(ssMsg);
+    CSerializeData* pdata = new CSerializeData();
+    ssMsg.GetAndClear(*pdata);
+    return CSerializeDataRef(pdata);
+}
+
+// Number of queued messages handed to the kernel in a single sendmsg() call
+static const int MAX_SEND_IOVECS = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializeDataRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather the unsent part of the queue into one vectored write,
+        // so small messages (inv, ping, headers) don't cost a syscall each
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializeDataRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; itIov++) {
+            const CSerializeData &data = **itIov;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nOffset = 0;
+            nIov++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            {
+                LOCK(cs_netTraffic);
+                nNetTotalSent += nBytes;
+            }
+            // Drop every message that went out completely
+            size_t nRemaining = nBytes;
+            while (nRemaining > 0) {
+                const CSerializeData &data = **it;
+                size_t nLeft = data.size() - pnode->nSendOffset;
+                if (nRemaining < nLeft) {
+                    pnode->nSendOffset += nRemaining;
+                    break;
+                }
+                nRemaining -= nLeft;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -749,6 +1054,7 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    pnode->nSendMsgCount = pnode->vSendMsg.size();
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -804,7 +1110,15 @@ void ThreadSocketHandler()
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    // the node's orphans go with it
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        EraseOrphansFor(pnode->id);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
@@ -998,6 +1312,10 @@ void ThreadSocketHandler()
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
+                            {
+                                LOCK(cs_netTraffic);
+                                nNetTotalRecv += nBytes;
+                            }
                         }
                         else if (nBytes == 0)
                         {
@@ -1261,10 +1579,20 @@ unsigned int pnSeed[] =
 
 void DumpAddresses()
 {
+    // Nothing to do if the tables didn't change since the last dump. The
+    // snapshot itself only takes addrman's lock shared, and the file is
+    // written after it is released.
+    static uint64 nLastDumped = 0;
+    uint64 nModifications = addrman.GetModifications();
+    if (nModifications == nLastDumped)
+        return;
+
     int64 nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (!adb.Write(addrman))
+        return;
+    nLastDumped = nModifications;
 
     printf("Flushed %d addresses to peers.dat  %"PRI64d"ms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1501,9 +1829,14 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 
 
 // for now, use a very simple selection metric: the node from which we received
-// most recently
+// most recently, with an hour's penalty for every block download it stalled
 double static NodeSyncScore(const CNode *pnode) {
-    return -pnode->nLastRecv;
+    return -pnode->nLastRecv - 60 * 60 * pnode->nBlockStalls;
+}
+
+void ReleaseSyncNode(CNode *pnode) {
+    if (pnode == pnodeSync)
+        pnodeSync = NULL;
 }
 
 void static StartSync(const vector<CNode*> &vNodes) {
@@ -1537,6 +1870,68 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Process the next received message of a node, unless another message
+// thread is already busy with it. Holding cs_vRecvMsg for the duration keeps
+// each peer's messages in order while different peers run concurrently.
+// Returns true if the node has more work queued.
+static bool ProcessNodeMessages(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return false;
+
+    if (!ProcessMessages(pnode))
+        pnode->CloseSocketDisconnect();
+
+    if (pnode->nSendSize < SendBufferSize())
+    {
+        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+            return true;
+    }
+    return false;
+}
+
+// Extra message threads (-msghandlers) only work on received messages;
+// syncing and SendMessages stay on ThreadMessageHandler.
+void ThreadMessageProcessor()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        bool fSleep = true;
+
+        // Start at a random node so the threads don't all queue up on the same peer
+        unsigned int nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+        for (unsigned int i = 0; i < vNodesCopy.size(); i++)
+        {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
+            if (pnode->fDisconnect)
+                continue;
+
+            if (ProcessNodeMessages(pnode))
+                fSleep = false;
+            boost::this_thread::interruption_point();
+        }
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        if (fSleep)
+            MilliSleep(100);
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1571,22 +1966,8 @@ void ThreadMessageHandler()
                 continue;
 
             // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
+            if (ProcessNodeMessages(pnode))
+                fSleep = false;
             boost::this_thread::interruption_point();
 
             // Send messages
@@ -1807,9 +2188,20 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageThreads = GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS);
+    if (nMessageThreads <= 0)
+        nMessageThreads += boost::thread::hardware_concurrency();
+    nMessageThreads = max(1, min(nMessageThreads, MAX_MSGHANDLER_THREADS));
+    for (int i = 1; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgproc", &ThreadMessageProcessor));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
+
+    // Periodically log the traffic per command and the busiest peers
+    int64 nTrafficDumpInterval = GetArg("-nettrafficdump", 0);
+    if (nTrafficDumpInterval > 0)
+        threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "nettraffic", &DumpNetTraffic, nTrafficDumpInterval * 1000));
 }
 
 bool StopNode()
@@ -1882,18 +2274,13 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
 {
     CInv inv(MSG_TX, hash);
     {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        CDataStream ssMsg = BeginSerializedMessage(inv.GetCommand());
+        ssMsg += ss;
+        mapRelay.Insert(inv, EndSerializedMessage(ssMsg));
     }
+    // Keys for the filtered peers are prepared on first use, then shared
+    std::auto_ptr<CBloomTxKeys> pkeys;
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1902,27 +2289,112 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
+            if (!pkeys.get())
+                pkeys.reset(new CBloomTxKeys(tx, hash));
+            if (pnode->pfilter->IsRelevantAndUpdate(tx, *pkeys))
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
     }
 }
 
-void RelayVirtualSendElectionEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64 nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64 lastUpdated)
+CRelayCache::CRelayCache(size_t nMaxBytesIn)
 {
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
+    nBytes = 0;
+    nMaxBytes = nMaxBytesIn;
+}
+
+void CRelayCache::EraseOldest()
+{
+    boost::unordered_map<CInv, CSerializeDataRef, CInvHasher>::iterator it = mapMessages.find(vExpiration.front().second);
+    if (it != mapMessages.end())
     {
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated);
+        nBytes -= it->second->size();
+        mapMessages.erase(it);
     }
+    vExpiration.pop_front();
 }
 
-void RelayVirtualSendElectionEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 nNow, const bool stop)
+void CRelayCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    while (nBytes > nMaxBytes && !vExpiration.empty())
+        EraseOldest();
+}
+
+void CRelayCache::Insert(const CInv& inv, const CSerializeDataRef& msg)
 {
+    int64 nNow = GetTime();
+    LOCK(cs);
+    // Expire old relay messages
+    while (!vExpiration.empty() && vExpiration.front().first < nNow)
+        EraseOldest();
+
+    if (!mapMessages.insert(std::make_pair(inv, msg)).second)
+        return;
+    nBytes += msg->size();
+    vExpiration.push_back(std::make_pair(nNow + RELAY_EXPIRY, inv));
+
+    // Stay within the memory limit by dropping the oldest messages first.
+    // Peers asking for those later fall back to the mempool.
+    while (nBytes > nMaxBytes && vExpiration.size() > 1)
+        EraseOldest();
+}
+
+CSerializeDataRef CRelayCache::Find(const CInv& inv) const
+{
+    LOCK(cs);
+    boost::unordered_map<CInv, CSerializeDataRef, CInvHasher>::const_iterator it = mapMessages.find(inv);
+    if (it == mapMessages.end())
+        return CSerializeDataRef();
+    return it->second;
+}
+
+size_t CRelayCache::size() const
+{
+    LOCK(cs);
+    return mapMessages.size();
+}
+
+size_t CRelayCache::GetBytes() const
+{
+    LOCK(cs);
+    return nBytes;
+}
+
+// Masternode messages are kept in the relay cache and announced by inv, so
+// they go out in the batched inv messages of SendMessages and each peer asks
+// for them at most once. Older peers get the message itself, once.
+static void RelayMasterNodeMessage(int nType, CDataStream& ssMsg)
+{
+    CInv inv(nType, Hash(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end()));
+    CSerializeDataRef msg = EndSerializedMessage(ssMsg);
+    mapRelay.Insert(inv, msg);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
+        if (pnode->nVersion >= MASTERNODE_INV_VERSION)
+            pnode->PushInventory(inv);
+        else if (!pnode->IsInventoryKnown(inv))
+        {
+            pnode->AddInventoryKnown(inv);
+            pnode->PushSerializedMessage(msg);
+        }
     }
 }
+
+void RelayVirtualSendElectionEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64 nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64 lastUpdated)
+{
+    CDataStream ssMsg = BeginSerializedMessage("dsee");
+    ssMsg << vin << addr << vchSig << nNow << pubkey << pubkey2 << count << current << lastUpdated;
+    RelayMasterNodeMessage(MSG_MASTERNODE_ANNOUNCE, ssMsg);
+}
+
+void RelayVirtualSendElectionEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64 nNow, const bool stop)
+{
+    CDataStream ssMsg = BeginSerializedMessage("dseep");
+    ssMsg << vin << vchSig << nNow << stop;
+    RelayMasterNodeMessage(MSG_MASTERNODE_PING, ssMsg);
+}
@@ -8,6 +8,8 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -27,10 +29,15 @@ class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+/** A complete wire message (header and payload). Queued messages are immutable
+ *  and reference counted, so one serialization can be sent to many nodes. */
+typedef boost::shared_ptr<const CSerializeData> CSerializeDataRef;
+
 
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
+inline unsigned int RelayCacheSize() { return 1000*GetArg("-maxrelaycache", 20*1000); }
 
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
@@ -44,7 +51,13 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+/** Stop syncing from pnode if it is the sync node; the message handler picks another */
+void ReleaseSyncNode(CNode *pnode);
 void SocketSendData(CNode *pnode);
+void SetMessageSizeAndChecksum(CDataStream& ssMsg);
+/** Start a message that is serialized once and queued on several nodes with CNode::PushSerializedMessage() */
+CDataStream BeginSerializedMessage(const char* pszCommand);
+CSerializeDataRef EndSerializedMessage(CDataStream& ssMsg);
 
 typedef int NodeId;
 
@@ -81,10 +94,68 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64> mapAlreadyAskedFor;
+
+/** Salted hash of a CInv, so peers can't choose inventory that collides in our hash tables */
+class CInvHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CInvHasher();
+    size_t operator()(const CInv& inv) const
+    {
+        return SipHashUint256(k0, k1, inv.hash) ^ inv.type;
+    }
+};
+
+/** Salted hash of a uint256, for hash tables keyed by hashes peers can choose */
+class CUint256Hasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CUint256Hasher();
+    size_t operator()(const uint256& hash) const
+    {
+        return SipHashUint256(k0, k1, hash);
+    }
+};
+
+extern limitedmap<CInv, int64, CInvHasher> mapAlreadyAskedFor;
+
+/** Recently relayed inventory, kept as complete wire messages so that getdata
+ *  requests from any number of peers queue the same payload without copying.
+ *  Entries expire after RELAY_EXPIRY seconds, and the oldest ones are dropped
+ *  early when the cache holds more than its byte limit.
+ */
+class CRelayCache
+{
+private:
+    boost::unordered_map<CInv, CSerializeDataRef, CInvHasher> mapMessages;
+    std::deque<std::pair<int64, CInv> > vExpiration;
+    size_t nBytes;
+    size_t nMaxBytes;
+    mutable CCriticalSection cs;
+
+    // requires LOCK(cs)
+    void EraseOldest();
+
+public:
+    static const int64 RELAY_EXPIRY = 15 * 60;
+
+    CRelayCache(size_t nMaxBytesIn);
+    void SetMaxBytes(size_t nMaxBytesIn);
+    /** Keep msg for inv, unless an earlier message for it is still cached */
+    void Insert(const CInv& inv, const CSerializeDataRef& msg);
+    /** Returns the cached message for inv, or an empty reference */
+    CSerializeDataRef Find(const CInv& inv) const;
+    size_t size() const;
+    size_t GetBytes() const;
+};
+
+extern CRelayCache mapRelay;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -93,9 +164,31 @@ extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
 
+/** Messages and bytes of one command in one direction; for received
+ *  messages also the time spent in ProcessMessage() */
+struct CMessageTraffic
+{
+    uint64 nMessages;
+    uint64 nBytes;
+    int64 nMicros;
+
+    CMessageTraffic() : nMessages(0), nBytes(0), nMicros(0) {}
+};
+
+typedef std::map<std::string, CMessageTraffic> CMessageTrafficMap;
+
+/** Add a message to a traffic map. Commands beyond the first
+ *  MAX_TRAFFIC_COMMANDS are counted as "other". */
+void RecordTraffic(CMessageTrafficMap& mapTraffic, const std::string& strCommand, uint64 nBytes, int64 nMicros);
+/** Copy the traffic of all connections since startup */
+void GetNetTraffic(uint64& nTotalRecv, uint64& nTotalSent, CMessageTrafficMap& mapRecvOut, CMessageTrafficMap& mapSentOut);
+/** Print the traffic totals and the busiest peers to the debug log */
+void DumpNetTraffic();
+
 class CNodeStats
 {
 public:
+    NodeId nodeid;
     uint64 nServices;
     int64 nLastSend;
     int64 nLastRecv;
@@ -110,6 +203,13 @@ public:
     uint64 nRecvBytes;
     uint64 nBlocksRequested;
     bool fSyncNode;
+    int nBlocksInFlight;
+    int nBlockStalls;
+    size_t nSendQueueMsgs;
+    size_t nSendQueueBytes;
+    size_t nRecvQueueMsgs;
+    CMessageTrafficMap mapRecvTraffic;
+    CMessageTrafficMap mapSendTraffic;
 };
 
 
@@ -133,6 +233,8 @@ public:
         nDataPos = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -150,6 +252,12 @@ public:
     int readData(const char *pch, unsigned int nBytes);
 };
 
+/** Receive buffers are recycled by size class instead of being freed after
+ * every message; zero_after_free_allocator only wipes them when they are
+ * finally freed, not on reuse. */
+void ReserveRecvBuffer(CDataStream& vRecv, unsigned int nSize);
+void ReleaseRecvBuffer(CDataStream& vRecv);
+
 
 
 
@@ -165,15 +273,23 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    uint64 nSendBytesQueued; // total size of all messages ever queued
+    std::deque<CSerializeDataRef> vSendMsg;
+    size_t nSendMsgCount; // vSendMsg.size(), kept for readers not holding cs_vSend
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    size_t nRecvMsgCount; // vRecvMsg.size(), kept for readers not holding cs_vRecvMsg
     CCriticalSection cs_vRecvMsg;
     uint64 nRecvBytes;
     int nRecvVersion;
 
+    // per-command traffic of this connection
+    CMessageTrafficMap mapRecvTraffic;
+    CMessageTrafficMap mapSendTraffic;
+    CCriticalSection cs_traffic;
+
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
@@ -220,20 +336,35 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first block download, protected by cs_main
+    bool fSyncHeaders;      // more headers to fetch from this node once the header chain has room
+    int nBlocksInFlight;    // blocks requested from this node and not yet received
+    int nBlocksDelivered;
+    int nBlockStalls;       // recent download stalls; each one halves the node's request window
+    int64 nLastBlockStall;  // when it last stalled; the blocked block goes to others for a while
+    int64 nGetHeadersTime;  // when the unanswered getheaders to this node was sent, 0 if none
+
+    // masternode list requested with dseg, streamed by SendMessages (protected by cs_main):
+    // the collateral outpoints of the list at the time of the request
+    std::vector<std::pair<uint256, unsigned int> > vMasterNodeListToSend;
+    unsigned int nMasterNodeListNext;
+    int nMasterNodeListSent;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown; // protects vAddrToSend and setAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), filterInventoryKnown(std::max(SendBufferSize() / 200, 1000u), 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -241,6 +372,7 @@ public:
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
+        nSendBytesQueued = 0;
         nRecvBytes = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
@@ -259,16 +391,25 @@ public:
         fAskedForBlocks = false;
         nRefCount = 0;
         nSendSize = 0;
+        nSendMsgCount = 0;
+        nRecvMsgCount = 0;
         nSendOffset = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fSyncHeaders = false;
+        nBlocksInFlight = 0;
+        nBlocksDelivered = 0;
+        nBlockStalls = 0;
+        nLastBlockStall = 0;
+        nGetHeadersTime = 0;
+        nMasterNodeListNext = 0;
+        nMasterNodeListSent = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
 
         {
@@ -339,6 +480,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -347,16 +489,38 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
 
 
+    // The known inventory filter is keyed by the hash followed by the type
+    static void GetInventoryKnownKey(const CInv& inv, unsigned char* pch)
+    {
+        memcpy(pch, inv.hash.begin(), 32);
+        unsigned int nType = inv.type;
+        for (int i = 0; i < 4; i++)
+            pch[32 + i] = (nType >> (8 * i)) & 0xff;
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
+        unsigned char pchKey[36];
+        GetInventoryKnownKey(inv, pchKey);
+        {
+            LOCK(cs_inventory);
+            filterInventoryKnown.insert(pchKey, sizeof(pchKey));
+        }
+    }
+
+    bool IsInventoryKnown(const CInv& inv)
+    {
+        unsigned char pchKey[36];
+        GetInventoryKnownKey(inv, pchKey);
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            return filterInventoryKnown.contains(pchKey, sizeof(pchKey));
         }
     }
 
@@ -364,7 +528,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!IsInventoryKnown(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -374,7 +538,7 @@ public:
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
         int64 nRequestTime;
-        limitedmap<CInv, int64>::const_iterator it = mapAlreadyAskedFor.find(inv);
+        limitedmap<CInv, int64, CInvHasher>::const_iterator it = mapAlreadyAskedFor.find(inv);
         if (it != mapAlreadyAskedFor.end())
             nRequestTime = it->second;
         else
@@ -434,34 +598,49 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        SetMessageSizeAndChecksum(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", (int)(ssSend.size() - CMessageHeader::HEADER_SIZE));
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        CSerializeData* pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        QueueSendMsg(CSerializeDataRef(pdata));
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CSerializeDataRef& msg)
+    {
+        RecordSendMsg(*msg);
+        vSendMsg.push_back(msg);
+        nSendMsgCount = vSendMsg.size();
+        nSendSize += msg->size();
+        nSendBytesQueued += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    /** Queue a message built by EndSerializedMessage(); the payload is shared, not copied */
+    void PushSerializedMessage(const CSerializeDataRef& msg)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: shared message (%d bytes)\n", (int)(msg->size() - CMessageHeader::HEADER_SIZE));
+        QueueSendMsg(msg);
     }
 
     void PushVersion();
 
+    /** Count a queued message (header and payload) in the traffic maps */
+    void RecordSendMsg(const CSerializeData& msg);
+    /** Count a received message and the time spent processing it */
+    void RecordRecvMsg(const std::string& strCommand, unsigned int nBytes, int64 nMicros);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -70,6 +70,8 @@ enum
 {
     NODE_NETWORK = (1 << 0),
     NODE_BLOOM = (1 << 1),
+    // Serves compact block filters ("getcfilters", "getcfheaders")
+    NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 /** A CService with information about it as peer */
@@ -124,6 +126,7 @@ class CInv
         )
 
         friend bool operator<(const CInv& a, const CInv& b);
+        friend bool operator==(const CInv& a, const CInv& b);
 
         bool IsKnownType() const;
         const char* GetCommand() const;
@@ -143,6 +146,12 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Only asked for in a getdata, answered with a "cmpctblock" message.
+    MSG_CMPCT_BLOCK,
+    // Masternode announcements ("dsee") and pings ("dseep"), identified by
+    // the hash of the message payload.
+    MSG_MASTERNODE_ANNOUNCE,
+    MSG_MASTERNODE_PING,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
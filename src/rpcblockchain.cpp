@@ -5,6 +5,8 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "blockfilter.h"
+#include "leveldb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -171,6 +173,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex);
 
     if (!fVerbose)
@@ -184,12 +188,39 @@ Value getblock(const Array& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+Value getblockfilter(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getblockfilter <hash>\n"
+            "Returns the compact filter of block <hash> and its filter header.\n"
+            "Requires -blockfilterindex.");
+
+    if (!fBlockFilterIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filter index is not enabled (-blockfilterindex)");
+
+    uint256 hash(params[0].get_str());
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockFilter filter;
+    uint256 header;
+    if (!GetBlockFilter(hash, filter, header))
+        throw JSONRPCError(RPC_MISC_ERROR, "Filter not found, the index may still be building");
+
+    Object ret;
+    ret.push_back(Pair("filter", HexStr(filter.GetEncoded())));
+    ret.push_back(Pair("header", header.GetHex()));
+    return ret;
+}
+
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "Returns statistics about the unspent transaction output set.\n"
+            "muhash is an order independent hash of the coin database records.");
 
     Object ret;
 
@@ -200,12 +231,104 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
         ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (boost::int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("muhash", stats.hashMuHash.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+Value getflushinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getflushinfo\n"
+            "Returns statistics about the background writes of the coin database.\n"
+            "writeamplification is the share of the flushed coin records that still had to be written\n"
+            "after merging the flushes queued during a write; times are in milliseconds.\n"
+            "Only coin records are counted: writes to the block index and the transaction index are\n"
+            "not included (syncms is the time spent syncing them before each write).");
+
+    Object ret;
+
+    CCoinsFlushStats stats;
+    if (pcoinsflusher) {
+        pcoinsflusher->GetFlushStats(stats);
+        ret.push_back(Pair("flushes", (boost::int64_t)stats.nFlushes));
+        ret.push_back(Pair("writes", (boost::int64_t)stats.nWrites));
+        ret.push_back(Pair("coinsflushed", (boost::int64_t)stats.nCoinsFlushed));
+        ret.push_back(Pair("coinswritten", (boost::int64_t)stats.nCoinsWritten));
+        ret.push_back(Pair("byteswritten", (boost::int64_t)stats.nBytesWritten));
+        ret.push_back(Pair("writeamplification", stats.nCoinsFlushed ? (double)stats.nCoinsWritten / stats.nCoinsFlushed : 0.0));
+        ret.push_back(Pair("queued", (int)stats.nQueued));
+        ret.push_back(Pair("lastms", stats.nLastMicros * 0.001));
+        ret.push_back(Pair("maxms", stats.nMaxMicros * 0.001));
+        ret.push_back(Pair("avgms", stats.nWrites ? (stats.nSyncMicros + stats.nWriteMicros) * 0.001 / stats.nWrites : 0.0));
+        ret.push_back(Pair("syncms", stats.nSyncMicros * 0.001));
+        ret.push_back(Pair("writems", stats.nWriteMicros * 0.001));
+        ret.push_back(Pair("stalls", (boost::int64_t)stats.nStalls));
+        ret.push_back(Pair("stallms", stats.nStallMicros * 0.001));
+    }
+    return ret;
+}
+
+static boost::filesystem::path GetSnapshotPath(const std::string& strFile)
+{
+    boost::filesystem::path path(strFile);
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset <filename>\n"
+            "Writes the unspent transaction output set at the current tip to <filename>\n"
+            "(relative to the data directory), for loadtxoutset on a new node.\n"
+            "The returned muhash is what a client must have compiled in to load it.");
+
+    boost::filesystem::path path = GetSnapshotPath(params[0].get_str());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CCoinsSnapshotHeader header;
+    uint256 hashSnapshot, hashMuHash;
+    std::string strError;
+    if (!DumpTxOutSet(path, header, hashSnapshot, hashMuHash, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    Object ret;
+    ret.push_back(Pair("coins_written", (boost::int64_t)header.nCoins));
+    ret.push_back(Pair("base_hash", header.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", header.Vcoinh));
+    ret.push_back(Pair("snapshot_hash", hashSnapshot.GetHex()));
+    ret.push_back(Pair("muhash", hashMuHash.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
+Value loadtxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset <filename>\n"
+            "Loads a snapshot written by dumptxoutset into a node that has only synced headers so far.\n"
+            "The muhash of the snapshot must match one compiled into the client for this network, as\n"
+            "the blocks before it are never downloaded or validated. Its block becomes the new tip.");
+
+    CCoinsSnapshotHeader header;
+    std::string strError;
+    if (!LoadTxOutSet(GetSnapshotPath(params[0].get_str()), header, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    Object ret;
+    ret.push_back(Pair("coins_loaded", (boost::int64_t)header.nCoins));
+    ret.push_back(Pair("tip_hash", header.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", header.Vcoinh));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -268,3 +391,304 @@ Value verifychain(const Array& params, bool fHelp)
     return VerifyDB(nCheckLevel, nCheckDepth);
 }
 
+Value getleveldbinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getleveldbinfo [database]\n"
+            "Returns the tuning and internals of the open LevelDB databases (chainstate, blockindex, blockfilter):\n"
+            "table files per level, leveldb.stats (size and compaction time per level) and the manual compactions.\n"
+            "memorylimit is what the block cache and write buffers may take; approximate-memory-usage is only\n"
+            "reported by LevelDB versions that have it.");
+
+    std::vector<CLevelDBStats> vStats;
+    GetLevelDBStats(vStats);
+
+    Object ret;
+    BOOST_FOREACH(const CLevelDBStats& stats, vStats) {
+        if (params.size() > 0 && stats.tuning.strName != params[0].get_str())
+            continue;
+        Object obj;
+        obj.push_back(Pair("maxopenfiles", stats.tuning.nMaxOpenFiles));
+        obj.push_back(Pair("blockcache", (boost::int64_t)stats.tuning.nBlockCacheSize));
+        obj.push_back(Pair("writebuffer", (boost::int64_t)stats.tuning.nWriteBufferSize));
+        obj.push_back(Pair("blocksize", (boost::int64_t)stats.tuning.nBlockSize));
+        obj.push_back(Pair("compression", stats.tuning.fCompression));
+        obj.push_back(Pair("memorylimit", (boost::int64_t)(stats.tuning.nBlockCacheSize + 2 * stats.tuning.nWriteBufferSize)));
+        if (!stats.strMemoryUsage.empty())
+            obj.push_back(Pair("approximate-memory-usage", (boost::int64_t)atoi64(stats.strMemoryUsage)));
+        Array files;
+        BOOST_FOREACH(int nFiles, stats.vFilesAtLevel)
+            files.push_back(nFiles);
+        obj.push_back(Pair("filesatlevel", files));
+        obj.push_back(Pair("stats", stats.strStats));
+        obj.push_back(Pair("compactions", (boost::int64_t)stats.nCompactions));
+        obj.push_back(Pair("compactms", stats.nCompactMicros * 0.001));
+        obj.push_back(Pair("lastcompactms", stats.nLastCompactMicros * 0.001));
+        ret.push_back(Pair(stats.tuning.strName, obj));
+    }
+    if (params.size() > 0 && ret.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No open database of that name");
+    return ret;
+}
+
+Value compactleveldb(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "compactleveldb <database>\n"
+            "Compacts the whole key range of a LevelDB database (chainstate, blockindex or blockfilter)\n"
+            "and returns the time it took in milliseconds. Writes to it wait while this runs.");
+
+    int64 nMicros;
+    if (!CompactLevelDB(params[0].get_str(), nMicros))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No open database of that name");
+    return nMicros * 0.001;
+}
+
+Value getverificationinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getverificationinfo\n"
+            "Returns the progress of the coin database verification run after startup by -checkbackground.");
+
+    CVerifyDBStatus status;
+    GetVerifyDBStatus(status);
+
+    Object ret;
+    ret.push_back(Pair("state", status.strState));
+    if (status.nTimeStart) {
+        ret.push_back(Pair("checklevel", status.nCheckLevel));
+        ret.push_back(Pair("checkblocks", status.nCheckDepth));
+        ret.push_back(Pair("height", status.Vcoinh));
+        ret.push_back(Pair("bestblock", status.hashBlock.GetHex()));
+        ret.push_back(Pair("blockschecked", status.nBlocksChecked));
+        ret.push_back(Pair("starttime", (boost::int64_t)status.nTimeStart));
+    }
+    if (status.nTimeEnd)
+        ret.push_back(Pair("endtime", (boost::int64_t)status.nTimeEnd));
+    if (!status.strError.empty())
+        ret.push_back(Pair("error", status.strError));
+    return ret;
+}
+
+
+// The address index RPCs take one address or an array of them
+static void ParseAddressIndexAddresses(const Value& value, vector<pair<uint160, int> >& vAddresses)
+{
+    Array arr;
+    if (value.type() == str_type)
+        arr.push_back(value);
+    else if (value.type() == array_type)
+        arr = value.get_array();
+    else
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an array of addresses");
+
+    BOOST_FOREACH(const Value& v, arr)
+    {
+        CBitcoinAddress address(v.get_str());
+        CTxDestination dest = address.Get();
+        if (const CKeyID *keyID = boost::get<CKeyID>(&dest))
+            vAddresses.push_back(make_pair(uint160(*keyID), (int)ADDRESS_INDEX_PUBKEYHASH));
+        else if (const CScriptID *scriptID = boost::get<CScriptID>(&dest))
+            vAddresses.push_back(make_pair(uint160(*scriptID), (int)ADDRESS_INDEX_SCRIPTHASH));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid address: ") + v.get_str());
+    }
+}
+
+string AddressIndexToString(int nType, const uint160& hashBytes)
+{
+    if (nType == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+// Optional [skip] [count] parameters starting at params[nFirst]
+static void ParseAddressIndexPaging(const Array& params, unsigned int nFirst, unsigned int& nSkip, unsigned int& nCount)
+{
+    nSkip = 0;
+    nCount = 1000;
+    if (params.size() > nFirst)
+        nSkip = std::max(params[nFirst].get_int(), 0);
+    if (params.size() > nFirst + 1)
+        nCount = std::max(params[nFirst + 1].get_int(), 0);
+}
+
+// Orders pairs by their first member only, to stable_sort by height or time
+struct CompareFirst
+{
+    template<typename T>
+    bool operator()(const T& a, const T& b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+static void CheckAddressIndex()
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is not enabled (-addressindex)");
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address or [addresses]>\n"
+            "Returns the confirmed balance of the addresses, and the total they received.\n"
+            "Requires -addressindex.");
+
+    CheckAddressIndex();
+    vector<pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+
+    int64 nBalance = 0;
+    int64 nReceived = 0;
+    for (vector<pair<uint160, int> >::iterator it = vAddresses.begin(); it != vAddresses.end(); it++)
+    {
+        vector<pair<CAddressIndexKey, int64> > vAddressIndex;
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+        for (vector<pair<CAddressIndexKey, int64> >::iterator mi = vAddressIndex.begin(); mi != vAddressIndex.end(); mi++)
+        {
+            nBalance += mi->second;
+            if (mi->second > 0)
+                nReceived += mi->second;
+        }
+    }
+
+    Object ret;
+    ret.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    ret.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return ret;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <address or [addresses]> [skip=0] [count=1000]\n"
+            "Returns the confirmed unspent outputs of the addresses, oldest first,\n"
+            "skipping the first [skip] and returning at most [count] of them.\n"
+            "Requires -addressindex.");
+
+    CheckAddressIndex();
+    vector<pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+    unsigned int nSkip, nCount;
+    ParseAddressIndexPaging(params, 1, nSkip, nCount);
+
+    // (height, (key, value)), so that outputs of several addresses come out in chain order
+    vector<pair<int, pair<CAddressUnspentKey, CAddressUnspentValue> > > vUnspent;
+    for (vector<pair<uint160, int> >::iterator it = vAddresses.begin(); it != vAddresses.end(); it++)
+    {
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentOutputs;
+        if (!GetAddressUnspent(it->first, it->second, vUnspentOutputs))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+        for (vector<pair<CAddressUnspentKey, CAddressUnspentValue> >::iterator mi = vUnspentOutputs.begin(); mi != vUnspentOutputs.end(); mi++)
+            vUnspent.push_back(make_pair(mi->second.nHeight, *mi));
+    }
+    std::stable_sort(vUnspent.begin(), vUnspent.end(), CompareFirst());
+
+    Array ret;
+    for (unsigned int i = nSkip; i < vUnspent.size() && i - nSkip < nCount; i++)
+    {
+        const CAddressUnspentKey& key = vUnspent[i].second.first;
+        const CAddressUnspentValue& value = vUnspent[i].second.second;
+        Object output;
+        output.push_back(Pair("address", AddressIndexToString(key.nType, key.hashBytes)));
+        output.push_back(Pair("txid", key.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)key.nIndex));
+        output.push_back(Pair("script", HexStr(value.script.begin(), value.script.end())));
+        output.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+        output.push_back(Pair("height", value.nHeight));
+        ret.push_back(output);
+    }
+    return ret;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 5)
+        throw runtime_error(
+            "getaddresstxids <address or [addresses]> [start=0] [end=0] [skip=0] [count=1000]\n"
+            "Returns the ids of the confirmed transactions paying to or spending from the\n"
+            "addresses in blocks [start] to [end] (0 = no limit), in chain order,\n"
+            "skipping the first [skip] and returning at most [count] of them.\n"
+            "Requires -addressindex.");
+
+    CheckAddressIndex();
+    vector<pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+    int nStart = 0, nEnd = 0;
+    if (params.size() > 1)
+        nStart = std::max(params[1].get_int(), 0);
+    if (params.size() > 2)
+        nEnd = std::max(params[2].get_int(), 0);
+    if (nEnd > 0 && nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "End height is below start height");
+    unsigned int nSkip, nCount;
+    ParseAddressIndexPaging(params, 3, nSkip, nCount);
+
+    // ((height, position in block), txid): sorted and without duplicates
+    set<pair<pair<int, unsigned int>, uint256> > setTxids;
+    for (vector<pair<uint160, int> >::iterator it = vAddresses.begin(); it != vAddresses.end(); it++)
+    {
+        vector<pair<CAddressIndexKey, int64> > vAddressIndex;
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+        for (vector<pair<CAddressIndexKey, int64> >::iterator mi = vAddressIndex.begin(); mi != vAddressIndex.end(); mi++)
+            setTxids.insert(make_pair(make_pair(mi->first.nHeight, mi->first.nTxIndex), mi->first.txhash));
+    }
+
+    Array ret;
+    unsigned int i = 0;
+    for (set<pair<pair<int, unsigned int>, uint256> >::iterator it = setTxids.begin(); it != setTxids.end() && ret.size() < nCount; it++, i++)
+        if (i >= nSkip)
+            ret.push_back(it->second.GetHex());
+    return ret;
+}
+
+Value getaddressmempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressmempool <address or [addresses]>\n"
+            "Returns the amounts memory pool transactions pay to (positive) or spend\n"
+            "from (negative) the addresses, oldest first.\n"
+            "Requires -addressindex.");
+
+    CheckAddressIndex();
+    vector<pair<uint160, int> > vAddresses;
+    ParseAddressIndexAddresses(params[0], vAddresses);
+
+    vector<pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > vDeltas;
+    mempool.getAddressIndex(vAddresses, vDeltas);
+
+    vector<pair<int64, pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > > vSorted;
+    for (vector<pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::iterator it = vDeltas.begin(); it != vDeltas.end(); it++)
+        vSorted.push_back(make_pair(it->second.nTime, *it));
+    std::stable_sort(vSorted.begin(), vSorted.end(), CompareFirst());
+
+    Array ret;
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+    {
+        const CMempoolAddressDeltaKey& key = vSorted[i].second.first;
+        const CMempoolAddressDelta& delta = vSorted[i].second.second;
+        Object entry;
+        entry.push_back(Pair("address", AddressIndexToString(key.nType, key.hashBytes)));
+        entry.push_back(Pair("txid", key.txhash.GetHex()));
+        entry.push_back(Pair("index", (int)key.nIndex));
+        entry.push_back(Pair("amount", ValueFromAmount(delta.nAmount)));
+        entry.push_back(Pair("timestamp", (boost::int64_t)delta.nTime));
+        if (key.fSpending)
+        {
+            entry.push_back(Pair("prevtxid", delta.prevhash.GetHex()));
+            entry.push_back(Pair("prevout", (int)delta.nPrevOut));
+        }
+        ret.push_back(entry);
+    }
+    return ret;
+}
@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "main.h"
 #include "net.h"
 #include "bitcoinrpc.h"
 #include "alert.h"
@@ -67,6 +68,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
+        obj.push_back(Pair("blocksinflight", stats.nBlocksInFlight));
+        obj.push_back(Pair("blockstalls", stats.nBlockStalls));
 
         ret.push_back(obj);
     }
@@ -74,6 +77,100 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getmessagetimings(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmessagetimings\n"
+            "Returns the time spent processing each received message command.");
+
+    map<string, CMessageTiming> mapTimings;
+    GetMessageTimings(mapTimings);
+
+    Object ret;
+    for (map<string, CMessageTiming>::const_iterator mi = mapTimings.begin(); mi != mapTimings.end(); mi++)
+    {
+        const CMessageTiming& timing = (*mi).second;
+        Object obj;
+        obj.push_back(Pair("count", (boost::int64_t)timing.nCount));
+        obj.push_back(Pair("totalms", timing.nTotalMicros * 0.001));
+        obj.push_back(Pair("avgms", timing.nCount ? timing.nTotalMicros * 0.001 / timing.nCount : 0.0));
+        obj.push_back(Pair("maxms", timing.nMaxMicros * 0.001));
+        ret.push_back(Pair((*mi).first, obj));
+    }
+
+    return ret;
+}
+
+static Object TrafficToJSON(const CMessageTrafficMap& mapTraffic, bool fTiming)
+{
+    Object ret;
+    for (CMessageTrafficMap::const_iterator mi = mapTraffic.begin(); mi != mapTraffic.end(); mi++)
+    {
+        const CMessageTraffic& traffic = (*mi).second;
+        Object obj;
+        obj.push_back(Pair("msgs", (boost::int64_t)traffic.nMessages));
+        obj.push_back(Pair("bytes", (boost::int64_t)traffic.nBytes));
+        if (fTiming)
+            obj.push_back(Pair("processms", traffic.nMicros * 0.001));
+        ret.push_back(Pair((*mi).first, obj));
+    }
+    return ret;
+}
+
+Value getnettraffic(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnettraffic [peers=false]\n"
+            "Returns bytes and messages received and sent per message command,\n"
+            "and the time spent processing received ones.\n"
+            "With peers=true also returns the traffic and send queue of each peer.");
+
+    bool fPeers = params.size() > 0 ? params[0].get_bool() : false;
+
+    uint64 nTotalRecv, nTotalSent;
+    CMessageTrafficMap mapRecv, mapSent;
+    GetNetTraffic(nTotalRecv, nTotalSent, mapRecv, mapSent);
+    int64 nHistoricalRate;
+    uint64 nHistoricalBytes, nHistoricalThrottled;
+    GetHistoricalUploadStats(nHistoricalRate, nHistoricalBytes, nHistoricalThrottled);
+
+    Object ret;
+    ret.push_back(Pair("totalbytesrecv", (boost::int64_t)nTotalRecv));
+    ret.push_back(Pair("totalbytessent", (boost::int64_t)nTotalSent));
+    ret.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+    ret.push_back(Pair("historicaluploadrate", (boost::int64_t)nHistoricalRate));
+    ret.push_back(Pair("historicalbytessent", (boost::int64_t)nHistoricalBytes));
+    ret.push_back(Pair("historicalthrottled", (boost::int64_t)nHistoricalThrottled));
+    ret.push_back(Pair("recv", TrafficToJSON(mapRecv, true)));
+    ret.push_back(Pair("sent", TrafficToJSON(mapSent, false)));
+
+    if (fPeers)
+    {
+        vector<CNodeStats> vstats;
+        CopyNodeStats(vstats);
+
+        Array peers;
+        BOOST_FOREACH(const CNodeStats& stats, vstats) {
+            Object obj;
+            obj.push_back(Pair("id", stats.nodeid));
+            obj.push_back(Pair("addr", stats.addrName));
+            obj.push_back(Pair("bytesrecv", (boost::int64_t)stats.nRecvBytes));
+            obj.push_back(Pair("bytessent", (boost::int64_t)stats.nSendBytes));
+            obj.push_back(Pair("sendqueuemsgs", (boost::int64_t)stats.nSendQueueMsgs));
+            obj.push_back(Pair("sendqueuebytes", (boost::int64_t)stats.nSendQueueBytes));
+            obj.push_back(Pair("recvqueuemsgs", (boost::int64_t)stats.nRecvQueueMsgs));
+            obj.push_back(Pair("recv", TrafficToJSON(stats.mapRecvTraffic, true)));
+            obj.push_back(Pair("sent", TrafficToJSON(stats.mapSendTraffic, false)));
+            peers.push_back(obj);
+        }
+        ret.push_back(Pair("peers", peers));
+    }
+
+    return ret;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
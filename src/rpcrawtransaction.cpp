@@ -94,6 +94,15 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
             o.push_back(Pair("asm", txin.scriptSig.ToString()));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
+
+            // With -spentindex, what the input spends
+            CSpentIndexValue spentInfo;
+            if (GetSpentIndex(CSpentIndexKey(txin.prevout.hash, txin.prevout.n), spentInfo) && spentInfo.txid == tx.GetHash())
+            {
+                in.push_back(Pair("value", ValueFromAmount(spentInfo.nValue)));
+                if (spentInfo.nType != 0)
+                    in.push_back(Pair("address", AddressIndexToString(spentInfo.nType, spentInfo.hashBytes)));
+            }
         }
         in.push_back(Pair("sequence", (boost::int64_t)txin.nSequence));
         vin.push_back(in);
@@ -109,6 +118,15 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         ScriptPubKeyToJSON(txout.scriptPubKey, o);
         out.push_back(Pair("scriptPubKey", o));
+
+        // With -spentindex, the input spending it
+        CSpentIndexValue spentInfo;
+        if (GetSpentIndex(CSpentIndexKey(tx.GetHash(), i), spentInfo))
+        {
+            out.push_back(Pair("spentTxId", spentInfo.txid.GetHex()));
+            out.push_back(Pair("spentIndex", (int)spentInfo.nIn));
+            out.push_back(Pair("spentHeight", spentInfo.nHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -166,6 +184,37 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <n>\n"
+            "Returns the transaction input that spent output <n> of <txid>, and its\n"
+            "height (-1 if it is in the memory pool).\n"
+            "Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index is not enabled (-spentindex)");
+
+    uint256 hash = ParseHashV(params[0], "parameter 1");
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(CSpentIndexKey(hash, n), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object ret;
+    ret.push_back(Pair("txid", value.txid.GetHex()));
+    ret.push_back(Pair("index", (int)value.nIn));
+    ret.push_back(Pair("height", value.nHeight));
+    ret.push_back(Pair("value", ValueFromAmount(value.nValue)));
+    if (value.nType != 0)
+        ret.push_back(Pair("address", AddressIndexToString(value.nType, value.hashBytes)));
+    return ret;
+}
+
 Value listunspent(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 3)
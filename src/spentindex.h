@@ -0,0 +1,74 @@
+// Copyright (c) 2026 The VirtualCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SPENTINDEX_H
+#define BITCOIN_SPENTINDEX_H
+
+#include "uint256.h"
+#include "serialize.h"
+
+/** A spent output, in the spent index */
+struct CSpentIndexKey
+{
+    uint256 txid;
+    unsigned int nOut;
+
+    CSpentIndexKey()
+    {
+        txid = 0;
+        nOut = 0;
+    }
+
+    CSpentIndexKey(const uint256& txidIn, unsigned int nOutIn) : txid(txidIn), nOut(nOutIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nOut);
+    )
+};
+
+/** The input that spent an output, and what the output was */
+struct CSpentIndexValue
+{
+    uint256 txid;               // spending transaction
+    unsigned int nIn;
+    int nHeight;                // -1 if the spender is in the memory pool
+    int64 nValue;               // of the spent output
+    int nType;                  // address index kind of the spent output, 0 if none
+    uint160 hashBytes;
+
+    CSpentIndexValue()
+    {
+        SetNull();
+    }
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInIn, int nHeightIn, int64 nValueIn, int nTypeIn, const uint160& hashBytesIn) :
+        txid(txidIn), nIn(nInIn), nHeight(nHeightIn), nValue(nValueIn), nType(nTypeIn), hashBytes(hashBytesIn) {}
+
+    void SetNull()
+    {
+        txid = 0;
+        nIn = 0;
+        nHeight = 0;
+        nValue = 0;
+        nType = 0;
+        hashBytes = 0;
+    }
+
+    // a null value marks an entry to erase
+    bool IsNull() const
+    {
+        return txid == 0;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nIn);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(nType);
+        READWRITE(hashBytes);
+    )
+};
+
+#endif // BITCOIN_SPENTINDEX_H
@@ -15,11 +15,11 @@
 
 #include <stdint.h>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+// Tests these internal-to-main.cpp structures:
+extern boost::unordered_map<uint256, COrphanTx, CUint256Hasher> mapOrphanTransactions;
+extern boost::unordered_map<uint256, std::set<uint256>, CUint256Hasher> mapOrphanTransactionsByPrev;
+extern std::vector<uint256> vOrphanList;
+extern unsigned int nOrphanTransactionsSize;
 
 CService ip(uint32_t i)
 {
@@ -133,11 +133,19 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second;
+    return mapOrphanTransactions[vOrphanList[GetRand(vOrphanList.size())]].tx;
+}
+
+// An unsigned orphan of about 4700 bytes spending random outputs
+CTransaction BigOrphan()
+{
+    CTransaction tx;
+    tx.vin.resize(115);
+    for (unsigned int j = 0; j < tx.vin.size(); j++)
+        tx.vin[j].prevout.hash = GetRandHash();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -211,6 +219,60 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(vOrphanList.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    // One peer can only fill MAX_PEER_ORPHAN_TRANSACTIONS_SIZE...
+    unsigned int nStored = 0;
+    for (int i = 0; i < 120; i++)
+        if (AddOrphanTx(BigOrphan(), 1))
+            nStored++;
+    BOOST_CHECK(nStored < 120);
+    BOOST_CHECK(nOrphanTransactionsSize <= MAX_PEER_ORPHAN_TRANSACTIONS_SIZE);
+
+    // ... but that doesn't stop other peers
+    BOOST_CHECK(AddOrphanTx(BigOrphan(), 2));
+    BOOST_CHECK(AddOrphanTx(BigOrphan()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), nStored + 2);
+
+    // Evicting by size keeps the bookkeeping consistent
+    LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 100000);
+    BOOST_CHECK(nOrphanTransactionsSize <= 100000);
+    BOOST_CHECK_EQUAL(vOrphanList.size(), mapOrphanTransactions.size());
+    for (unsigned int i = 0; i < vOrphanList.size(); i++)
+        BOOST_CHECK_EQUAL(mapOrphanTransactions[vOrphanList[i]].nListPos, i);
+
+    // Room was freed for peer 1 again
+    BOOST_CHECK(AddOrphanTx(BigOrphan(), 1));
+
+    // A disconnecting peer takes its orphans along
+    unsigned int nOthers = 0;
+    for (unsigned int i = 0; i < vOrphanList.size(); i++)
+        if (mapOrphanTransactions[vOrphanList[i]].fromPeer != 1)
+            nOthers++;
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), nOthers);
+    BOOST_CHECK(AddOrphanTx(BigOrphan(), 1));
+
+    // An orphan that is accepted after all is dropped right away
+    CTransaction txAccepted = BigOrphan();
+    BOOST_CHECK(AddOrphanTx(txAccepted, 3));
+    unsigned int nSizeBefore = nOrphanTransactionsSize;
+    EraseOrphanTx(txAccepted.GetHash());
+    BOOST_CHECK(!mapOrphanTransactions.count(txAccepted.GetHash()));
+    BOOST_CHECK(nOrphanTransactionsSize < nSizeBefore);
+    BOOST_CHECK_EQUAL(vOrphanList.size(), mapOrphanTransactions.size());
+
+    // Expired orphans go regardless of the limits
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + 1);
+    LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+    SetMockTime(0);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -0,0 +1,71 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addressindex.h"
+#include "key.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_destination)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    int nType;
+    uint160 hashBytes;
+    CScript script;
+    script.SetDestination(keyID);
+    BOOST_CHECK(GetAddressIndexDestination(script, nType, hashBytes));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_INDEX_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == keyID);
+
+    // pay-to-pubkey outputs are indexed under the key ID too
+    script.clear();
+    script << key.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(GetAddressIndexDestination(script, nType, hashBytes));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_INDEX_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == keyID);
+
+    CScript redeem;
+    redeem << OP_1;
+    script.SetDestination(redeem.GetID());
+    BOOST_CHECK(GetAddressIndexDestination(script, nType, hashBytes));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_INDEX_SCRIPTHASH);
+
+    script.clear();
+    script << OP_RETURN;
+    BOOST_CHECK(!GetAddressIndexDestination(script, nType, hashBytes));
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hashBytes = 12345;
+    CAddressIndexKey key1(ADDRESS_INDEX_PUBKEYHASH, hashBytes, 255, 7, 1, 0, false);
+    CAddressIndexKey key2(ADDRESS_INDEX_PUBKEYHASH, hashBytes, 256, 0, 1, 0, false);
+
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << make_pair('a', key1);
+    ss2 << make_pair('a', key2);
+    BOOST_CHECK_EQUAL(ss1.size(), key1.GetSerializeSize(SER_DISK, CLIENT_VERSION) + 1);
+
+    // the database sorts keys bytewise, which must follow the height
+    BOOST_CHECK(ss1.str() < ss2.str());
+
+    // the iterator key is a prefix of the keys at its height
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair('a', CAddressIndexIteratorKey(ADDRESS_INDEX_PUBKEYHASH, hashBytes, 256));
+    BOOST_CHECK(ss2.str().compare(0, ssPrefix.size(), ssPrefix.str()) == 0);
+    BOOST_CHECK(ss1.str() < ssPrefix.str());
+
+    char ch;
+    CAddressIndexKey key3;
+    ss2 >> ch >> key3;
+    BOOST_CHECK_EQUAL(key3.nHeight, 256);
+    BOOST_CHECK_EQUAL(key3.nTxIndex, 0U);
+    BOOST_CHECK(key3.txhash == key2.txhash);
+    BOOST_CHECK(key3.hashBytes == hashBytes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+
+#include "addrman.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress RoutableAddress(unsigned int i)
+{
+    // 1.x.y.z, spread over many /16s so the entries land in many buckets
+    CService addr(strprintf("1.%u.%u.%u", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), 8333);
+    CAddress caddr(addr);
+    caddr.nTime = GetAdjustedTime() - 60;
+    return caddr;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_consistency)
+{
+    CAddrMan addrman;
+    addrman.SetCheckEntries(4);
+    CNetAddr source("250.1.2.3");
+
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < 1000; i++)
+        vAddr.push_back(RoutableAddress(i * 257));
+    // one source only gets a few buckets, so not all of them stay
+    BOOST_CHECK(addrman.Add(vAddr, source));
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 100);
+    BOOST_CHECK_EQUAL(addrman.CheckAll(), 0);
+
+    // move some to the tried table
+    for (unsigned int i = 0; i < 1000; i++)
+        addrman.Good(vAddr[i]);
+    BOOST_CHECK_EQUAL(addrman.size(), nSize);
+    BOOST_CHECK_EQUAL(addrman.CheckAll(), 0);
+
+    // every change is counted
+    uint64 nModifications = addrman.GetModifications();
+    addrman.Attempt(vAddr[500]);
+    BOOST_CHECK(addrman.GetModifications() > nModifications);
+
+    // selecting doesn't change anything
+    nModifications = addrman.GetModifications();
+    for (unsigned int i = 0; i < 100; i++)
+        BOOST_CHECK(addrman.Select().IsValid());
+    BOOST_CHECK_EQUAL(addrman.GetModifications(), nModifications);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_getaddr)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.2.3");
+
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < 1000; i++)
+        vAddr.push_back(RoutableAddress(i * 257));
+    addrman.Add(vAddr, source);
+    int nSize = addrman.size();
+
+    // GetAddr returns distinct addresses, without touching the tables
+    vector<CAddress> vGot = addrman.GetAddr();
+    BOOST_CHECK_EQUAL(vGot.size(), (unsigned int)(ADDRMAN_GETADDR_MAX_PCT * nSize / 100));
+    set<CService> setGot(vGot.begin(), vGot.end());
+    BOOST_CHECK_EQUAL(setGot.size(), vGot.size());
+    BOOST_CHECK_EQUAL(addrman.CheckAll(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.2.3");
+
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < 500; i++)
+        vAddr.push_back(RoutableAddress(i * 257));
+    addrman.Add(vAddr, source);
+    for (unsigned int i = 0; i < 50; i++)
+        addrman.Good(vAddr[i]);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    BOOST_CHECK_EQUAL(addrman2.CheckAll(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockfilter.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    CBlock block;
+    block.nTime = 1234;
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (i > 0)
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << ParseHex("0102030405060708090a0b0c0d0e0f1011121314") << i << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1].scriptPubKey << OP_RETURN << i;
+        block.vtx.push_back(tx);
+    }
+
+    CBlockFilter filter(block);
+    BOOST_CHECK(filter.GetBlockHash() == block.GetHash());
+
+    // Every output script and spent outpoint matches; OP_RETURN outputs are left out
+    vector<vector<unsigned char> > vElements;
+    CBlockFilter::GetElements(block, vElements);
+    BOOST_CHECK_EQUAL(vElements.size(), 20U + 19U);
+    BOOST_FOREACH(const vector<unsigned char>& vElement, vElements)
+        BOOST_CHECK(filter.Match(vElement));
+    BOOST_CHECK(filter.MatchAny(vElements));
+
+    // Other elements match with a chance of about 39/BLOCK_FILTER_M each, so
+    // about one in 20000 does; allow for far more than that
+    int nFalsePositives = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 hash = GetRandHash();
+        if (filter.Match(vector<unsigned char>(hash.begin(), hash.end())))
+            nFalsePositives++;
+    }
+    BOOST_CHECK(nFalsePositives <= 10);
+
+    // Serialization round trip
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << filter;
+    CBlockFilter filter2;
+    ss >> filter2;
+    BOOST_CHECK(filter2.GetEncoded() == filter.GetEncoded());
+    BOOST_CHECK(filter2.Match(vElements[0]));
+
+    // Headers chain onto the previous one
+    BOOST_CHECK(filter.GetHeader(0) != filter.GetHeader(1));
+    BOOST_CHECK(filter.GetHeader(0) == filter2.GetHeader(0));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_empty)
+{
+    CBlock block;
+    CBlockFilter filter(block);
+    BOOST_CHECK_EQUAL(filter.GetEncoded().size(), 1U);
+    BOOST_CHECK(!filter.Match(ParseHex("00")));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
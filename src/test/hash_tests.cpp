@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+
+#include "uint256.h"
+#include "hash.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hash_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // SipHash-2-4 reference key 000102..0f over the message 000102..1f
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+
+    unsigned char pch[32];
+    for (int i = 0; i < 32; i++)
+        pch[i] = i;
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, pch, 0), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, pch, 15), 0xa129ca6149be45e5ULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, pch, 32), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(murmurhash3)
+{
+
+#define T(expected, seed, data) BOOST_CHECK_EQUAL(MurmurHash3(seed, ParseHex(data)), expected)
+
+    // Test MurmurHash3 with various inputs. Of course this is retested in the
+    // bloom filter tests - they would fail if MurmurHash3() had any problems -
+    // but is useful for those trying to implement Bitcoin libraries as a
+    // source of test data for their MurmurHash3() primitive during
+    // development.
+    T(0x00000000, 0x00000000, "");
+    T(0x6a396f08, 0xFBA4C795, "");
+    T(0x81f16f39, 0xffffffff, "");
+
+    T(0x514e28b7, 0x00000000, "00");
+    T(0xea3f0b17, 0xFBA4C795, "00");
+    T(0xfd6cf10d, 0x00000000, "ff");
+
+    T(0x16c6b7ab, 0x00000000, "0011");
+    T(0x8eb51c3d, 0x00000000, "001122");
+    T(0xb4471bf8, 0x00000000, "00112233");
+    T(0xe2301fa8, 0x00000000, "0011223344");
+    T(0xfc2e4a15, 0x00000000, "001122334455");
+    T(0xb074502c, 0x00000000, "00112233445566");
+    T(0x8034d2a0, 0x00000000, "0011223344556677");
+    T(0xb4698def, 0x00000000, "001122334455667788");
+
+#undef T
+}
+
+BOOST_AUTO_TEST_CASE(murmurhash3_mixed)
+{
+    // Mixing a key once and running the rounds per seed gives the plain hash
+    for (unsigned int nLen = 0; nLen < 64; nLen++)
+    {
+        vector<unsigned char> vKey(nLen);
+        for (unsigned int i = 0; i < nLen; i++)
+            vKey[i] = (unsigned char)(insecure_rand() >> 8);
+        vector<uint32_t> vBlocks(nLen / 4 + 1);
+        uint32_t nTail;
+        MurmurHash3Mix(vKey.empty() ? NULL : &vKey[0], nLen, &vBlocks[0], nTail);
+        for (unsigned int nHashNum = 0; nHashNum < 10; nHashNum++)
+        {
+            unsigned int nSeed = nHashNum * 0xFBA4C795 + nLen;
+            BOOST_CHECK_EQUAL(MurmurHash3Mixed(nSeed, &vBlocks[0], nLen, nTail), MurmurHash3(nSeed, vKey));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,93 @@
+//
+// Unit tests for headers-first sync: which headers may replace the header chain
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+
+// Tests these internal-to-main.cpp structures and functions:
+extern std::map<uint256, CBlockIndex*> mapHeaderIndex;
+extern std::deque<CBlockIndex*> vHeaderChain;
+extern bool AcceptBlockHeaders(CValidationState &state, const std::vector<CBlock>& vHeaders, unsigned int& nAccepted);
+
+// A header on hashPrev that passes the testnet minimum difficulty rule
+static CBlock MineHeader(const uint256& hashPrev, unsigned int nTime, unsigned int nBranch)
+{
+    CBlock header;
+    header.nVersion = 2;
+    header.hashPrevBlock = hashPrev;
+    header.hashMerkleRoot = nBranch;
+    header.nTime = nTime;
+    header.nBits = CBigNum(~uint256(0) >> 10).GetCompact();
+    header.nNonce = 0;
+    while (!CheckProofOfWork(header.GetHash(), header.nBits))
+        header.nNonce++;
+    return header;
+}
+
+static bool Accept(const std::vector<CBlock>& vHeaders, unsigned int& nAccepted)
+{
+    CValidationState state;
+    return AcceptBlockHeaders(state, vHeaders, nAccepted);
+}
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+BOOST_AUTO_TEST_CASE(headers_lower_work_fork)
+{
+    fTestNet = true;
+    mapArgs["-checkpoints"] = "0";
+
+    // headers over 10 minutes apart, so each may use the minimum difficulty
+    unsigned int nTime = pindexGenesisBlock->nTime + 1000;
+    CBlock a1 = MineHeader(pindexGenesisBlock->GetBlockHash(), nTime, 1);
+    CBlock b1 = MineHeader(pindexGenesisBlock->GetBlockHash(), nTime, 2);
+    CBlock b2 = MineHeader(b1.GetHash(), nTime + 1000, 2);
+
+    unsigned int nAccepted;
+    BOOST_CHECK(Accept(std::vector<CBlock>(1, a1), nAccepted));
+    BOOST_CHECK_EQUAL(nAccepted, 1U);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 1U);
+
+    // A fork with no more work than the header chain leaves it alone
+    BOOST_CHECK(Accept(std::vector<CBlock>(1, b1), nAccepted));
+    BOOST_CHECK_EQUAL(nAccepted, 0U);
+    BOOST_CHECK(vHeaderChain.size() == 1 && vHeaderChain.back()->GetBlockHash() == a1.GetHash());
+    BOOST_CHECK(!mapHeaderIndex.count(b1.GetHash()));
+
+    // One with more work replaces it
+    std::vector<CBlock> vHeaders;
+    vHeaders.push_back(b1);
+    vHeaders.push_back(b2);
+    BOOST_CHECK(Accept(vHeaders, nAccepted));
+    BOOST_CHECK_EQUAL(nAccepted, 2U);
+    BOOST_CHECK(vHeaderChain.size() == 2 && vHeaderChain.back()->GetBlockHash() == b2.GetHash());
+    BOOST_CHECK(!mapHeaderIndex.count(a1.GetHash()));
+
+    // and the old, now lower-work, branch can't take it back
+    BOOST_CHECK(Accept(std::vector<CBlock>(1, a1), nAccepted));
+    BOOST_CHECK_EQUAL(nAccepted, 0U);
+    BOOST_CHECK(vHeaderChain.size() == 2 && vHeaderChain.back()->GetBlockHash() == b2.GetHash());
+
+    // Headers that don't follow each other are rejected
+    vHeaders.clear();
+    vHeaders.push_back(MineHeader(b2.GetHash(), nTime + 2000, 2));
+    vHeaders.push_back(MineHeader(b1.GetHash(), nTime + 3000, 3));
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!AcceptBlockHeaders(state, vHeaders, nAccepted));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS > 0);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 2U);
+
+    BOOST_FOREACH(CBlockIndex* pindex, vHeaderChain) {
+        mapHeaderIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+    vHeaderChain.clear();
+    mapArgs.erase("-checkpoints");
+    fTestNet = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,116 @@
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+
+#include "limitedmap.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(limitedmap_tests)
+
+BOOST_AUTO_TEST_CASE(limitedmap_test)
+{
+    // create a limitedmap capped at 10 items
+    limitedmap<int, int> map(10);
+
+    // check that the max size is 10
+    BOOST_CHECK(map.max_size() == 10);
+
+    // check that it's empty
+    BOOST_CHECK(map.size() == 0);
+
+    // insert (-1, -1)
+    map.insert(pair<int, int>(-1, -1));
+
+    // make sure that the size is updated
+    BOOST_CHECK(map.size() == 1);
+
+    // make sure that the new item is in the map
+    BOOST_CHECK(map.count(-1) == 1);
+
+    // insert 9 more items, the oldest is evicted when the map fills up
+    for (int i = 0; i < 9; i++)
+        map.insert(pair<int, int>(i, i + 1));
+
+    BOOST_CHECK(map.size() == 9);
+    BOOST_CHECK(map.count(-1) == 0);
+
+    // iterate over the map, both with an index and an iterator
+    limitedmap<int, int>::const_iterator it = map.begin();
+    for (int i = 0; i < 9; i++) {
+        // make sure the item is present
+        BOOST_CHECK(map.count(i) == 1);
+
+        // use the iterator to check for the expected key and value
+        BOOST_CHECK(map.find(it->first)->second == it->first + 1);
+        it++;
+    }
+    BOOST_CHECK(it == map.end());
+
+    // raise the value of the lowest item, so it survives the next eviction
+    map.update(map.find(0), 100);
+    BOOST_CHECK(map.find(0)->second == 100);
+
+    // erase an item in the middle
+    map.erase(4);
+    BOOST_CHECK(map.size() == 8);
+    BOOST_CHECK(map.count(4) == 0);
+
+    // shrink the map, this evicts the three lowest values (keys 1, 2 and 3)
+    map.max_size(5);
+    BOOST_CHECK(map.max_size() == 5);
+    BOOST_CHECK(map.size() == 5);
+    BOOST_CHECK(map.count(0) == 1);
+    BOOST_CHECK(map.count(1) == 0);
+    BOOST_CHECK(map.count(2) == 0);
+    BOOST_CHECK(map.count(3) == 0);
+    BOOST_CHECK(map.count(5) == 1);
+    BOOST_CHECK(map.count(8) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(limitedmap_random)
+{
+    // compare against a std::map with the same eviction rule, under enough
+    // updates and erases that the lazy heap has to be rebuilt several times
+    limitedmap<int, int> map(100);
+    std::map<int, int> ref;
+    for (int i = 0; i < 20000; i++)
+    {
+        int k = GetRandInt(300);
+        int v = i;
+        int nOp = GetRandInt(3);
+        if (nOp == 0)
+        {
+            map.erase(k);
+            ref.erase(k);
+        }
+        else if (nOp == 1 && map.count(k))
+        {
+            map.update(map.find(k), v);
+            ref[k] = v;
+        }
+        else if (!map.count(k))
+        {
+            map.insert(make_pair(k, v));
+            if (ref.size() == 99)
+            {
+                // values are unique, so the lowest one is well defined
+                std::map<int, int>::iterator itMin = ref.begin();
+                for (std::map<int, int>::iterator it = ref.begin(); it != ref.end(); ++it)
+                    if (it->second < itMin->second)
+                        itMin = it;
+                ref.erase(itMin);
+            }
+            ref[k] = v;
+        }
+        BOOST_CHECK_EQUAL(map.size(), ref.size());
+    }
+    for (std::map<int, int>::iterator it = ref.begin(); it != ref.end(); ++it)
+    {
+        BOOST_CHECK(map.count(it->first) == 1);
+        BOOST_CHECK(map.find(it->first)->second == it->second);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
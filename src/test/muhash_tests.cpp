@@ -0,0 +1,91 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "hash.h"
+#include "muhash.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+static vector<unsigned char> Element(int n)
+{
+    return vector<unsigned char>(1 + n % 7, (unsigned char)n);
+}
+
+BOOST_AUTO_TEST_CASE(muhash_order_independent)
+{
+    CMuHash3072 a, b;
+    for (int i = 0; i < 10; i++)
+        a.Insert(Element(i));
+    for (int i = 9; i >= 0; i--)
+        b.Insert(Element(i));
+    BOOST_CHECK(a.GetHash() == b.GetHash());
+
+    CMuHash3072 empty;
+    BOOST_CHECK(a.GetHash() != empty.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_remove)
+{
+    CMuHash3072 a, b;
+    a.Insert(Element(1));
+    a.Insert(Element(2));
+    a.Insert(Element(3));
+    a.Remove(Element(2));
+    b.Insert(Element(3));
+    b.Insert(Element(1));
+    BOOST_CHECK(a.GetHash() == b.GetHash());
+
+    // removing before inserting works too
+    CMuHash3072 c;
+    c.Remove(Element(4));
+    c.Insert(Element(1));
+    c.Insert(Element(4));
+    c.Insert(Element(3));
+    BOOST_CHECK(c.GetHash() == b.GetHash());
+
+    CMuHash3072 empty;
+    a.Remove(Element(1));
+    a.Remove(Element(3));
+    BOOST_CHECK(a.GetHash() == empty.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_combine_serialize)
+{
+    CMuHash3072 a, b, all;
+    for (int i = 0; i < 6; i++) {
+        (i % 2 ? a : b).Insert(Element(i));
+        all.Insert(Element(i));
+    }
+    a *= b;
+    BOOST_CHECK(a.GetHash() == all.GetHash());
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << a;
+    CMuHash3072 c;
+    ss >> c;
+    BOOST_CHECK(c.GetHash() == all.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_batch_by_hash)
+{
+    // a batch of changes, kept by element hash, applied with one multiplication
+    CMuHash3072 set, batch, expected;
+    for (int i = 0; i < 4; i++)
+        set.Insert(Element(i));
+    vector<unsigned char> vch = Element(1);
+    batch.RemoveHash(Hash(vch.begin(), vch.end()));
+    vch = Element(5);
+    batch.InsertHash(Hash(vch.begin(), vch.end()));
+    set *= batch;
+
+    expected.Insert(Element(0));
+    expected.Insert(Element(2));
+    expected.Insert(Element(3));
+    expected.Insert(Element(5));
+    BOOST_CHECK(set.GetHash() == expected.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
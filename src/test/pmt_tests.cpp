@@ -64,6 +64,12 @@ BOOST_AUTO_TEST_CASE(pmt_test1)
             CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
             ss << pmt1;
 
+            // building from the block's complete merkle tree gives the same result
+            CPartialMerkleTree pmt4(block.vMerkleTree, nTx, vMatch);
+            CDataStream ss4(SER_NETWORK, PROTOCOL_VERSION);
+            ss4 << pmt4;
+            BOOST_CHECK(ss.str() == ss4.str());
+
             // verify CPartialMerkleTree's size guarantees
             unsigned int n = std::min<unsigned int>(nTx, 1 + vMatchTxid1.size()*Vcoinh);
             BOOST_CHECK(ss.size() <= 10 + (258*n+7)/8);
@@ -0,0 +1,91 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(relaycache_tests)
+
+static CSerializeDataRef MakeMessage(unsigned int nPayload)
+{
+    CDataStream ssMsg = BeginSerializedMessage("tx");
+    ssMsg << vector<unsigned char>(nPayload, 0x42);
+    return EndSerializedMessage(ssMsg);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_shared)
+{
+    CRelayCache cache(1000000);
+    CInv inv(MSG_TX, GetRandHash());
+    CSerializeDataRef msg = MakeMessage(100);
+    cache.Insert(inv, msg);
+    BOOST_CHECK(cache.size() == 1);
+    BOOST_CHECK(cache.GetBytes() == msg->size());
+
+    // The cached payload is the same object, not a copy
+    BOOST_CHECK(cache.Find(inv) == msg);
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, GetRandHash())));
+    BOOST_CHECK(!cache.Find(CInv(MSG_BLOCK, inv.hash)));
+
+    // An earlier message for the same inventory is kept
+    cache.Insert(inv, MakeMessage(200));
+    BOOST_CHECK(cache.Find(inv) == msg);
+    BOOST_CHECK(cache.GetBytes() == msg->size());
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_bytelimit)
+{
+    CSerializeDataRef msg = MakeMessage(1000);
+    CRelayCache cache(msg->size() * 10);
+    vector<CInv> vInv;
+    for (int i = 0; i < 15; i++)
+    {
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+        cache.Insert(vInv.back(), msg);
+    }
+    // The oldest five were dropped to stay within the limit
+    BOOST_CHECK(cache.size() == 10);
+    BOOST_CHECK(cache.GetBytes() == msg->size() * 10);
+    for (int i = 0; i < 15; i++)
+        BOOST_CHECK(!cache.Find(vInv[i]) == (i < 5));
+
+    // Lowering the limit drops more of the oldest entries
+    cache.SetMaxBytes(msg->size() * 3);
+    BOOST_CHECK(cache.size() == 3);
+    BOOST_CHECK(cache.Find(vInv[14]));
+    BOOST_CHECK(!cache.Find(vInv[11]));
+
+    // A single message larger than the limit is still kept until the next one
+    CRelayCache small(10);
+    small.Insert(vInv[0], msg);
+    BOOST_CHECK(small.Find(vInv[0]));
+    small.Insert(vInv[1], msg);
+    BOOST_CHECK(!small.Find(vInv[0]));
+    BOOST_CHECK(small.Find(vInv[1]));
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_expiry)
+{
+    int64 nStart = GetTime();
+    SetMockTime(nStart);
+    CRelayCache cache(1000000);
+    CInv inv1(MSG_TX, GetRandHash());
+    CInv inv2(MSG_TX, GetRandHash());
+    cache.Insert(inv1, MakeMessage(10));
+
+    SetMockTime(nStart + CRelayCache::RELAY_EXPIRY / 2);
+    cache.Insert(inv2, MakeMessage(10));
+    BOOST_CHECK(cache.size() == 2);
+
+    // Expired entries are dropped on the next insert
+    SetMockTime(nStart + CRelayCache::RELAY_EXPIRY + 1);
+    cache.Insert(CInv(MSG_TX, GetRandHash()), MakeMessage(10));
+    BOOST_CHECK(!cache.Find(inv1));
+    BOOST_CHECK(cache.Find(inv2));
+    BOOST_CHECK(cache.size() == 2);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -20,11 +20,55 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+void static BatchWriteCoinsTotals(CLevelDBBatch &batch, const CCoinsTotals &totals) {
+    batch.Write('S', totals);
+}
+
+// The set hash commits to the records exactly as they are stored
+CCoinsOrigin::CCoinsOrigin(const uint256 &txid, const CCoins &coins) : fExists(true), nOutputs(0), nAmount(0) {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txid;
+    ss << coins;
+    hashRecord = Hash(ss.begin(), ss.end());
+    nValueSize = ss.size() - sizeof(txid);
+    BOOST_FOREACH(const CTxOut &out, coins.vout) {
+        if (!out.IsNull()) {
+            nOutputs++;
+            nAmount += out.nValue;
+        }
+    }
+}
+
+void CCoinsTotals::Add(const uint256 &txid, const CCoins &coins) {
+    Add(CCoinsOrigin(txid, coins), muhash);
+}
+
+void CCoinsTotals::Add(const CCoinsOrigin &record, CMuHash3072 &muhashBatch) {
+    muhashBatch.InsertHash(record.hashRecord);
+    nTransactions++;
+    nSerializedSize += 32 + record.nValueSize;
+    nTransactionOutputs += record.nOutputs;
+    nTotalAmount += record.nAmount;
+}
+
+void CCoinsTotals::Remove(const CCoinsOrigin &record, CMuHash3072 &muhashBatch) {
+    muhashBatch.RemoveHash(record.hashRecord);
+    nTransactions--;
+    nSerializedSize -= 32 + record.nValueSize;
+    nTransactionOutputs -= record.nOutputs;
+    nTotalAmount -= record.nAmount;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", CLevelDBTuning("chainstate", nCacheSize, DEFAULT_CHAINSTATE_MAX_OPEN_FILES), fMemory, fWipe) {
+    // An empty database has nothing to count
+    fTotalsValid = db.Read('S', totals) || !db.Exists('B');
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
-    return db.Read(make_pair('c', txid), coins); 
+    if (!db.Read(make_pair('c', txid), coins))
+        return false;
+    coins.origin = CCoinsOrigin(txid, coins);
+    return true;
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
@@ -57,15 +101,43 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockI
     printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
 
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+    CCoinsTotals totalsNew = totals;
+    CMuHash3072 muhashBatch;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (fTotalsValid) {
+            // the entries know what was read for them, so the old records
+            // don't have to be read again
+            const CCoinsOrigin &originOld = it->second.origin;
+            if (it->second.IsPruned()) {
+                if (originOld.fExists)
+                    totalsNew.Remove(originOld, muhashBatch);
+            } else {
+                // the cache hands back what it only read as well, skip those
+                CCoinsOrigin originNew(it->first, it->second);
+                if (!originOld.fExists || originOld.hashRecord != originNew.hashRecord) {
+                    if (originOld.fExists)
+                        totalsNew.Remove(originOld, muhashBatch);
+                    totalsNew.Add(originNew, muhashBatch);
+                }
+            }
+        }
         BatchWriteCoins(batch, it->first, it->second);
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+    if (fTotalsValid) {
+        totalsNew.muhash *= muhashBatch;
+        BatchWriteCoinsTotals(batch, totalsNew);
+    }
 
-    return db.WriteBatch(batch);
+    if (!db.WriteBatch(batch))
+        return false;
+    if (fTotalsValid)
+        totals = totalsNew;
+    return true;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", CLevelDBTuning("blockindex", nCacheSize), fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -111,14 +183,13 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+// Count the totals of a database written before they were kept, once
+bool CCoinsViewDB::CountTotals() {
+    printf("Counting the coin database totals...\n");
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
+    CCoinsTotals totalsNew;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -133,35 +204,112 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.Vcoinh);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                totalsNew.Add(txhash, coins);
             }
             pcursor->Next();
         } catch (std::exception &e) {
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
     delete pcursor;
-    stats.Vcoinh = GetBestBlock()->Vcoinh;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+
+    CLevelDBBatch batch;
+    BatchWriteCoinsTotals(batch, totalsNew);
+    if (!db.WriteBatch(batch))
+        return false;
+    totals = totalsNew;
+    fTotalsValid = true;
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    CBlockIndex *pindexBest = GetBestBlock();
+    if (pindexBest == NULL)
+        return false;
+    if (!fTotalsValid && !CountTotals())
+        return false;
+
+    stats.Vcoinh = pindexBest->Vcoinh;
+    stats.hashBlock = pindexBest->GetBlockHash();
+    stats.nTransactions = totals.nTransactions;
+    stats.nTransactionOutputs = totals.nTransactionOutputs;
+    stats.nSerializedSize = totals.nSerializedSize;
+    stats.nTotalAmount = totals.nTotalAmount;
+    stats.hashMuHash = totals.muhash.GetHash();
+    return true;
+}
+
+CCoinsView *CCoinsViewDB::NewSnapshot() {
+    return new CCoinsViewDBSnapshot(db);
+}
+
+CCoinsViewDBSnapshot::CCoinsViewDBSnapshot(CLevelDB &dbIn) : db(dbIn), pindexBest(NULL) {
+    psnapshot = db.GetSnapshot();
+    uint256 hashBestChain;
+    if (db.Read('B', hashBestChain, psnapshot)) {
+        std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+        if (it != mapBlockIndex.end())
+            pindexBest = it->second;
+    }
+}
+
+CCoinsViewDBSnapshot::~CCoinsViewDBSnapshot() {
+    db.ReleaseSnapshot(psnapshot);
+}
+
+bool CCoinsViewDBSnapshot::GetCoins(const uint256 &txid, CCoins &coins) {
+    return db.Read(make_pair('c', txid), coins, psnapshot);
+}
+
+bool CCoinsViewDBSnapshot::HaveCoins(const uint256 &txid) {
+    return db.Exists(make_pair('c', txid), psnapshot);
+}
+
+CBlockIndex *CCoinsViewDBSnapshot::GetBestBlock() {
+    return pindexBest;
+}
+
+bool static DumpCoinsRecords(leveldb::Iterator *pcursor, CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) {
+    pcursor->SeekToFirst();
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType == 'c') {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                uint256 txhash;
+                ssKey >> txhash;
+                // the stored form already uses CTxOutCompressor, keep it as is
+                fileout << txhash << coins;
+                hasher << txhash << coins;
+                header.nCoins++;
+            }
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : %s", __PRETTY_FUNCTION__, e.what());
+        }
+    }
+    delete pcursor;
     return true;
 }
 
+bool CCoinsViewDB::DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) {
+    return DumpCoinsRecords(db.NewIterator(), fileout, hasher, header);
+}
+
+bool CCoinsViewDBSnapshot::DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header) {
+    return DumpCoinsRecords(db.NewIterator(psnapshot), fileout, hasher, header);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
@@ -173,6 +321,117 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> >&vect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> >&vect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Erase(make_pair('a', it->first));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160 &hashBytes, int nType, std::vector<std::pair<CAddressIndexKey, int64> > &vect,
+                                    int nStart, int nEnd) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexIteratorKey(nType, hashBytes, nStart));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != 'a')
+                break;
+            ssKey >> key;
+            if (key.nType != nType || key.hashBytes != hashBytes || (nEnd > 0 && key.nHeight > nEnd))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64 nValue;
+            ssValue >> nValue;
+            vect.push_back(make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >&vect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160 &hashBytes, int nType, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentIteratorKey(nType, hashBytes));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> key;
+            if (key.nType != nType || key.hashBytes != hashBytes)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vect.push_back(make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value) {
+    return Read(make_pair('p', key), value);
+}
+
+bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -261,3 +520,28 @@ bool CBlockTreeDB::WriteCheckpointPubKey(const string& strPubKey)
 {
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "filter", CLevelDBTuning("blockfilter", nCacheSize), fMemory, fWipe) {
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256 &hash, CBlockFilter &filter) {
+    return Read(make_pair('f', hash), filter);
+}
+
+bool CBlockFilterDB::ReadFilterHeader(const uint256 &hash, uint256 &header, uint256 &hashFilter) {
+    std::pair<uint256, uint256> value;
+    if (!Read(make_pair('h', hash), value))
+        return false;
+    header = value.first;
+    hashFilter = value.second;
+    return true;
+}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter &filter, const uint256 &header) {
+    // Filters are keyed by block hash, so blocks that get disconnected keep
+    // valid entries and nothing needs undoing on a reorganization
+    CLevelDBBatch batch;
+    batch.Write(make_pair('f', filter.GetBlockHash()), filter);
+    batch.Write(make_pair('h', filter.GetBlockHash()), make_pair(header, filter.GetHash()));
+    return WriteBatch(batch);
+}
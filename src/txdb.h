@@ -7,12 +7,54 @@
 
 #include "main.h"
 #include "leveldb.h"
+#include "blockfilter.h"
+#include "addressindex.h"
+#include "spentindex.h"
+#include "muhash.h"
+
+/** The chainstate is read all over its key range, so it keeps more table
+ * files open than the other databases (-chainstate.maxopenfiles) */
+static const int DEFAULT_CHAINSTATE_MAX_OPEN_FILES = 1000;
+
+/** Running totals over the records of the coin database, kept up to date
+ * by every BatchWrite so that gettxoutsetinfo doesn't have to scan it */
+class CCoinsTotals
+{
+public:
+    uint64 nTransactions;
+    uint64 nTransactionOutputs;
+    uint64 nSerializedSize;
+    int64 nTotalAmount;
+    CMuHash3072 muhash;
+
+    CCoinsTotals() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    )
+
+    void Add(const uint256 &txid, const CCoins &coins);
+
+    // Count a record in or out, with its set hash going to muhashBatch
+    // instead, so that a batch of changes is multiplied into muhash once
+    void Add(const CCoinsOrigin &record, CMuHash3072 &muhashBatch);
+    void Remove(const CCoinsOrigin &record, CMuHash3072 &muhashBatch);
+};
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+    // false until the totals have been counted once (databases from before they existed)
+    bool fTotalsValid;
+    CCoinsTotals totals;
+
+    bool CountTotals();
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -23,6 +65,27 @@ public:
     bool SetBestBlock(CBlockIndex *pindex);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    bool DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header);
+    CCoinsView *NewSnapshot();
+};
+
+/** Read-only CCoinsView of the coin database at the moment it was created,
+ * through a LevelDB snapshot. The best block is resolved once, at creation,
+ * so create it with cs_main held; reads afterwards need no locks. */
+class CCoinsViewDBSnapshot : public CCoinsView
+{
+protected:
+    CLevelDB &db;
+    const leveldb::Snapshot *psnapshot;
+    CBlockIndex *pindexBest;
+public:
+    CCoinsViewDBSnapshot(CLevelDB &dbIn);
+    ~CCoinsViewDBSnapshot();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool DumpCoins(CAutoFile &fileout, CHashWriter &hasher, CCoinsSnapshotHeader &header);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -45,6 +108,14 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vect);
+    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vect);
+    bool ReadAddressIndex(const uint160 &hashBytes, int nType, std::vector<std::pair<CAddressIndexKey, int64> > &vect,
+                          int nStart = 0, int nEnd = 0);
+    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadAddressUnspentIndex(const uint160 &hashBytes, int nType, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
+    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vect);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -54,4 +125,18 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
 };
 
+/** Access to the compact block filter index (blocks/filter/) */
+class CBlockFilterDB : public CLevelDB
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+public:
+    bool ReadFilter(const uint256 &hash, CBlockFilter &filter);
+    bool ReadFilterHeader(const uint256 &hash, uint256 &header, uint256 &hashFilter);
+    bool WriteFilter(const CBlockFilter &filter, const uint256 &header);
+};
+
 #endif // BITCOIN_TXDB_LEVELDB_H